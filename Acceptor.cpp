@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include "Acceptor.h"
+#include "FdManager.h"
+
+Acceptor::Listener::~Listener()
+{
+    if(fd >= 0) ::close(fd);
+}
+
+Acceptor::Acceptor(IOManager *iom, Handler handler, const AcceptorOptions &options)
+    : m_shared(new Shared)
+{
+    m_shared->iom = iom;
+    m_shared->handler = std::move(handler);
+    m_shared->options = options;
+    if(m_shared->options.batch == 0) m_shared->options.batch = 1;
+}
+
+Acceptor::~Acceptor()
+{
+    stop();
+}
+
+bool Acceptor::bind(const sockaddr *addr, socklen_t addrlen)
+{
+    size_t count = m_shared->options.reuse_port ? m_shared->iom->getWorkerCount() : 1;
+    sockaddr_storage bound;
+    memcpy(&bound, addr, addrlen);
+    for(size_t i = 0; i < count; ++i)
+    {
+        Listener::ptr listener(new Listener);
+        listener->fd = ::socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listener->fd < 0)
+        {
+            m_listeners.clear();
+            return false;
+        }
+        int yes = 1;
+        setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if((m_shared->options.reuse_port && setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)))
+           || ::bind(listener->fd, reinterpret_cast<sockaddr *>(&bound), addrlen)
+           || ::listen(listener->fd, m_shared->options.backlog))
+        {
+            int err = errno;
+            m_listeners.clear();
+            errno = err;
+            return false;
+        }
+        if(i == 0 && count > 1)
+        { // 端口为0时第一个socket绑定到了一个随机端口，其余的socket要绑定到同一个端口上
+            socklen_t len = addrlen;
+            getsockname(listener->fd, reinterpret_cast<sockaddr *>(&bound), &len);
+        }
+        m_listeners.push_back(listener);
+    }
+    return true;
+}
+
+std::vector<int> Acceptor::getListenFds() const
+{
+    std::vector<int> fds;
+    for(auto &listener : m_listeners) fds.push_back(listener->fd);
+    return fds;
+}
+
+void Acceptor::start()
+{
+    if(m_started)
+    {
+        return;
+    }
+    m_started = true;
+    IOManager *iom = m_shared->iom;
+    for(size_t i = 0; i < m_listeners.size(); ++i)
+    {
+        std::function<void()> loop = std::bind(&Acceptor::AcceptLoop, m_shared, m_listeners[i]);
+        if(m_shared->options.reuse_port)
+        { // 每个监听socket的接收协程从对应的工作线程开始运行，per_worker_epoll时socket注册在这个线程的epoll上
+            iom->schedule(loop, iom->getWorkerThreadId(i % iom->getWorkerCount()));
+        }
+        else iom->schedule(loop);
+    }
+}
+
+void Acceptor::stop()
+{
+    if(m_shared->stopping.exchange(true))
+    {
+        return;
+    }
+    // 先设置停止标记再shutdown，被唤醒的接收协程一定能看到停止标记
+    // 监听socket的引用还在，这里不会操作已经关闭的fd
+    for(auto &listener : m_listeners)
+    {
+        ::shutdown(listener->fd, SHUT_RDWR);
+    }
+    m_listeners.clear();
+}
+
+int Acceptor::Drain(Shared &shared, int listen_fd)
+{
+    std::vector<std::function<void()>> handlers;
+    int err = 0;
+    for(;;)
+    {
+        int fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0)
+        {
+            err = errno;
+            if(err == EINTR || err == ECONNABORTED || err == EPROTO)
+            { // 连接在取出之前就被对端重置了，继续取下一个
+                continue;
+            }
+            break;
+        }
+        FdMgr::GetInstance()->get(fd, true); // 注册fd，处理协程可以直接使用hook的读写
+        if(shared.iom->getOptions().socket_busy_poll.count() > 0)
+        {
+            int us = static_cast<int>(shared.iom->getOptions().socket_busy_poll.count());
+            setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+        }
+        ++shared.accepted;
+        handlers.emplace_back(std::bind(shared.handler, fd));
+        if(handlers.size() >= shared.options.batch)
+        {
+            shared.iom->scheduleBatch(handlers.begin(), handlers.end());
+            handlers.clear();
+        }
+    }
+    if(!handlers.empty())
+    {
+        shared.iom->scheduleBatch(handlers.begin(), handlers.end());
+    }
+    return err;
+}
+
+void Acceptor::AcceptLoop(std::shared_ptr<Shared> shared, Listener::ptr listener)
+{
+    IOManager *iom = shared->iom;
+    int listen_fd = listener->fd;
+    bool exhausted = false;     // 是否处在资源耗尽的重试中，一次连续的失败只打印一次
+    while(!shared->stopping)
+    {
+        int err = Drain(*shared, listen_fd);
+        if(err == EAGAIN || err == EWOULDBLOCK)
+        { // backlog已经取完，等待新的连接。只有第一次需要epoll_ctl注册，之后是否重新注册取决于IOManager的注册方式
+            exhausted = false;
+            if(iom->addEvent(listen_fd, IOManager::READ))
+            {
+                break;
+            }
+            Fiber::GetThis()->yield();
+        }
+        else if(err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM)
+        { // fd或者内存耗尽，连接留在backlog中，等一会儿再取，避免忙循环
+            if(!exhausted)
+            {
+                std::cerr << "Acceptor: accept4 failed: " << strerror(err) << ", retry every 10ms" << std::endl;
+                exhausted = true;
+            }
+            Fiber::ptr fiber = Fiber::GetThis();
+            iom->addTimer(std::chrono::milliseconds(10), [iom, fiber](){ iom->schedule(fiber); });
+            fiber.reset();
+            Fiber::GetThis()->yield();
+        }
+        else
+        { // 监听socket被stop关闭(EINVAL)或者出现了其他错误
+            break;
+        }
+    }
+    // 持久注册模式下要先从epoll中删除，最后一个引用释放时关闭socket
+    iom->cancalAll(listen_fd);
+}
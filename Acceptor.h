@@ -0,0 +1,87 @@
+// 连接接收器
+// 监听socket可读时用accept4一次取完backlog中所有的连接，每个连接交给一个处理协程
+
+#pragma once
+#include <sys/socket.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "IOManager.h"
+
+// Acceptor的可选配置
+struct AcceptorOptions
+{
+    int backlog = SOMAXCONN;    // listen的backlog
+
+    // 每个工作线程一个设置了SO_REUSEPORT的监听socket，内核按照四元组的哈希把新连接分散到各个socket上
+    // 每个socket的接收协程第一次运行在对应的工作线程上，配合per_worker_epoll时socket的事件也由这个线程检测
+    // 默认只有一个监听socket
+    bool reuse_port = false;
+
+    // 一次最多取多少个连接再批量调度处理协程，取完backlog之前会分多批提交
+    size_t batch = 64;
+};
+
+// 接收到的连接是非阻塞、close-on-exec的，已经在FdManager中注册，处理协程里可以直接使用hook的读写
+// 处理函数负责关闭连接
+class Acceptor
+{
+public:
+    typedef std::shared_ptr<Acceptor> ptr;
+    typedef std::function<void(int fd)> Handler;
+
+    Acceptor(IOManager *iom, Handler handler, const AcceptorOptions &options = AcceptorOptions());
+
+    // 析构时停止接收，监听socket在接收协程退出之后关闭
+    ~Acceptor();
+
+    Acceptor(const Acceptor &) = delete;
+    Acceptor &operator=(const Acceptor &) = delete;
+
+    // 创建监听socket并绑定到addr，reuse_port时创建和工作线程一样多的socket
+    // 失败时返回false，errno为出错的系统调用设置的值
+    bool bind(const sockaddr *addr, socklen_t addrlen);
+
+    // 为每个监听socket启动一个接收协程
+    void start();
+
+    // 停止接收，shutdown监听socket唤醒等待中的接收协程
+    void stop();
+
+    // 已经接收的连接数量
+    uint64_t getAcceptedCount() const { return m_shared->accepted; }
+
+    // 监听socket，bind之后有效
+    std::vector<int> getListenFds() const;
+
+private:
+    // 接收协程和Acceptor共享的状态，Acceptor析构之后还没退出的接收协程仍然可以安全访问
+    struct Shared
+    {
+        IOManager *iom = nullptr;
+        Handler handler;
+        AcceptorOptions options;
+        std::atomic<bool> stopping {false};     // 是否正在停止
+        std::atomic<uint64_t> accepted {0};     // 已经接收的连接数量
+    };
+
+    // 监听socket，Acceptor和接收协程都不再使用时关闭
+    struct Listener
+    {
+        typedef std::shared_ptr<Listener> ptr;
+        int fd = -1;
+        ~Listener();
+    };
+
+    // 接收协程：取完backlog中的连接，然后等待监听socket可读，停止时关闭监听socket
+    static void AcceptLoop(std::shared_ptr<Shared> shared, Listener::ptr listener);
+
+    // 从监听socket中取出所有连接，返回让accept4停下来的errno，取完时为EAGAIN
+    static int Drain(Shared &shared, int listen_fd);
+
+private:
+    std::shared_ptr<Shared> m_shared;
+    std::vector<Listener::ptr> m_listeners;     // 监听socket
+    bool m_started = false;                     // 接收协程是否已经启动
+};
@@ -0,0 +1,293 @@
+// 协程通道
+// 有界多生产者多消费者通道，缓冲区满时send挂起当前协程，缓冲区空时recv挂起当前协程
+
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include "FiberSync.h"
+
+// 缓冲区是Vyukov有界MPMC环形队列，收发不需要加锁
+// 只有需要挂起或者有协程在等待时才使用自旋锁操作等待队列
+// close之后不能再send，recv可以继续取出缓冲区中剩下的数据，取完之后返回false
+// 挂起的send/recv可以被协程的截止时间和取消令牌打断，这时返回false，errno为ETIMEDOUT/ECANCELED
+template <typename T>
+class Channel
+{
+public:
+    typedef std::shared_ptr<Channel> ptr;
+
+    // 容量会向上取整为2的幂，最小为1
+    explicit Channel(size_t capacity)
+    {
+        size_t cap = 1;
+        while(cap < capacity) cap <<= 1;
+        m_mask = cap - 1;
+        m_cells = new Cell[cap];
+        for(size_t i = 0; i < cap; ++i)
+        {
+            m_cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~Channel()
+    {
+        // 析构缓冲区中剩下的数据
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        for(size_t pos = m_head.load(std::memory_order_relaxed); pos != tail; ++pos)
+        {
+            m_cells[pos & m_mask].data()->~T();
+        }
+        delete [] m_cells;
+    }
+
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    // 发送数据，缓冲区满时挂起当前协程，通道已关闭或者等待被打断时返回false
+    bool send(const T &value)
+    {
+        T copy(value);
+        return send(std::move(copy));
+    }
+
+    bool send(T &&value)
+    {
+        for(;;)
+        {
+            if(m_closed.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            if(push(value))
+            {
+                notify(m_recvWaiting, m_receivers);
+                return true;
+            }
+
+            // 先登记等待再重试一次，和recv中先取出数据再检查等待的发送者配合，不会丢失唤醒
+            m_lock.lock();
+            ++m_sendWaiting;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(m_closed.load(std::memory_order_relaxed) || push(value))
+            {
+                bool closed = m_closed.load(std::memory_order_relaxed);
+                --m_sendWaiting;
+                m_lock.unlock();
+                if(closed) return false;
+                notify(m_recvWaiting, m_receivers);
+                return true;
+            }
+            m_senders.push();
+            m_lock.unlock();
+            if(FiberWaitQueue::SuspendInterruptible(m_lock, m_senders, &m_sendWaiting))
+            {
+                return false;
+            }
+        }
+    }
+
+    // 接收数据，缓冲区空时挂起当前协程，通道已关闭并且缓冲区为空或者等待被打断时返回false
+    bool recv(T &value)
+    {
+        for(;;)
+        {
+            if(pop(value))
+            {
+                notify(m_sendWaiting, m_senders);
+                return true;
+            }
+            if(m_closed.load(std::memory_order_acquire))
+            { // 关闭之前发送的数据可能刚刚写完，再取一次
+                if(pop(value))
+                {
+                    notify(m_sendWaiting, m_senders);
+                    return true;
+                }
+                return false;
+            }
+
+            m_lock.lock();
+            ++m_recvWaiting;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if(pop(value))
+            {
+                --m_recvWaiting;
+                m_lock.unlock();
+                notify(m_sendWaiting, m_senders);
+                return true;
+            }
+            if(m_closed.load(std::memory_order_relaxed))
+            {
+                --m_recvWaiting;
+                m_lock.unlock();
+                return false;
+            }
+            m_receivers.push();
+            m_lock.unlock();
+            if(FiberWaitQueue::SuspendInterruptible(m_lock, m_receivers, &m_recvWaiting))
+            {
+                return false;
+            }
+        }
+    }
+
+    // 非阻塞发送，缓冲区满或者通道已关闭时返回false
+    bool try_send(const T &value)
+    {
+        T copy(value);
+        return try_send(std::move(copy));
+    }
+
+    bool try_send(T &&value)
+    {
+        if(m_closed.load(std::memory_order_acquire) || !push(value))
+        {
+            return false;
+        }
+        notify(m_recvWaiting, m_receivers);
+        return true;
+    }
+
+    // 非阻塞接收，缓冲区空时返回false
+    bool try_recv(T &value)
+    {
+        if(!pop(value))
+        {
+            return false;
+        }
+        notify(m_sendWaiting, m_senders);
+        return true;
+    }
+
+    // 关闭通道，唤醒所有等待的协程
+    void close()
+    {
+        std::deque<FiberWaitQueue::Waiter> waiters;
+        m_lock.lock();
+        m_closed.store(true, std::memory_order_release);
+        m_senders.popAll(waiters);
+        std::deque<FiberWaitQueue::Waiter> receivers;
+        m_receivers.popAll(receivers);
+        m_sendWaiting = 0;
+        m_recvWaiting = 0;
+        m_lock.unlock();
+        for(auto &waiter : waiters) FiberWaitQueue::Wake(waiter);
+        for(auto &waiter : receivers) FiberWaitQueue::Wake(waiter);
+    }
+
+    bool isClosed() const { return m_closed.load(std::memory_order_acquire); }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // 缓冲区中数据数量的近似值
+    size_t size() const
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    // 环形队列的槽位，seq表示槽位的状态：等于写入位置时可写，等于写入位置+1时可读
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *data() { return reinterpret_cast<T *>(storage); }
+    };
+
+    // 写入缓冲区，缓冲区满时返回false，value不会被移走
+    bool push(T &value)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell &cell = m_cells[pos & m_mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if(diff == 0)
+            {
+                if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    new (cell.data()) T(std::move(value));
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            { // 槽位还没被读走，缓冲区满
+                return false;
+            }
+            else
+            {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // 从缓冲区读取，缓冲区空时返回false
+    bool pop(T &value)
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            Cell &cell = m_cells[pos & m_mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if(diff == 0)
+            {
+                if(m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(*cell.data());
+                    cell.data()->~T();
+                    cell.seq.store(pos + m_mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(diff < 0)
+            { // 槽位还没写入，缓冲区空
+                return false;
+            }
+            else
+            {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // 有协程在等待时唤醒其中一个
+    void notify(std::atomic<size_t> &waiting, FiberWaitQueue &queue)
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiting.load(std::memory_order_relaxed) == 0)
+        {
+            return;
+        }
+        FiberWaitQueue::Waiter waiter;
+        m_lock.lock();
+        bool found = queue.pop(waiter);
+        if(found) --waiting;
+        m_lock.unlock();
+        if(found)
+        {
+            FiberWaitQueue::Wake(waiter);
+        }
+    }
+
+private:
+    Cell *m_cells = nullptr;
+    size_t m_mask = 0;
+    alignas(64) std::atomic<size_t> m_tail {0};     // 写入位置
+    alignas(64) std::atomic<size_t> m_head {0};     // 读取位置
+    alignas(64) std::atomic<bool> m_closed {false};
+    std::atomic<size_t> m_sendWaiting {0};          // 等待发送的协程数量
+    std::atomic<size_t> m_recvWaiting {0};          // 等待接收的协程数量
+    Spinlock m_lock;                                // 保护两个等待队列
+    FiberWaitQueue m_senders;
+    FiberWaitQueue m_receivers;
+};
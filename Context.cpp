@@ -0,0 +1,183 @@
+#include <cstdint>
+#include <cstdlib>
+#include "Context.h"
+#include "Fiber.h"
+
+#ifdef FIBER_USE_UCONTEXT
+
+void Context::init()
+{
+    if(getcontext(&m_ctx))
+    {
+        error_handling("getcontext error");
+    }
+}
+
+void Context::make(void *stack, size_t size, EntryFunc entry)
+{
+    if(getcontext(&m_ctx))
+    {
+        error_handling("getcontext error");
+    }
+    m_ctx.uc_link = nullptr;
+    m_ctx.uc_stack.ss_sp = stack;
+    m_ctx.uc_stack.ss_size = size;
+    makecontext(&m_ctx, entry, 0);
+}
+
+void Context::Swap(Context &from, Context &to)
+{
+    if(swapcontext(&from.m_ctx, &to.m_ctx))
+    {
+        error_handling("swapcontext error");
+    }
+}
+
+const char *Context::BackendName()
+{
+    return "ucontext";
+}
+
+#else
+
+extern "C"
+{
+    // 保存callee-saved寄存器到当前栈上，把栈顶写入*from_sp，然后切换到to_sp并恢复寄存器
+    void fiber_context_switch(void **from_sp, void *to_sp);
+
+    // 新上下文第一次被切换进来时的入口，调用保存在寄存器中的入口函数
+    void fiber_context_trampoline();
+}
+
+#if defined(__x86_64__)
+// 栈布局(低地址 -> 高地址): x87控制字, MXCSR, r15, r14, r13, r12, rbx, rbp, 返回地址
+__asm__(
+    ".text\n"
+    ".globl fiber_context_switch\n"
+    ".hidden fiber_context_switch\n"
+    ".type fiber_context_switch, @function\n"
+    "fiber_context_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $16, %rsp\n"
+    "    stmxcsr 8(%rsp)\n"
+    "    fnstcw (%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    fldcw (%rsp)\n"
+    "    ldmxcsr 8(%rsp)\n"
+    "    addq $16, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size fiber_context_switch, .-fiber_context_switch\n"
+
+    ".globl fiber_context_trampoline\n"
+    ".hidden fiber_context_trampoline\n"
+    ".type fiber_context_trampoline, @function\n"
+    "fiber_context_trampoline:\n"
+    "    callq *%rbx\n"
+    "    ud2\n"
+    ".size fiber_context_trampoline, .-fiber_context_trampoline\n"
+);
+
+void Context::make(void *stack, size_t size, EntryFunc entry)
+{
+    // 栈顶按16字节对齐，trampoline中call之前rsp必须16字节对齐
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~static_cast<uintptr_t>(15);
+    uint64_t *sp = reinterpret_cast<uint64_t *>(top - 72);
+    sp[0] = 0x037F;                                             // x87控制字默认值
+    sp[1] = 0x1F80;                                             // MXCSR默认值
+    sp[2] = sp[3] = sp[4] = sp[5] = 0;                          // r15 r14 r13 r12
+    sp[6] = reinterpret_cast<uint64_t>(entry);                  // rbx，trampoline的调用目标
+    sp[7] = 0;                                                  // rbp
+    sp[8] = reinterpret_cast<uint64_t>(&fiber_context_trampoline); // 返回地址
+    m_sp = sp;
+}
+
+#elif defined(__aarch64__)
+// 栈布局(低地址 -> 高地址): d8-d15, x19-x28, x29(fp), x30(lr)，共160字节
+__asm__(
+    ".text\n"
+    ".globl fiber_context_switch\n"
+    ".hidden fiber_context_switch\n"
+    ".type fiber_context_switch, %function\n"
+    "fiber_context_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp d8, d9, [sp, #0]\n"
+    "    stp d10, d11, [sp, #16]\n"
+    "    stp d12, d13, [sp, #32]\n"
+    "    stp d14, d15, [sp, #48]\n"
+    "    stp x19, x20, [sp, #64]\n"
+    "    stp x21, x22, [sp, #80]\n"
+    "    stp x23, x24, [sp, #96]\n"
+    "    stp x25, x26, [sp, #112]\n"
+    "    stp x27, x28, [sp, #128]\n"
+    "    stp x29, x30, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp d8, d9, [sp, #0]\n"
+    "    ldp d10, d11, [sp, #16]\n"
+    "    ldp d12, d13, [sp, #32]\n"
+    "    ldp d14, d15, [sp, #48]\n"
+    "    ldp x19, x20, [sp, #64]\n"
+    "    ldp x21, x22, [sp, #80]\n"
+    "    ldp x23, x24, [sp, #96]\n"
+    "    ldp x25, x26, [sp, #112]\n"
+    "    ldp x27, x28, [sp, #128]\n"
+    "    ldp x29, x30, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size fiber_context_switch, .-fiber_context_switch\n"
+
+    ".globl fiber_context_trampoline\n"
+    ".hidden fiber_context_trampoline\n"
+    ".type fiber_context_trampoline, %function\n"
+    "fiber_context_trampoline:\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size fiber_context_trampoline, .-fiber_context_trampoline\n"
+);
+
+void Context::make(void *stack, size_t size, EntryFunc entry)
+{
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~static_cast<uintptr_t>(15);
+    uint64_t *sp = reinterpret_cast<uint64_t *>(top - 160);
+    for(int i = 0; i < 20; ++i) sp[i] = 0;
+    sp[8] = reinterpret_cast<uint64_t>(entry);                      // x19，trampoline的调用目标
+    sp[19] = reinterpret_cast<uint64_t>(&fiber_context_trampoline); // x30，返回地址
+    m_sp = sp;
+}
+
+#endif
+
+void Context::init()
+{
+    // 汇编实现中线程主协程的寄存器在第一次切换出去时才保存，这里不需要做任何事
+    m_sp = nullptr;
+}
+
+void Context::Swap(Context &from, Context &to)
+{
+    fiber_context_switch(&from.m_sp, to.m_sp);
+}
+
+const char *Context::BackendName()
+{
+#if defined(__x86_64__)
+    return "asm-x86_64";
+#else
+    return "asm-aarch64";
+#endif
+}
+
+#endif
@@ -0,0 +1,44 @@
+// 协程上下文切换
+// x86-64 / AArch64 下使用手写汇编，只保存callee-saved寄存器，避免swapcontext每次切换都执行rt_sigprocmask系统调用
+// 其他平台或者定义了 FIBER_USE_UCONTEXT 时退回到 ucontext 实现
+
+#pragma once
+#include <cstddef>
+
+#if !defined(FIBER_USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define FIBER_USE_UCONTEXT
+#endif
+
+#ifdef FIBER_USE_UCONTEXT
+#include <ucontext.h>
+#endif
+
+class Context
+{
+public:
+    typedef void (*EntryFunc)();
+
+    // 获取当前线程的上下文，用于线程主协程
+    void init();
+
+    // 在指定的栈上创建上下文，切换进去之后从entry开始执行，entry不允许返回
+    void make(void *stack, size_t size, EntryFunc entry);
+
+    // 保存当前上下文到from，然后切换到to
+    static void Swap(Context &from, Context &to);
+
+    // 当前使用的切换方式名称
+    static const char *BackendName();
+
+#ifndef FIBER_USE_UCONTEXT
+    // 挂起时保存的栈顶指针，只有汇编实现可用
+    void *getStackPointer() const { return m_sp; }
+#endif
+
+private:
+#ifdef FIBER_USE_UCONTEXT
+    ucontext_t m_ctx;       // ucontext上下文
+#else
+    void *m_sp = nullptr;   // 挂起时的栈顶，callee-saved寄存器都保存在栈上
+#endif
+};
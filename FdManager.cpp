@@ -9,8 +9,8 @@ FdCtx::FdCtx(int fd) :
     m_userNoBlock(false),
     m_isClosed(false),
     m_fd(fd),
-    m_recvTimeout(std::chrono::milliseconds(-1)),
-    m_sendTimeout(std::chrono::milliseconds(-1))
+    m_recvTimeout(std::chrono::microseconds(-1)),
+    m_sendTimeout(std::chrono::microseconds(-1))
 {   
     init(); 
 }
@@ -18,8 +18,8 @@ FdCtx::FdCtx(int fd) :
 bool FdCtx::init()
 {
     if(m_isInit == true) return true;
-    m_recvTimeout = std::chrono::milliseconds(-1);
-    m_sendTimeout = std::chrono::milliseconds(-1);
+    m_recvTimeout = std::chrono::microseconds(-1);
+    m_sendTimeout = std::chrono::microseconds(-1);
     
     // fstat函数来获取一个文件描述符m_fd的状态，并根据这个状态来设置两个布尔变量m_isInit和m_isSocket的值。
     struct stat fd_stat;
@@ -53,7 +53,7 @@ bool FdCtx::init()
     return m_isInit;
 }
 
-void FdCtx::setTimeout(int type, std::chrono::milliseconds t)
+void FdCtx::setTimeout(int type, std::chrono::microseconds t)
 {
     if(type == SO_RECVTIMEO)
     {
@@ -65,7 +65,7 @@ void FdCtx::setTimeout(int type, std::chrono::milliseconds t)
     }
 }
 
-std::chrono::milliseconds FdCtx::getTimeout(int type) const
+std::chrono::microseconds FdCtx::getTimeout(int type) const
 {
     if(type == SO_RECVTIMEO)
     {
@@ -92,18 +92,19 @@ FdCtx::ptr FdManager::get(int fd, bool auto_create)
         {
             return nullptr;
         }
-        else
-        {
-            if(m_datas[fd] || !auto_create)
-            { // 已经存在，直接返回
-                return m_datas[fd];
-            }
-        }
+    }
+    else if(m_datas[fd] || !auto_create)
+    { // 已经存在，直接返回
+        return m_datas[fd];
     }
     lk_R.unlock();
 
     // 到此为止m_datas[fd]要么为空，要么就不存在，因此需要自己创建
     WriteLock lk_W(m_mutex);
+    if(fd < static_cast<int>(m_datas.size()) && m_datas[fd])
+    { // 释放读锁期间其他线程已经创建了
+        return m_datas[fd];
+    }
     FdCtx::ptr ctx(new FdCtx(fd));
     if(fd >= static_cast<int>(m_datas.size()))
     { // 如果有必要，直接扩容
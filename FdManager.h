@@ -1,5 +1,6 @@
 // 文件句柄管理类
 #pragma once
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <chrono>
@@ -31,7 +32,10 @@ public:
     bool isSocket() const {return m_isSocket;}
 
     // 是否关闭
-    bool isClose() const {return m_isClosed;}
+    bool isClose() const {return m_isClosed.load(std::memory_order_acquire);}
+
+    // 标记为关闭，hook的close在唤醒fd上的等待者之前调用，被唤醒的IO看到之后不再重试
+    void setClose() {m_isClosed.store(true, std::memory_order_release);}
 
     // 用户是否主动设置了非阻塞
     void setUserNoBlock(bool flag) {m_userNoBlock = flag;}
@@ -46,10 +50,10 @@ public:
     bool getSysNoBlock() const {return m_sysNoBlock;}
 
     // 设置超时时间
-    void setTimeout(int type, std::chrono::milliseconds t);
+    void setTimeout(int type, std::chrono::microseconds t);
 
     // 获取超时时间
-    std::chrono::milliseconds getTimeout(int type) const;
+    std::chrono::microseconds getTimeout(int type) const;
 
 protected:
     // 初始化
@@ -60,10 +64,10 @@ private:
     bool m_isSocket     : 1;                    // 是否为socket
     bool m_sysNoBlock   : 1;                    // 是否hook非阻塞
     bool m_userNoBlock  : 1;                    // 是否用户设置非阻塞
-    bool m_isClosed     : 1;                    // 是否关闭
+    std::atomic<bool> m_isClosed;               // 是否关闭，其他线程上被close唤醒的IO会读取
     int m_fd;                                   // 文件句柄
-    std::chrono::milliseconds m_recvTimeout;    // 读超时时间毫秒
-    std::chrono::milliseconds m_sendTimeout;    // 写超时时间毫秒
+    std::chrono::microseconds m_recvTimeout;    // 读超时时间微秒
+    std::chrono::microseconds m_sendTimeout;    // 写超时时间微秒
 };
 
 // 文件句柄管理类
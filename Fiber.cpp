@@ -1,6 +1,9 @@
 #include <mutex>
+#include <string.h>
 #include "Fiber.h"
 #include "Scheduler.h"
+#include "StackAllocator.h"
+#include "Interrupt.h"
 
 // 全局静态变量，用于生成协程ID
 static std::atomic<uint64_t> s_fiber_id{0};
@@ -18,16 +21,6 @@ static thread_local Fiber::ptr t_thread_fiber = nullptr;
 static uint32_t g_fiber_stack_size = 128 * 1024;
 
 
-// malloc栈内存分配器
-class MallocStackAllocator
-{
-public:
-    static void *Alloc(size_t size) { return malloc(size); }
-    static void Dealloc(void *vp, size_t size) { return free(vp); }
-};
-// 重命名
-using StackAllocator =  MallocStackAllocator;
-
 uint64_t Fiber::GetFiberId()
 {
     if(t_fiber != nullptr)
@@ -41,18 +34,20 @@ Fiber::Fiber()
 {
     SetThis(this);
     m_state = RUNNING; // 设置状态为正在运行
+    m_stack = nullptr;
 
-    if(getcontext(&m_ctx))
-    {
-        // 程序异常，需要停止
-        error_handling("getcontext error");
-    }
+    m_ctx.init();
 
     ++s_fiber_count;
     m_id = s_fiber_id++;
 
 }
 
+uint64_t Fiber::TotalFibers()
+{
+    return s_fiber_count;
+}
+
 void Fiber::SetThis(Fiber *f)
 {
     t_fiber = f;
@@ -75,32 +70,37 @@ Fiber::ptr Fiber::GetThis()
 }
 
 // 有参构造函数用于创建其他协程，需要分配栈
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler)
+Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool run_in_scheduler, bool shared_stack)
     : m_id(s_fiber_id++), m_cb(cb), m_runInScheduler(run_in_scheduler)
 {
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size;
-    m_stack = StackAllocator::Alloc(m_stacksize); // 分配栈空间
-
-    if (getcontext(&m_ctx)) 
-    {
-        MYASSERT(false, "getcontext");
+#ifndef FIBER_USE_UCONTEXT
+    m_useSharedStack = shared_stack;
+#endif
+    if(m_useSharedStack)
+    { // 共享栈协程在第一次resume时才确定使用哪一块共享栈
+        m_stack = nullptr;
+        m_needMake = true;
+        return;
     }
 
-    // 设置上下文的栈
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
+    m_stacksize = stacksize ? stacksize : g_fiber_stack_size;
+    m_stack = StackAllocator::Alloc(m_stacksize); // 分配栈空间
 
-    // 创建上下文
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    // 在分配的栈上创建上下文
+    m_ctx.make(m_stack, m_stacksize, &Fiber::MainFunc);
 }
 
 // 析构函数，因为主协程没有分配栈和cb，析构时需要特殊处理
 Fiber::~Fiber()
 {
     --s_fiber_count;
-    if(m_stack != nullptr)
+    if(m_useSharedStack)
+    { // 共享栈协程，结束时已经让出了共享栈，只需释放保存缓冲区
+        MYASSERT(m_state == TERM || m_needMake, "m_state != TERM");
+        free(m_saveBuffer);
+    }
+    else if(m_stack != nullptr)
     { // 有栈，说明不是主协程
         MYASSERT(m_state == TERM, "m_state != TERM");
         StackAllocator::Dealloc(m_stack, m_stacksize);
@@ -116,25 +116,32 @@ Fiber::~Fiber()
     }
 }
 
+FiberInterrupt *Fiber::getInterrupt(bool create)
+{
+    if(!m_interrupt && create)
+    {
+        m_interrupt.reset(new FiberInterrupt);
+    }
+    return m_interrupt.get();
+}
+
 // 为了简化状态管理，强制只有TERM状态的协程才可以重置
 // 其实刚创建好并且还未执行的协程也应该允许重置的
 void Fiber::reset(std::function<void()> cb)
 {
-    MYASSERT(m_stack != nullptr, "main fiber cannot reset");
+    MYASSERT(m_stack != nullptr || m_useSharedStack, "main fiber cannot reset");
     MYASSERT(m_state == TERM, "reset error, m_state != TERM");
     m_cb = cb; // 设置回调函数
-    if(getcontext(&m_ctx))
-    {
-        MYASSERT(false, "getcontext");
-    }
 
-    // 重置栈空间
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
-
-    // 创建上下文
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
+    if(m_useSharedStack)
+    { // 共享栈可能正被其他协程占用，等下次切入时再创建上下文
+        m_needMake = true;
+        m_saveSize = 0;
+    }
+    else
+    { // 复用栈空间重新创建上下文
+        m_ctx.make(m_stack, m_stacksize, &Fiber::MainFunc);
+    }
     m_state = READY; // 重置后为就绪状态
 }
 
@@ -142,48 +149,97 @@ void Fiber::reset(std::function<void()> cb)
 void Fiber::resume()
 {
     MYASSERT(m_state != TERM && m_state != RUNNING, "resume error");
+    if(m_useSharedStack)
+    {
+        switchInSharedStack();
+    }
     SetThis(this);
     m_state = RUNNING;
 
     // 如果协程参与调度器调度，那么应该和调度器的主协程进行swap，而不是线程主协程
     if(m_runInScheduler)
     {
-        if(swapcontext(&(Scheduler::GetScheduleFiber()->m_ctx), &m_ctx))
-        {
-            MYASSERT(false, "swapcontext");
-        }
+        Context::Swap(Scheduler::GetScheduleFiber()->m_ctx, m_ctx);
     }
     else
     {
-        if(swapcontext(&(t_thread_fiber->m_ctx), &m_ctx))
-        {
-            MYASSERT(false, "swapcontext");
+        Context::Swap(t_thread_fiber->m_ctx, m_ctx);
+    }
+
+    // 协程让出时状态仍是RUNNING，回到这里时它的上下文已经完整保存，这时才允许其他线程resume它
+    // 如果在yield中切换之前就改为READY，其他线程可能在上下文保存完之前切换进去
+    if(m_state == RUNNING) m_state = READY;
+
+    if(m_useSharedStack && m_state == TERM)
+    { // 协程结束后共享栈上的内容已经没用了，直接让出共享栈
+        m_sharedStack->occupant = nullptr;
+    }
+}
+
+void Fiber::switchInSharedStack()
+{
+    if(m_sharedStack == nullptr)
+    { // 第一次运行，从当前线程的共享栈中选一块，并绑定到当前线程
+        m_sharedStack = SharedStackPool::Acquire();
+        m_boundThread = std::this_thread::get_id();
+    }
+    MYASSERT(m_boundThread == std::this_thread::get_id(), "shared stack fiber resumed on another thread");
+    MYASSERT(t_fiber == nullptr || t_fiber->m_sharedStack != m_sharedStack, "resume shared stack fiber on the same shared stack");
+
+    Fiber *occupant = m_sharedStack->occupant;
+    if(occupant != this)
+    {
+        if(occupant)
+        { // 共享栈被其他挂起的协程占用，先把它的栈内容拷贝出去
+            occupant->saveSharedStack();
+        }
+        if(!m_needMake)
+        { // 恢复自己之前保存的栈内容
+            char *top = m_sharedStack->stack + m_sharedStack->size;
+            memcpy(top - m_saveSize, m_saveBuffer, m_saveSize);
         }
+        m_sharedStack->occupant = this;
+    }
+    if(m_needMake)
+    {
+        m_ctx.make(m_sharedStack->stack, m_sharedStack->size, &Fiber::MainFunc);
+        m_needMake = false;
     }
 }
 
+void Fiber::saveSharedStack()
+{
+#ifndef FIBER_USE_UCONTEXT
+    char *top = m_sharedStack->stack + m_sharedStack->size;
+    char *sp = static_cast<char *>(m_ctx.getStackPointer());
+    size_t used = top - sp;
+    if(m_saveCapacity < used || m_saveCapacity > 2 * used)
+    { // 保存缓冲区按实际用量分配，避免长期持有过大的缓冲区
+        free(m_saveBuffer);
+        m_saveBuffer = static_cast<char *>(malloc(used));
+        m_saveCapacity = used;
+    }
+    memcpy(m_saveBuffer, sp, used);
+    m_saveSize = used;
+#endif
+}
+
 // 协程让出执行权
 // 协程运行完之后会自动yield一次，用于回到主协程
 void Fiber::yield()
 {
     MYASSERT(m_state == RUNNING || m_state == TERM, "yield error");
     SetThis(t_thread_fiber.get()); // 设置当前运行协程为主协程
-    if(m_state != TERM) m_state = READY;
+    // 状态由resume在切换回来之后改为READY
 
     // 如果协程参与调度器调度，那么应该和调度器的调度协程进行上下文切换，而非和线程主协程切换
     if(m_runInScheduler)
     {
-        if(swapcontext(&m_ctx, &(Scheduler::GetScheduleFiber()->m_ctx)))
-        {
-            MYASSERT(false, "swapcontext");
-        }
+        Context::Swap(m_ctx, Scheduler::GetScheduleFiber()->m_ctx);
     }
     else 
     {
-        if(swapcontext(&m_ctx, &(t_thread_fiber->m_ctx)))
-        {
-            MYASSERT(false, "swapcontext");
-        }
+        Context::Swap(m_ctx, t_thread_fiber->m_ctx);
     }
 }
 
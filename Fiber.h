@@ -4,7 +4,8 @@
 #include <functional>
 #include <memory>
 #include <cassert>
-#include <ucontext.h>
+#include <thread>
+#include "Context.h"
 
 inline void error_handling(std::string &&expression)
 {
@@ -38,6 +39,9 @@ inline void MYASSERT(bool flag, std::string &&expression)
     }
 }
 
+struct SharedStack;
+class FiberInterrupt;
+
 class Fiber : public std::enable_shared_from_this<Fiber>
 {
 public:
@@ -57,7 +61,9 @@ private:
 
 public:
     // 构造函数，用于创建用户线程
-    Fiber(std::function<void()> cb, size_t stack_size = 0, bool run_in_scheduler = true);
+    // shared_stack为true时协程不分配私有栈，而是运行在当前线程的共享栈上，切出时只把用到的栈内容拷贝到保存缓冲区
+    // 共享栈协程第一次运行之后就绑定在该线程上，之后只能在该线程上resume，ucontext后端下该参数被忽略
+    Fiber(std::function<void()> cb, size_t stack_size = 0, bool run_in_scheduler = true, bool shared_stack = false);
 
     // 析构函数
     ~Fiber();
@@ -77,6 +83,18 @@ public:
     // 获取协程状态
     State getState() const { return this->m_state; }
 
+    // 是否运行在共享栈上
+    bool isSharedStack() const { return m_useSharedStack; }
+
+    // 共享栈协程绑定的线程，未绑定时为 std::thread::id(-1)
+    std::thread::id getBoundThread() const { return m_boundThread; }
+
+    // 共享栈协程挂起时保存的栈内容大小
+    size_t getSavedStackSize() const { return m_saveSize; }
+
+    // 协程的打断状态(截止时间等)，create为true时第一次调用创建，之后随协程一起释放
+    FiberInterrupt *getInterrupt(bool create);
+
 public:
     // 设置当前正在运行的协程，也就是设置线程局部变量 t_fiber 的值
     static void SetThis(Fiber *f);
@@ -85,7 +103,7 @@ public:
     static Fiber::ptr GetThis();
 
     // 获取协程总数
-    // static uint64_t TotalFibers();
+    static uint64_t TotalFibers();
 
     // 协程入口函数
     static void MainFunc();
@@ -93,14 +111,31 @@ public:
     // 获取当前协程id
     static uint64_t GetFiberId();
 
+private:
+    // 切入共享栈：必要时先把当前占用者的栈内容拷贝出去，再恢复自己的栈内容
+    void switchInSharedStack();
+
+    // 把自己在共享栈上用到的部分拷贝到保存缓冲区
+    void saveSharedStack();
+
 private:
     
     uint64_t m_id = 0;          // 协程ID
     uint32_t m_stacksize = 0;   // 协程栈大小
-    State m_state = READY;      // 协程状态
-    ucontext_t m_ctx;           // 协程上下文
+    std::atomic<State> m_state {READY}; // 协程状态，其他线程的调度协程会读取
+    Context m_ctx;              // 协程上下文
     void *m_stack;              // 协程栈地址
     std::function<void()> m_cb; // 协程函数入口
     bool m_runInScheduler;      // 本协程是否参与调度器调度
+
+    bool m_useSharedStack = false;                          // 是否运行在共享栈上
+    bool m_needMake = false;                                // 共享栈协程下次切入时是否需要重新创建上下文
+    SharedStack *m_sharedStack = nullptr;                   // 绑定的共享栈
+    std::thread::id m_boundThread = std::thread::id(-1);    // 共享栈协程绑定的线程
+    char *m_saveBuffer = nullptr;                           // 共享栈内容保存缓冲区
+    size_t m_saveSize = 0;                                  // 保存的栈内容大小
+    size_t m_saveCapacity = 0;                              // 保存缓冲区容量
+
+    std::unique_ptr<FiberInterrupt> m_interrupt;            // 打断状态，用到时才创建
 };
 
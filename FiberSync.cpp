@@ -0,0 +1,407 @@
+#include <errno.h>
+#include "FiberSync.h"
+#include "Interrupt.h"
+
+// 加锁失败后挂起之前自旋的次数
+static const int MUTEX_SPIN = 32;
+
+// =======================FiberWaitQueue=========================
+
+void FiberWaitQueue::push()
+{
+    Waiter waiter;
+    waiter.fiber = Fiber::GetThis();
+    waiter.scheduler = Scheduler::GetThis();
+    if(waiter.scheduler == nullptr || waiter.fiber.get() == Scheduler::GetScheduleFiber())
+    {
+        MYASSERT(false, "fiber sync primitives can only wait inside a scheduled fiber");
+    }
+    m_waiters.emplace_back(std::move(waiter));
+}
+
+bool FiberWaitQueue::pop(Waiter &waiter)
+{
+    if(m_waiters.empty())
+    {
+        return false;
+    }
+    waiter = std::move(m_waiters.front());
+    m_waiters.pop_front();
+    return true;
+}
+
+void FiberWaitQueue::Wake(Waiter &waiter)
+{
+    // 协程可能还没来得及yield，调度器会等它yield之后再执行
+    waiter.scheduler->schedule(waiter.fiber);
+    waiter.fiber.reset();
+}
+
+void FiberWaitQueue::Suspend()
+{
+    Fiber::GetThis()->yield();
+}
+
+bool FiberWaitQueue::remove(Fiber *fiber, Waiter &waiter)
+{
+    for(auto it = m_waiters.begin(); it != m_waiters.end(); ++it)
+    {
+        if(it->fiber.get() == fiber)
+        {
+            waiter = std::move(*it);
+            m_waiters.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+// 等待队列上一次可打断的等待
+struct queue_wait
+{
+    Spinlock *lock = nullptr;
+    FiberWaitQueue *queue = nullptr;
+    std::atomic<size_t> *waiting = nullptr;
+    Fiber *fiber = nullptr;
+    int interrupted = 0;
+};
+
+// 把等待的协程从队列中摘下，已经被取出时返回false
+static bool take_waiter(queue_wait *wait, FiberWaitQueue::Waiter &waiter)
+{
+    std::lock_guard<Spinlock> lock(*wait->lock);
+    if(!wait->queue->remove(wait->fiber, waiter))
+    {
+        return false;
+    }
+    if(wait->waiting) --*wait->waiting;
+    return true;
+}
+
+// 打断回调：协程还在队列中时摘下并唤醒，否则唤醒已经在路上，什么都不做
+static void on_queue_interrupt(void *arg, int err)
+{
+    queue_wait *wait = static_cast<queue_wait *>(arg);
+    FiberWaitQueue::Waiter waiter;
+    if(take_waiter(wait, waiter))
+    {
+        wait->interrupted = err;
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+int FiberWaitQueue::SuspendInterruptible(Spinlock &lock, FiberWaitQueue &queue, std::atomic<size_t> *waiting)
+{
+    FiberInterrupt *interrupt = FiberInterrupt::GetThis(false);
+    if(!interrupt)
+    {
+        Suspend();
+        return 0;
+    }
+    // 共享栈协程切出时栈帧会被拷走，打断回调要访问的状态放在堆上
+    queue_wait local;
+    std::unique_ptr<queue_wait> heap;
+    queue_wait *wait = &local;
+    if(Fiber::GetThis()->isSharedStack())
+    {
+        heap.reset(new queue_wait);
+        wait = heap.get();
+    }
+    wait->lock = &lock;
+    wait->queue = &queue;
+    wait->waiting = waiting;
+    wait->fiber = Fiber::GetThis().get();
+
+    int err = interrupt->beginWait(&on_queue_interrupt, wait);
+    if(err)
+    { // 登记之前就被打断了，自己从队列中摘下
+        Waiter waiter;
+        if(!take_waiter(wait, waiter))
+        {
+            Suspend();
+            return 0;
+        }
+    }
+    else
+    {
+        Suspend();
+        interrupt->endWait();
+        err = wait->interrupted;
+    }
+    if(err) errno = err;
+    return err;
+}
+
+// =======================FiberMutex=========================
+
+int FiberMutex::lockSlow(bool interruptible)
+{
+    // 锁通常很快就会释放，先自旋一会儿
+    for(int i = 0; i < MUTEX_SPIN; ++i)
+    {
+        int expected = 0;
+        if(m_state.load(std::memory_order_relaxed) == 0 &&
+           m_state.compare_exchange_weak(expected, 1, std::memory_order_acquire))
+        {
+            return 0;
+        }
+        Spinlock::CpuRelax();
+    }
+
+    // 进入等待队列之后只能把状态设为2，否则解锁时不会唤醒队列里的其他协程
+    // 被打断时状态留在2，下一次解锁多走一次慢路径
+    m_lock.lock();
+    while(m_state.exchange(2, std::memory_order_acquire) != 0)
+    {
+        m_waiters.push();
+        m_lock.unlock();
+        if(interruptible)
+        {
+            int err = FiberWaitQueue::SuspendInterruptible(m_lock, m_waiters);
+            if(err) return err;
+        }
+        else FiberWaitQueue::Suspend();
+        m_lock.lock();
+    }
+    m_lock.unlock();
+    return 0;
+}
+
+void FiberMutex::unlockSlow()
+{
+    FiberWaitQueue::Waiter waiter;
+    m_lock.lock();
+    bool found = m_waiters.pop(waiter);
+    m_lock.unlock();
+    if(found)
+    { // 被唤醒的协程重新竞争锁
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+// =======================FiberCondVar=========================
+
+void FiberCondVar::wait(std::unique_lock<FiberMutex> &lk)
+{
+    m_lock.lock();
+    m_waiters.push();
+    m_lock.unlock();
+    // 先进入等待队列再释放mutex，释放之后的notify不会丢失
+    lk.unlock();
+    FiberWaitQueue::Suspend();
+    lk.lock();
+}
+
+int FiberCondVar::wait_interruptible(std::unique_lock<FiberMutex> &lk)
+{
+    m_lock.lock();
+    m_waiters.push();
+    m_lock.unlock();
+    lk.unlock();
+    int err = FiberWaitQueue::SuspendInterruptible(m_lock, m_waiters);
+    // 被打断时也要重新获取mutex，调用者的unique_lock仍然持有锁
+    lk.lock();
+    return err;
+}
+
+void FiberCondVar::notify_one()
+{
+    FiberWaitQueue::Waiter waiter;
+    m_lock.lock();
+    bool found = m_waiters.pop(waiter);
+    m_lock.unlock();
+    if(found)
+    {
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+void FiberCondVar::notify_all()
+{
+    std::deque<FiberWaitQueue::Waiter> waiters;
+    m_lock.lock();
+    m_waiters.popAll(waiters);
+    m_lock.unlock();
+    for(auto &waiter : waiters)
+    {
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+// =======================FiberSemaphore=========================
+
+bool FiberSemaphore::try_wait()
+{
+    uint32_t count = m_count.load(std::memory_order_relaxed);
+    while(count > 0)
+    {
+        if(m_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FiberSemaphore::wait()
+{
+    if(try_wait())
+    {
+        return;
+    }
+    m_lock.lock();
+    if(try_wait())
+    {
+        m_lock.unlock();
+        return;
+    }
+    m_waiters.push();
+    m_lock.unlock();
+    // post直接把信号交给等待的协程，被唤醒时已经获取到信号
+    FiberWaitQueue::Suspend();
+}
+
+int FiberSemaphore::wait_interruptible()
+{
+    if(try_wait())
+    {
+        return 0;
+    }
+    m_lock.lock();
+    if(try_wait())
+    {
+        m_lock.unlock();
+        return 0;
+    }
+    m_waiters.push();
+    m_lock.unlock();
+    // 被摘下之前post已经把信号交给了这个协程时照常返回0
+    return FiberWaitQueue::SuspendInterruptible(m_lock, m_waiters);
+}
+
+void FiberSemaphore::post()
+{
+    FiberWaitQueue::Waiter waiter;
+    m_lock.lock();
+    bool found = m_waiters.pop(waiter);
+    if(!found)
+    {
+        m_count.fetch_add(1, std::memory_order_release);
+    }
+    m_lock.unlock();
+    if(found)
+    {
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+// =======================FiberRWMutex=========================
+
+bool FiberRWMutex::try_rdlock()
+{
+    int state = m_state.load(std::memory_order_relaxed);
+    while(state >= 0 && m_writersWaiting == 0)
+    {
+        if(m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FiberRWMutex::rdlock()
+{
+    if(try_rdlock())
+    {
+        return;
+    }
+    m_lock.lock();
+    if(try_rdlock())
+    {
+        m_lock.unlock();
+        return;
+    }
+    m_readers.push();
+    m_lock.unlock();
+    // 写者释放锁时直接把读锁交给等待的读者
+    FiberWaitQueue::Suspend();
+}
+
+void FiberRWMutex::rdunlock()
+{
+    // 先减少读者数量再检查等待的写者，和wrlock中先增加等待写者数量再尝试加锁配合，不会漏掉写者
+    if(m_state.fetch_sub(1) != 1 || m_writersWaiting == 0)
+    {
+        return;
+    }
+    FiberWaitQueue::Waiter waiter;
+    m_lock.lock();
+    int expected = 0;
+    bool found = !m_writers.empty() && m_state.compare_exchange_strong(expected, -1);
+    if(found)
+    {
+        m_writers.pop(waiter);
+        --m_writersWaiting;
+    }
+    m_lock.unlock();
+    if(found)
+    {
+        FiberWaitQueue::Wake(waiter);
+    }
+}
+
+bool FiberRWMutex::try_wrlock()
+{
+    int expected = 0;
+    return m_state.compare_exchange_strong(expected, -1, std::memory_order_acquire);
+}
+
+void FiberRWMutex::wrlock()
+{
+    if(try_wrlock())
+    {
+        return;
+    }
+    m_lock.lock();
+    ++m_writersWaiting;
+    if(try_wrlock())
+    {
+        --m_writersWaiting;
+        m_lock.unlock();
+        return;
+    }
+    m_writers.push();
+    m_lock.unlock();
+    // 最后一个读者或者上一个写者释放锁时直接把写锁交给等待的写者
+    FiberWaitQueue::Suspend();
+}
+
+void FiberRWMutex::wrunlock()
+{
+    std::deque<FiberWaitQueue::Waiter> waiters;
+    m_lock.lock();
+    if(!m_readers.empty())
+    { // 优先把读锁交给所有等待的读者
+        m_readers.popAll(waiters);
+        m_state.store(static_cast<int>(waiters.size()), std::memory_order_release);
+    }
+    else
+    {
+        FiberWaitQueue::Waiter waiter;
+        if(m_writers.pop(waiter))
+        { // 写锁直接交给下一个写者，m_state保持-1
+            --m_writersWaiting;
+            waiters.emplace_back(std::move(waiter));
+        }
+        else
+        {
+            m_state.store(0, std::memory_order_release);
+        }
+    }
+    m_lock.unlock();
+    for(auto &waiter : waiters)
+    {
+        FiberWaitQueue::Wake(waiter);
+    }
+}
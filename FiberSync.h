@@ -0,0 +1,229 @@
+// 协程同步原语
+// 等待的协程放入等待队列后yield，不会阻塞工作线程，释放时通过Scheduler::schedule重新调度等待的协程
+
+#pragma once
+#include <sched.h>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include "Fiber.h"
+#include "Scheduler.h"
+
+// 自旋锁，只用于保护很短的临界区，持有期间不能yield
+class Spinlock
+{
+public:
+    void lock()
+    {
+        for(int i = 0; m_flag.test_and_set(std::memory_order_acquire); ++i)
+        {
+            if(i < 64) CpuRelax();
+            else sched_yield();
+        }
+    }
+
+    bool try_lock() { return !m_flag.test_and_set(std::memory_order_acquire); }
+
+    void unlock() { m_flag.clear(std::memory_order_release); }
+
+    static void CpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+private:
+    std::atomic_flag m_flag = ATOMIC_FLAG_INIT;
+};
+
+// 协程等待队列，由使用者的Spinlock保护
+class FiberWaitQueue
+{
+public:
+    // 等待的协程以及把它重新加入调度的调度器
+    struct Waiter
+    {
+        Fiber::ptr fiber;
+        Scheduler *scheduler = nullptr;
+    };
+
+    // 把当前协程加入等待队列，之后调用者释放锁并yield
+    void push();
+
+    // 取出一个等待的协程，队列为空时返回false
+    bool pop(Waiter &waiter);
+
+    // 取出所有等待的协程
+    void popAll(std::deque<Waiter> &waiters) { waiters.swap(m_waiters); }
+
+    bool empty() const { return m_waiters.empty(); }
+
+    size_t size() const { return m_waiters.size(); }
+
+    // 重新调度等待的协程，调用时不需要持有锁
+    static void Wake(Waiter &waiter);
+
+    // 挂起当前协程，等待被Wake
+    static void Suspend();
+
+    // 可以被打断的挂起，当前协程已经通过push进入queue，调用者已经释放lock
+    // 协程的截止时间到了或者被取消时，如果它还在队列中就把它摘下并唤醒，返回打断的原因并设置errno
+    // 已经被取出(唤醒正在路上)时照常等待被唤醒，返回0；waiting不为空时摘下协程的同时把它减一
+    static int SuspendInterruptible(Spinlock &lock, FiberWaitQueue &queue, std::atomic<size_t> *waiting = nullptr);
+
+    // 从队列中摘下fiber，不在队列中时返回false
+    bool remove(Fiber *fiber, Waiter &waiter);
+
+private:
+    std::deque<Waiter> m_waiters;
+};
+
+// 协程互斥锁
+// m_state: 0 未加锁，1 加锁且没有等待者，2 加锁且可能有等待者
+// 没有竞争时加锁解锁都只有一次原子操作
+class FiberMutex
+{
+public:
+    FiberMutex() = default;
+    FiberMutex(const FiberMutex &) = delete;
+    FiberMutex &operator=(const FiberMutex &) = delete;
+
+    void lock()
+    {
+        int expected = 0;
+        if(!m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+        {
+            lockSlow();
+        }
+    }
+
+    bool try_lock()
+    {
+        int expected = 0;
+        return m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+    }
+
+    void unlock()
+    {
+        if(m_state.exchange(0, std::memory_order_release) == 2)
+        {
+            unlockSlow();
+        }
+    }
+
+    // 可以被截止时间和取消令牌打断的加锁，成功时返回0，被打断时没有加锁，返回ECANCELED/ETIMEDOUT
+    int lock_interruptible()
+    {
+        int expected = 0;
+        if(!m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire))
+        {
+            return lockSlow(true);
+        }
+        return 0;
+    }
+
+private:
+    int lockSlow(bool interruptible = false);
+    void unlockSlow();
+
+private:
+    std::atomic<int> m_state {0};
+    Spinlock m_lock;                // 保护等待队列
+    FiberWaitQueue m_waiters;
+};
+
+// 协程条件变量，和FiberMutex配合使用
+class FiberCondVar
+{
+public:
+    FiberCondVar() = default;
+    FiberCondVar(const FiberCondVar &) = delete;
+    FiberCondVar &operator=(const FiberCondVar &) = delete;
+
+    // 释放mutex并挂起当前协程，被唤醒后重新获取mutex
+    void wait(std::unique_lock<FiberMutex> &lk);
+
+    template <typename Predicate>
+    void wait(std::unique_lock<FiberMutex> &lk, Predicate pred)
+    {
+        while(!pred()) wait(lk);
+    }
+
+    // 可以被截止时间和取消令牌打断的等待，返回0或者打断的原因，返回时都已经重新获取了mutex
+    int wait_interruptible(std::unique_lock<FiberMutex> &lk);
+
+    // 唤醒一个等待的协程
+    void notify_one();
+
+    // 唤醒所有等待的协程
+    void notify_all();
+
+private:
+    Spinlock m_lock;
+    FiberWaitQueue m_waiters;
+};
+
+// 协程信号量
+class FiberSemaphore
+{
+public:
+    explicit FiberSemaphore(uint32_t count = 0) : m_count(count) {}
+    FiberSemaphore(const FiberSemaphore &) = delete;
+    FiberSemaphore &operator=(const FiberSemaphore &) = delete;
+
+    // 获取一个信号，没有信号时挂起当前协程
+    void wait();
+
+    // 尝试获取一个信号，不会挂起
+    bool try_wait();
+
+    // 可以被截止时间和取消令牌打断的等待，获取到信号时返回0，被打断时没有获取信号，返回打断的原因
+    int wait_interruptible();
+
+    // 释放一个信号，有等待的协程时直接交给它
+    void post();
+
+    uint32_t getCount() const { return m_count; }
+
+private:
+    std::atomic<uint32_t> m_count;
+    Spinlock m_lock;
+    FiberWaitQueue m_waiters;
+};
+
+// 协程读写锁，写优先：有写者等待时新的读者也要等待；写锁释放时优先唤醒所有等待的读者，避免读者饿死
+// m_state: >0 持有读锁的读者数量，0 未加锁，-1 写者持有
+class FiberRWMutex
+{
+public:
+    FiberRWMutex() = default;
+    FiberRWMutex(const FiberRWMutex &) = delete;
+    FiberRWMutex &operator=(const FiberRWMutex &) = delete;
+
+    void rdlock();
+    bool try_rdlock();
+    void rdunlock();
+
+    void wrlock();
+    bool try_wrlock();
+    void wrunlock();
+
+    // 兼容std::unique_lock/std::shared_lock
+    void lock() { wrlock(); }
+    bool try_lock() { return try_wrlock(); }
+    void unlock() { wrunlock(); }
+    void lock_shared() { rdlock(); }
+    bool try_lock_shared() { return try_rdlock(); }
+    void unlock_shared() { rdunlock(); }
+
+private:
+    std::atomic<int> m_state {0};
+    std::atomic<int> m_writersWaiting {0};  // 等待中的写者数量
+    Spinlock m_lock;                        // 保护两个等待队列
+    FiberWaitQueue m_readers;
+    FiberWaitQueue m_writers;
+};
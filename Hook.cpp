@@ -4,6 +4,7 @@
 #include "Hook.h"
 #include "FdManager.h"
 #include "IOManager.h"
+#include "Interrupt.h"
 
 static thread_local bool t_hook_enable = false; // 每一个线程是否开启hook
 
@@ -63,13 +64,136 @@ void set_hook_enable(bool flag)
     t_hook_enable = flag;
 }
 
+// errno是线程局部变量，编译器可能把yield之前取到的errno地址沿用到yield之后
+// 协程恢复时换了线程，就会写到原来线程的errno上，yield之后通过不内联的函数重新取地址
+static __attribute__((noinline)) void set_errno(int err)
+{
+    errno = err;
+}
+
+// 等待fd就绪时的超时，超时节点直接放在等待协程的栈帧里，启动和停止都不分配内存
 struct timer_info
 {
+    TimeoutNode node;
+    IOManager *iom = nullptr;
+    int fd = -1;
+    uint32_t event = 0;
     int cancelled = 0;
 };
 
+// 打断fd上的等待：记录原因，取消fd上的事件让等待的协程继续
+static void on_io_interrupt(void *arg, int err)
+{
+    timer_info *info = static_cast<timer_info *>(arg);
+    info->cancelled = err;
+    info->iom->cancelEvent(info->fd, static_cast<IOManager::Event>(info->event));
+}
+
+// 超时回调，在idle中执行
+static void on_io_timeout(void *arg)
+{
+    on_io_interrupt(arg, ETIMEDOUT);
+}
+
+// 准备等待fd事件的状态
+// 共享栈协程切出时栈帧会被拷走，超时节点不能留在栈上，这时改为在堆上分配，heap持有它
+static timer_info *prepare_io_wait(timer_info &local, std::unique_ptr<timer_info> &heap, IOManager *iom, int fd,
+                                   uint32_t event)
+{
+    timer_info *info = &local;
+    if(Fiber::GetThis()->isSharedStack())
+    {
+        if(!heap) heap.reset(new timer_info);
+        info = heap.get();
+    }
+    info->iom = iom;
+    info->fd = fd;
+    info->event = event;
+    return info;
+}
+
+// 调用自己的超时是否比协程的截止时间先到，left为DeadlineScope::Remaining()的返回值
+// 截止时间更早时由协程的截止时间节点唤醒，不用再启动调用自己的超时
+static bool own_timeout_first(std::chrono::microseconds to, std::chrono::microseconds left)
+{
+    return to.count() >= 0 && (left.count() < 0 || to < left);
+}
+
+// 调用自己的超时和协程的截止时间中较早的一个，都没有时返回-1
+static std::chrono::microseconds min_timeout(std::chrono::microseconds to, std::chrono::microseconds left)
+{
+    return own_timeout_first(to, left) || left.count() < 0 ? to : left;
+}
+
+// 登记可以被截止时间和取消令牌打断的等待，fd上的事件已经添加
+// 登记之前就被打断了时自己取消事件，协程yield之后马上会被唤醒
+static void begin_io_wait(FiberInterrupt *interrupt, timer_info *info)
+{
+    int err = interrupt->beginWait(&on_io_interrupt, info);
+    if(err)
+    {
+        on_io_interrupt(info, err);
+    }
+}
+
+// hook的sleep，超时节点和timer_info一样放在栈帧里
+// 超时和打断谁先到谁唤醒协程，另一个什么都不做
+struct sleep_info
+{
+    TimeoutNode node;
+    IOManager *iom = nullptr;
+    Fiber::ptr fiber;
+    std::atomic<bool> woken {false};
+    int cancelled = 0;
+};
+
+static void wake_sleeper(sleep_info *info, int err)
+{
+    if(!info->woken.exchange(true))
+    {
+        info->cancelled = err;
+        info->iom->schedule(info->fiber);
+    }
+}
+
+static void on_sleep_timeout(void *arg)
+{
+    wake_sleeper(static_cast<sleep_info *>(arg), 0);
+}
+
+static void on_sleep_interrupt(void *arg, int err)
+{
+    wake_sleeper(static_cast<sleep_info *>(arg), err);
+}
+
+// 当前协程能否通过io_uring执行IO
+// 共享栈协程切出时栈内容会被拷走，内核写入的缓冲区可能就在共享栈上，只能走epoll
+static IOManager *uring_manager()
+{
+    IOManager *iom = IOManager::GetThis();
+    if(!iom || !iom->isIoUring() || Fiber::GetThis()->isSharedStack())
+    {
+        return nullptr;
+    }
+    return iom;
+}
+
+// IOManager开启了socket_busy_poll时为新的socket设置SO_BUSY_POLL，没有权限等原因失败时忽略
+static void set_busy_poll(int fd)
+{
+    IOManager *iom = IOManager::GetThis();
+    if(!iom || iom->getOptions().socket_busy_poll.count() <= 0)
+    {
+        return;
+    }
+    int us = static_cast<int>(iom->getOptions().socket_busy_poll.count());
+    setsockopt_f(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+}
+
+// uring_op不为空并且使用io_uring后端时直接提交IO请求，不再先等待fd就绪再调用系统调用
 template <typename OriginFun, typename... Args>
-static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name, uint32_t event, int timeout_so, Args &&... args)
+static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name, uint32_t event, int timeout_so,
+                     const IoUringOp *uring_op, Args &&... args)
 {
     if(!t_hook_enable)
     {
@@ -101,8 +225,33 @@ static ssize_t do_io(int fd, OriginFun fun, const char *hook_fun_name, uint32_t
     }
 
     // 处理超时
-    std::chrono::milliseconds to = ctx->getTimeout(timeout_so);
-    std::shared_ptr<timer_info> tinfo(new timer_info);
+    std::chrono::microseconds to = ctx->getTimeout(timeout_so);
+
+    // 协程已经被取消或者截止时间已经过了，不再执行
+    FiberInterrupt *interrupt = FiberInterrupt::GetThis(false);
+    int err = interrupt ? interrupt->pending() : 0;
+    if(err)
+    {
+        errno = err;
+        return -1;
+    }
+    std::chrono::microseconds left = interrupt ? interrupt->remaining() : std::chrono::microseconds(-1);
+
+    IOManager *uring_iom = uring_op ? uring_manager() : nullptr;
+    if(uring_iom)
+    { // 超时取自己的超时和截止时间中较早的一个，被取消时submitIo取消提交的请求
+        ssize_t n = uring_iom->submitIo(*uring_op, min_timeout(to, left));
+        if(n < 0)
+        {
+            set_errno(static_cast<int>(-n));
+            return -1;
+        }
+        return n;
+    }
+
+    timer_info local_tinfo;
+    std::unique_ptr<timer_info> heap_tinfo;
+    timer_info *tinfo = &local_tinfo;
 
 retry:
     ssize_t n;
@@ -115,36 +264,43 @@ retry:
     if(n == -1 && errno == EAGAIN)
     { // EAGAIN表示资源暂时不可用，因此此时会阻塞
         IOManager *iom = IOManager::GetThis();
-        Timer::ptr timer;
-        std::weak_ptr<timer_info> winfo(tinfo); // 使用弱指针
-        // to = std::chrono::milliseconds(1);
-        if(to != std::chrono::milliseconds(-1))
-        { // 超时时间合法，手动设置一个定时器
-            timer = iom->addConditionTimer(to, [winfo, fd, iom, event](){
-                auto t = winfo.lock();
-                if(!t || t->cancelled)
-                {
-                    return;
-                }
-                t->cancelled = ETIMEDOUT;
-                iom->cancelEvent(fd, static_cast<IOManager::Event>(event)); // 触发事件让此协程继续
-            }, winfo);
+        if(interrupt) left = interrupt->remaining();
+        bool timed = own_timeout_first(to, left);
+        if(timed || interrupt)
+        {
+            tinfo = prepare_io_wait(local_tinfo, heap_tinfo, iom, fd, event);
+        }
+        if(timed)
+        { // 超时时间合法，启动超时节点，超时之后取消事件让此协程继续
+            iom->armTimeout(tinfo->node, to, &on_io_timeout, tinfo);
         }
         // idle 协程会删除已经触发的事件
         int rt = iom->addEvent(fd, static_cast<IOManager::Event>(event)); // cb为空表示传入当前协程
         if(rt == -1)
         { // 添加失败
-            if(timer) timer->cancel();
+            if(timed) iom->disarmTimeout(tinfo->node);
             return -1;
         }
         else // rt == 0
         { // 添加成功
+            if(interrupt) begin_io_wait(interrupt, tinfo);
+            if(ctx->isClose())
+            { // 检查之后到添加事件之前fd被关闭了，close没有看到这个事件，自己取消它
+                iom->cancelEvent(fd, static_cast<IOManager::Event>(event));
+            }
             Fiber::GetThis()->yield();
-            // 协程继续执行有两种情况，一是超时触发，而是epoll检测可读/写
-            if(timer) timer->cancel();
+            // 协程继续执行有三种情况，一是超时触发，二是截止时间到了或者被取消，三是epoll检测可读/写
+            // 超时回调或者打断回调正在执行时会等它执行完，之后tinfo不会再被访问
+            if(interrupt) interrupt->endWait();
+            if(timed) iom->disarmTimeout(tinfo->node);
             if(tinfo->cancelled)
             {
-                errno = tinfo->cancelled;
+                set_errno(tinfo->cancelled);
+                return -1;
+            }
+            if(ctx->isClose())
+            { // 被close唤醒，fd值可能已经被复用，不能再重试
+                set_errno(EBADF);
                 return -1;
             }
             goto retry;
@@ -166,12 +322,44 @@ unsigned int sleep(unsigned int seconds)
         return sleep_f(seconds);
     }
 
-    Fiber::ptr fiber = Fiber::GetThis();
-    IOManager *iom = IOManager::GetThis();
-    iom->addTimer(std::chrono::milliseconds(seconds * 1000), std::bind((void(Scheduler::*)
-            (Fiber::ptr, std::thread::id thread))&IOManager::schedule, iom/*this 指针*/, fiber, std::thread::id(-1)));
-    Fiber::GetThis()->yield();
-    return 0;
+    // 最多睡到协程的截止时间，被取消时提前返回，返回没有睡完的秒数，被打断时errno为打断的原因
+    std::chrono::microseconds us = std::chrono::seconds(seconds);
+    FiberInterrupt *interrupt = FiberInterrupt::GetThis(false);
+    int err = interrupt ? interrupt->pending() : 0;
+    std::chrono::microseconds left = interrupt ? interrupt->remaining() : std::chrono::microseconds(-1);
+    std::chrono::microseconds slept = err ? std::chrono::microseconds(0) : min_timeout(us, left);
+    if(slept.count() > 0)
+    {
+        IOManager *iom = IOManager::GetThis();
+        sleep_info local_info;
+        std::unique_ptr<sleep_info> heap_info;
+        sleep_info *info = &local_info;
+        if(Fiber::GetThis()->isSharedStack())
+        { // 和timer_info一样，共享栈协程的超时节点不能留在栈上
+            heap_info.reset(new sleep_info);
+            info = heap_info.get();
+        }
+        info->iom = iom;
+        info->fiber = Fiber::GetThis();
+        TimerClock::time_point start = getNow();
+        iom->armTimeout(info->node, slept, &on_sleep_timeout, info);
+        if(interrupt)
+        {
+            int rt = interrupt->beginWait(&on_sleep_interrupt, info);
+            if(rt) on_sleep_interrupt(info, rt);
+        }
+        Fiber::GetThis()->yield();
+        if(interrupt) interrupt->endWait();
+        iom->disarmTimeout(info->node);
+        info->fiber.reset();
+        err = info->cancelled;
+        if(err)
+        {
+            slept = std::min(us, std::chrono::duration_cast<std::chrono::microseconds>(getNow() - start));
+        }
+    }
+    if(err) set_errno(err);
+    return static_cast<unsigned int>(std::chrono::ceil<std::chrono::seconds>(us - slept).count());
 }
 
 int socket(int domain, int type, int protocol)
@@ -183,6 +371,7 @@ int socket(int domain, int type, int protocol)
     }
 
     FdMgr::GetInstance()->get(fd, true); // 文件句柄管理中注册fd
+    set_busy_poll(fd);
     return fd;
 }
 
@@ -213,6 +402,30 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
         return connect_f(fd, addr, addrlen);
     }
 
+    // 协程已经被取消或者截止时间已经过了，不再发起连接
+    FiberInterrupt *interrupt = FiberInterrupt::GetThis(false);
+    int err = interrupt ? interrupt->pending() : 0;
+    if(err)
+    {
+        errno = err;
+        return -1;
+    }
+    std::chrono::microseconds left = interrupt ? interrupt->remaining() : std::chrono::microseconds(-1);
+    std::chrono::microseconds to = timeout_ms;
+
+    IOManager *uring_iom = uring_manager();
+    if(uring_iom)
+    { // io_uring的connect在内部等待连接完成，直接返回最终结果
+        IoUringOp op{IoUringOp::CONNECT, fd, addr, addrlen};
+        int rt = static_cast<int>(uring_iom->submitIo(op, min_timeout(to, left)));
+        if(rt < 0)
+        {
+            set_errno(-rt);
+            return -1;
+        }
+        return 0;
+    }
+
     int n = connect_f(fd, addr, addrlen);
     if(n == 0) 
     {
@@ -227,38 +440,38 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
     else if(n != -1 || errno != EINPROGRESS) return n; // EINPROGRESS 是一个特定的错误码，表示连接操作正在进行中
 
     IOManager *iom = IOManager::GetThis();
-    Timer::ptr timer;
-    std::shared_ptr<timer_info> tinfo(new timer_info);
-    std::weak_ptr<timer_info> winfo(tinfo);
-
-    // 设置超时定时器
-    if(timeout_ms != std::chrono::milliseconds(-1))
+    timer_info local_tinfo;
+    std::unique_ptr<timer_info> heap_tinfo;
+    timer_info *tinfo = &local_tinfo;
+
+    // 设置超时，截止时间更早时由协程的截止时间节点负责唤醒
+    if(interrupt) left = interrupt->remaining();
+    bool timed = own_timeout_first(to, left);
+    if(timed || interrupt)
+    {
+        tinfo = prepare_io_wait(local_tinfo, heap_tinfo, iom, fd, IOManager::WRITE);
+    }
+    if(timed)
     { // 超时时间合法
-        timer = iom->addConditionTimer(timeout_ms, [winfo, fd, iom](){
-            auto t = winfo.lock();
-            if(!t || t->cancelled)
-            {
-                return;
-            }
-            t->cancelled = ETIMEDOUT;
-            iom->cancelEvent(fd, IOManager::WRITE);
-        }, winfo);
+        iom->armTimeout(tinfo->node, to, &on_io_timeout, tinfo);
     }
 
     int rt = iom->addEvent(fd, IOManager::WRITE);
     if(rt == 0)
     { // 添加事件成功
+        if(interrupt) begin_io_wait(interrupt, tinfo);
         Fiber::GetThis()->yield(); // ???
-        if(timer) timer->cancel();
+        if(interrupt) interrupt->endWait();
+        if(timed) iom->disarmTimeout(tinfo->node);
         if(tinfo->cancelled)
         {
-            errno = tinfo->cancelled;
+            set_errno(tinfo->cancelled);
             return -1;
         }
     }
     else
     { // 添加事件失败
-        if(timer) timer->cancel();
+        if(timed) iom->disarmTimeout(tinfo->node);
     }
 
     int error = 0;
@@ -273,7 +486,7 @@ int connect_with_timeout(int fd, const struct sockaddr *addr, socklen_t addrlen,
     }
     else 
     {
-        errno = error;
+        set_errno(error);
         return -1;
     }
 }
@@ -283,51 +496,57 @@ int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 }
 
 int accept(int s, struct sockaddr *addr, socklen_t *addrlen) {
-    int fd = do_io(s, accept_f, "accept", IOManager::READ, SO_RCVTIMEO, addr, addrlen);
+    IoUringOp op{IoUringOp::ACCEPT, s, addr, 0, 0, addrlen};
+    int fd = do_io(s, accept_f, "accept", IOManager::READ, SO_RCVTIMEO, &op, addr, addrlen);
     if(fd >= 0) {
         FdMgr::GetInstance()->get(fd, true);
+        set_busy_poll(fd);
     }
     return fd;
 }
 
 ssize_t read(int fd, void *buf, size_t count) {
-    return do_io(fd, read_f, "read", IOManager::READ, SO_RCVTIMEO, buf, count);
+    IoUringOp op{IoUringOp::READ, fd, buf, count};
+    return do_io(fd, read_f, "read", IOManager::READ, SO_RCVTIMEO, &op, buf, count);
 }
 
 ssize_t readv(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, readv_f, "readv", IOManager::READ, SO_RCVTIMEO, iov, iovcnt);
+    return do_io(fd, readv_f, "readv", IOManager::READ, SO_RCVTIMEO, nullptr, iov, iovcnt);
 }
 
 ssize_t recv(int sockfd, void *buf, size_t len, int flags) {
-    return do_io(sockfd, recv_f, "recv", IOManager::READ, SO_RCVTIMEO, buf, len, flags);
+    IoUringOp op{IoUringOp::RECV, sockfd, buf, len, flags};
+    return do_io(sockfd, recv_f, "recv", IOManager::READ, SO_RCVTIMEO, &op, buf, len, flags);
 }
 
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen) {
-    return do_io(sockfd, recvfrom_f, "recvfrom", IOManager::READ, SO_RCVTIMEO, buf, len, flags, src_addr, addrlen);
+    return do_io(sockfd, recvfrom_f, "recvfrom", IOManager::READ, SO_RCVTIMEO, nullptr, buf, len, flags, src_addr, addrlen);
 }
 
 ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags) {
-    return do_io(sockfd, recvmsg_f, "recvmsg", IOManager::READ, SO_RCVTIMEO, msg, flags);
+    return do_io(sockfd, recvmsg_f, "recvmsg", IOManager::READ, SO_RCVTIMEO, nullptr, msg, flags);
 }
 
 ssize_t write(int fd, const void *buf, size_t count) {
-    return do_io(fd, write_f, "write", IOManager::WRITE, SO_SNDTIMEO, buf, count);
+    IoUringOp op{IoUringOp::WRITE, fd, buf, count};
+    return do_io(fd, write_f, "write", IOManager::WRITE, SO_SNDTIMEO, &op, buf, count);
 }
 
 ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
-    return do_io(fd, writev_f, "writev", IOManager::WRITE, SO_SNDTIMEO, iov, iovcnt);
+    return do_io(fd, writev_f, "writev", IOManager::WRITE, SO_SNDTIMEO, nullptr, iov, iovcnt);
 }
 
 ssize_t send(int s, const void *msg, size_t len, int flags) {
-    return do_io(s, send_f, "send", IOManager::WRITE, SO_SNDTIMEO, msg, len, flags);
+    IoUringOp op{IoUringOp::SEND, s, msg, len, flags};
+    return do_io(s, send_f, "send", IOManager::WRITE, SO_SNDTIMEO, &op, msg, len, flags);
 }
 
 ssize_t sendto(int s, const void *msg, size_t len, int flags, const struct sockaddr *to, socklen_t tolen) {
-    return do_io(s, sendto_f, "sendto", IOManager::WRITE, SO_SNDTIMEO, msg, len, flags, to, tolen);
+    return do_io(s, sendto_f, "sendto", IOManager::WRITE, SO_SNDTIMEO, nullptr, msg, len, flags, to, tolen);
 }
 
 ssize_t sendmsg(int s, const struct msghdr *msg, int flags) {
-    return do_io(s, sendmsg_f, "sendmsg", IOManager::WRITE, SO_SNDTIMEO, msg, flags);
+    return do_io(s, sendmsg_f, "sendmsg", IOManager::WRITE, SO_SNDTIMEO, nullptr, msg, flags);
 }
 
 int close(int fd)
@@ -340,10 +559,16 @@ int close(int fd)
     FdCtx::ptr ctx = FdMgr::GetInstance()->get(fd);
     if(ctx)
     {
+        // 先标记关闭再唤醒等待者，否则等待者可能在close_f之前重试IO，又在这个fd上挂起
+        ctx->setClose();
         auto iom = IOManager::GetThis();
         if(iom)
         {
             iom->cancalAll(fd);
+            if(iom->isIoUring())
+            { // io_uring请求持有文件引用，关闭fd不会让它们结束，需要主动取消
+                iom->cancelIo(fd);
+            }
         }
         FdMgr::GetInstance()->del(fd);
     }
@@ -473,8 +698,10 @@ int setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t
             FdCtx::ptr ctx = FdMgr::GetInstance()->get(sockfd);
             if(ctx)
             {
+                // 超时时间保留到微秒，全为0表示不超时
                 const timeval *v = static_cast<const timeval *>(optval);
-                ctx->setTimeout(optname, std::chrono::milliseconds(v->tv_sec * 1000 + v->tv_usec / 1000));
+                std::chrono::microseconds us(v->tv_sec * 1000000 + v->tv_usec);
+                ctx->setTimeout(optname, us.count() ? us : std::chrono::microseconds(-1));
             }
         }
     }
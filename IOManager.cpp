@@ -1,8 +1,20 @@
-#include <unistd.h>     // pipe()
+#include <unistd.h>
 #include <sys/epoll.h>  // epoll
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
 #include <fcntl.h>      // fcntl()
 #include <string.h>     // memset
+#include <errno.h>
 #include "IOManager.h"
+#include "FiberSync.h"
+#include "Interrupt.h"
+
+// io_uring请求user_data中IoRequest地址占用的位数，高位是提交序号
+static const int IO_REQUEST_ADDR_BITS = 48;
+static const uint64_t IO_REQUEST_ADDR_MASK = (1ull << IO_REQUEST_ADDR_BITS) - 1;
+
+// 当前线程提交io_uring请求的序号
+static thread_local uint64_t t_io_request_seq = 0;
 
 IOManager::FdContext::EventContext &IOManager::FdContext::getEventContext(IOManager::Event event)
 {
@@ -26,7 +38,7 @@ void IOManager::FdContext::resetEventContext(EventContext &ctx)
     ctx.cb = nullptr;
 }
 
-void IOManager::FdContext::triggerEvent(IOManager::Event event)
+void IOManager::FdContext::triggerEvent(IOManager::Event event, std::vector<ScheduleTask> *batch)
 {
     // 待触发的事件必须已经被注册过
     assert(events & event);
@@ -36,7 +48,12 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event)
     events = static_cast<Event>(events & ~event);
     // 调度对应的协程
     EventContext &ctx = getEventContext(event);
-    if(ctx.cb)
+    if(batch && ctx.scheduler == Scheduler::GetThis())
+    { // 由调用者批量提交
+        if(ctx.cb) batch->emplace_back(ctx.cb);
+        else batch->emplace_back(ctx.fiber);
+    }
+    else if(ctx.cb)
     { // 通过函数添加
         ctx.scheduler->schedule(ctx.cb);
     }
@@ -48,30 +65,53 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event)
     return;
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string &name) : Scheduler(threads, use_caller, name)
+IOManager::IOManager(size_t threads, bool use_caller, const std::string &name, const IOManagerOptions &options)
+    : Scheduler(threads, use_caller, name), TimerManager(options.timer_wheel_tick, options.per_worker_timers && options.per_worker_epoll ? getWorkerCount() : 0),
+      m_options(options)
 {
-    // 初始化epoll
-    m_epfd = epoll_create(1024);
-    assert(m_epfd > 0);
-    
-    // 创建管道
-    int rt = pipe(m_tickleFds);
-    assert(!rt);
+    size_t poller_count = m_options.per_worker_epoll ? getWorkerCount() : 1;
+    for(size_t i = 0; i < poller_count; ++i)
+    {
+        m_pollers.emplace_back(new Poller);
+        Poller &poller = *m_pollers.back();
+
+        // 初始化epoll
+        poller.epfd = epoll_create(1024);
+        assert(poller.epfd > 0);
 
-    // pipe读句柄的可读事件，用于tickle协程
-    epoll_event event;
-    memset(&event, 0, sizeof(epoll_event));
-    event.events = EPOLLIN | EPOLLET; // 读事件 + 边缘触发ET
-    event.data.fd = m_tickleFds[0];
+        // 创建eventfd，非阻塞方式，配合边缘触发ET
+        poller.tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        assert(poller.tickleFd >= 0);
 
-    // 非阻塞方式，配合边缘触发ET
-    rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK); // 非阻塞
-    assert(!rt);
+        // eventfd的可读事件，用于tickle协程，私有指针指向Poller，和FdContext区分开
+        epoll_event event;
+        memset(&event, 0, sizeof(epoll_event));
+        event.events = EPOLLIN | EPOLLET; // 读事件 + 边缘触发ET
+        event.data.ptr = &poller;
+
+        int rt = epoll_ctl(poller.epfd, EPOLL_CTL_ADD, poller.tickleFd, &event);
+        assert(!rt);
+    }
 
-    rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event);
-    assert(!rt);
+    if(m_options.use_io_uring)
+    { // 每个Poller一个ring，任何一个创建失败都整体退回epoll
+        bool ok = true;
+        for(auto &poller : m_pollers)
+        {
+            poller->ring.reset(new IoUring);
+            if(!poller->ring->init(256))
+            {
+                ok = false;
+                break;
+            }
+        }
+        if(!ok)
+        {
+            for(auto &poller : m_pollers) poller->ring.reset();
+        }
+    }
 
-    contextResize(32);
+    m_fdChunks.reset(new std::atomic<FdContext *>[FD_MAX_CHUNKS]());
     // 这里直接开始了协程调度器的调度
     start();
 }
@@ -80,65 +120,147 @@ IOManager::~IOManager()
 {
     stop(); // 协程调度器停止
     // 释放文件句柄
-    close(m_epfd);
-    close(m_tickleFds[0]);
-    close(m_tickleFds[1]);
+    for(auto &poller : m_pollers)
+    {
+        close(poller->epfd);
+        close(poller->tickleFd);
+    }
+
+    for(int i = 0; i < FD_MAX_CHUNKS; ++i)
+    {
+        delete [] m_fdChunks[i].load(std::memory_order_relaxed);
+    }
+}
 
-    for(size_t i = 0; i < m_fdContexts.size(); ++i)
+IOManager::Poller &IOManager::localPoller()
+{
+    if(m_pollers.size() == 1)
     {
-        if(m_fdContexts[i])
+        return *m_pollers[0];
+    }
+    size_t index = getWorkerIndex();
+    assert(index < m_pollers.size());
+    return *m_pollers[index];
+}
+
+int IOManager::choosePoller()
+{
+    if(m_pollers.size() == 1)
+    {
+        return 0;
+    }
+    return static_cast<int>(chooseWorker());
+}
+
+size_t IOManager::chooseWorker()
+{
+    size_t n = getWorkerCount();
+    size_t index = getWorkerIndex();
+    if(index < n && isWorkerAvailable(index))
+    {
+        return index;
+    }
+    // use_caller的0号线程在stop()之前不会调度，分给它的fd和定时器要等到stop()才会处理
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t candidate = m_nextPoller++ % n;
+        if(isWorkerAvailable(candidate))
         {
-            delete m_fdContexts[i];
+            return candidate;
         }
     }
+    return 0;
 }
 
-void IOManager::contextResize(size_t size)
+IOManager::FdContext *IOManager::getFdContext(int fd, bool auto_create)
 {
-    m_fdContexts.resize(size);
-    
-    // 如果需要的的话，初始化新加入的fd上下文
-    for(size_t i = 0; i < m_fdContexts.size(); ++i)
+    if(fd < 0 || fd >= FD_MAX_CHUNKS * FD_CHUNK_SIZE)
+    {
+        return nullptr;
+    }
+    std::atomic<FdContext *> &slot = m_fdChunks[fd >> FD_CHUNK_SHIFT];
+    FdContext *chunk = slot.load(std::memory_order_acquire);
+    if(!chunk)
     {
-        if(!m_fdContexts[i])
+        if(!auto_create)
+        { // 块还没有分配，说明这个fd从来没有添加过事件
+            return nullptr;
+        }
+        // 多个线程可能同时分配同一个块，只有一个能放进去，其他的释放自己分配的
+        FdContext *fresh = new FdContext[FD_CHUNK_SIZE];
+        int base = fd & ~(FD_CHUNK_SIZE - 1);
+        for(int i = 0; i < FD_CHUNK_SIZE; ++i)
+        {
+            fresh[i].fd = base + i;
+        }
+        if(slot.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel, std::memory_order_acquire))
         {
-            m_fdContexts[i] = new FdContext;
-            m_fdContexts[i]->fd = i;
+            chunk = fresh;
+        }
+        else
+        {
+            delete [] fresh;
         }
     }
+    return &chunk[fd & (FD_CHUNK_SIZE - 1)];
 }
 
 // 如果cb为空，则以当前协程为cb
 int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
 {
-    // 找到fd对应的FdContexts，如果不存在就分配一个 --> fdContexts 扩容
-    FdContext *fd_ctx = nullptr;
-    ReadLock lk_R(m_mutex);
-    if(static_cast<int>(m_fdContexts.size()) > fd)
+    // 找到fd对应的FdContext，所在的块不存在就分配一块
+    FdContext *fd_ctx = getFdContext(fd, true);
+    if(!fd_ctx)
     {
-        fd_ctx = m_fdContexts[fd];
-        lk_R.unlock();
-    }
-    else
-    { // m_fdContexts长度不够，进行扩容
-        lk_R.unlock();
-        WriteLock lk_W(m_mutex);
-        contextResize(fd + fd > 1);
-        fd_ctx = m_fdContexts[fd];
+        errno = EBADF;
+        return -1;
     }
+    // 和idle、cancelEvent互斥，否则事件可能在等待者设置完之前就被处理
+    std::unique_lock<std::mutex> lk(fd_ctx->mtx);
     // 同一个fd不允许添加同一个事件
-    MYASSERT(!(fd_ctx->events & event), "can not add same event in the same fd");
+    if(fd_ctx->events & event)
+    {
+        MYASSERT(false, "can not add same event in the same fd");
+    }
 
-    // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
-    int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
-    epoll_event epevent;
-    epevent.events = EPOLLET | fd_ctx->events | event;
-    epevent.data.ptr = fd_ctx;
+    // fd第一次添加事件时选择它所在的Poller，之后一直留在这个Poller上
+    if(fd_ctx->poller < 0)
+    {
+        fd_ctx->poller = choosePoller();
+    }
 
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt)
+    if(m_options.persistent_registration)
+    { // 第一次等待这个fd时注册读写两个事件，之后只需要设置等待者
+        if(!fd_ctx->registered)
+        {
+            epoll_event epevent;
+            epevent.events = EPOLLET | EPOLLIN | EPOLLOUT;
+            epevent.data.ptr = fd_ctx;
+            int rt = epoll_ctl(m_pollers[fd_ctx->poller]->epfd, EPOLL_CTL_ADD, fd, &epevent);
+            if(rt && errno == EEXIST)
+            { // fd被dup过，旧的注册还留在epoll中
+                rt = epoll_ctl(m_pollers[fd_ctx->poller]->epfd, EPOLL_CTL_MOD, fd, &epevent);
+            }
+            if(rt)
+            {
+                return -1;
+            }
+            fd_ctx->registered = true;
+        }
+    }
+    else
     {
-        return -1;
+        // 将新的事件加入epoll_wait，使用epoll_event的私有指针存储FdContext的位置
+        int op = fd_ctx->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        epoll_event epevent;
+        epevent.events = EPOLLET | fd_ctx->events | event;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_pollers[fd_ctx->poller]->epfd, op, fd, &epevent);
+        if(rt)
+        {
+            return -1;
+        }
     }
 
     // 待执行IO事件加一
@@ -160,17 +282,22 @@ int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
         event_ctx.fiber = Fiber::GetThis();
         assert((event_ctx.fiber->getState() == Fiber::RUNNING));
     }
+
+    if(fd_ctx->ready & event)
+    { // 事件在没有等待者的时候已经就绪过，边缘触发不会再通知，直接触发
+        fd_ctx->ready = static_cast<Event>(fd_ctx->ready & ~event);
+        fd_ctx->triggerEvent(event);
+        --m_pendingEventCount;
+    }
     return 0;
 }
 
 bool IOManager::delEvent(int fd, Event event)
 {
     // 找到df对应的FdContext
-    ReadLock lk_R(m_mutex);
-    if(static_cast<int>(m_fdContexts.size() <= fd)) return false; // 不存在
+    FdContext *fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx) return false; // 不存在
 
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lk_R.unlock();
     std::unique_lock<std::mutex> lk(fd_ctx->mtx);
     if(!(fd_ctx->events & event))
     { // 删除的事件类型不存在
@@ -178,16 +305,20 @@ bool IOManager::delEvent(int fd, Event event)
     }
 
     // 清除指定事件，表示不关心这个事件了，如果清除之后结果为0，则从epoll_wait中删除该文件描述符
+    // 持久注册时fd留在epoll中，只清除等待者
     Event new_events = static_cast<Event>(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) 
+    if(!m_options.persistent_registration)
     {
-        return false;
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_pollers[fd_ctx->poller]->epfd, op, fd, &epevent);
+        if(rt) 
+        {
+            return false;
+        }
     }
 
     // 待执行事件数目减一
@@ -203,13 +334,11 @@ bool IOManager::delEvent(int fd, Event event)
 bool IOManager::cancelEvent(int fd, Event event)
 {
     // 找到fd对应的FdContext
-    ReadLock lk_R(m_mutex);
-    if(static_cast<int>(m_fdContexts.size() <= fd))
+    FdContext *fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx)
     {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lk_R.unlock();
 
     std::unique_lock<std::mutex> lk(fd_ctx->mtx);
     if(!(fd_ctx->events & event))
@@ -217,17 +346,20 @@ bool IOManager::cancelEvent(int fd, Event event)
         return false;
     }
 
-    // 开始删除事件
-    Event new_events = static_cast<Event>(fd_ctx->events & ~event);
-    int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = EPOLLET | new_events;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt)
+    // 开始删除事件，持久注册时fd留在epoll中
+    if(!m_options.persistent_registration)
     {
-        return false;
+        Event new_events = static_cast<Event>(fd_ctx->events & ~event);
+        int op = new_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = EPOLLET | new_events;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_pollers[fd_ctx->poller]->epfd, op, fd, &epevent);
+        if(rt)
+        {
+            return false;
+        }
     }
 
     // 删除之前触发一次事件
@@ -240,30 +372,40 @@ bool IOManager::cancelEvent(int fd, Event event)
 bool IOManager::cancalAll(int fd)
 {
     // 找到fd对应的FdContext
-    ReadLock lk_R(m_mutex);
-    if(static_cast<int>(m_fdContexts.size() <= fd))
+    FdContext *fd_ctx = getFdContext(fd, false);
+    if(!fd_ctx)
     {
         return false;
     }
-    FdContext *fd_ctx = m_fdContexts[fd];
-    lk_R.unlock();
 
     std::unique_lock<std::mutex> lk(fd_ctx->mtx);
+    if(fd_ctx->registered)
+    { // 持久注册的fd即将关闭，从epoll中删除并清除锁存的事件，fd值被复用时重新注册
+        epoll_event epevent;
+        memset(&epevent, 0, sizeof(epoll_event));
+        epoll_ctl(m_pollers[fd_ctx->poller]->epfd, EPOLL_CTL_DEL, fd, &epevent);
+        fd_ctx->registered = false;
+        fd_ctx->ready = NONE;
+    }
     if(!fd_ctx->events)
     { // 如果没有任何类型事件可以删除 返回false
+        fd_ctx->poller = -1; // fd即将关闭，fd值被复用时重新选择Poller
         return false;
     }
 
     // 删除全部事件
-    int op = EPOLL_CTL_DEL;
-    epoll_event epevent;
-    epevent.events = 0;
-    epevent.data.ptr = fd_ctx;
-
-    int rt = epoll_ctl(m_epfd, op, fd, &epevent);
-    if(rt) 
+    if(!m_options.persistent_registration)
     {
-        return false;
+        int op = EPOLL_CTL_DEL;
+        epoll_event epevent;
+        epevent.events = 0;
+        epevent.data.ptr = fd_ctx;
+
+        int rt = epoll_ctl(m_pollers[fd_ctx->poller]->epfd, op, fd, &epevent);
+        if(rt) 
+        {
+            return false;
+        }
     }
 
     // 触发全部已经注册的事件
@@ -279,6 +421,7 @@ bool IOManager::cancalAll(int fd)
     }
 
     assert(fd_ctx->events == 0);
+    fd_ctx->poller = -1;
     return true;
 }
 
@@ -296,23 +439,95 @@ void IOManager::tickle()
     {
         return;
     }
-    // 向管道中写数据
-    int rt = write(m_tickleFds[1], "T", 1);
-    assert(rt == 1);
+    if(m_pollers.size() == 1)
+    {
+        ticklePoller(*m_pollers[0]);
+        return;
+    }
+    // 每个线程有自己的epoll，轮流找一个空闲的线程唤醒，连续多次tickle会唤醒不同的线程
+    size_t n = m_pollers.size();
+    size_t start = m_nextPoller++;
+    for(size_t i = 0; i < n; ++i)
+    {
+        size_t index = (start + i) % n;
+        if(isWorkerIdle(index))
+        {
+            ticklePoller(*m_pollers[index]);
+            return;
+        }
+    }
+}
+
+void IOManager::tickleWorker(size_t index)
+{
+    if(m_pollers.size() == 1)
+    {
+        tickle();
+        return;
+    }
+    ticklePoller(*m_pollers[index]);
+}
+
+void IOManager::ticklePoller(Poller &poller)
+{
+    if(m_options.busy_poll.count() > 0)
+    { // 有线程正在忙轮询，它自己会看到新任务和定时器，和busyPoll结束时的检查配合，不会漏掉
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(poller.spinners.load(std::memory_order_relaxed) > 0)
+        {
+            return;
+        }
+    }
+    // 上一次的通知还没被读走，epoll_wait一定会返回，不需要再写
+    if(poller.notified.exchange(true))
+    {
+        return;
+    }
+    if(poller.ring)
+    { // io_uring后端的空闲线程等待在ring上，NOP的完成事件会让它返回
+        poller.ring->submitNop(RING_TAG_TICKLE);
+        return;
+    }
+    uint64_t one = 1;
+    int rt = write(poller.tickleFd, &one, sizeof(one));
+    assert(rt == sizeof(one));
 }
 
 bool IOManager::stopping()
 {
-    std::chrono::milliseconds timeout(0);
+    std::chrono::microseconds timeout(0);
     return stopping(timeout);
 }
 
-bool IOManager::stopping(std::chrono::milliseconds &timeout)
+bool IOManager::stopping(std::chrono::microseconds &timeout)
 {
     // 对于IOManager而言，必须等待所有待调度的IO事件都执行完毕以后才可以退出
     // 增加定时器功能之后，还应该保证没有剩余的定时器待触发
+    // 定时器分片时timeout只是当前线程的，其他线程的定时器也要等待
     timeout = getNextTimer();
-    return (timeout == std::chrono::milliseconds(~0ull) && m_pendingEventCount == 0 && Scheduler::stopping());
+    return (!hasTimer() && m_pendingEventCount == 0 && Scheduler::stopping());
+}
+
+// 等待epoll事件，超时时间精确到微秒
+// 优先使用epoll_pwait2(5.11以上的内核)，不支持时退回epoll_wait，超时时间向上取整到毫秒，宁可晚一点也不要提前醒来空转
+static int EpollWait(int epfd, epoll_event *events, int max_events, std::chrono::microseconds timeout)
+{
+#ifdef SYS_epoll_pwait2
+    static std::atomic<bool> s_has_pwait2 {true};
+    if(s_has_pwait2.load(std::memory_order_relaxed))
+    {
+        timespec ts;
+        ts.tv_sec = timeout.count() / 1000000;
+        ts.tv_nsec = (timeout.count() % 1000000) * 1000;
+        int rt = static_cast<int>(syscall(SYS_epoll_pwait2, epfd, events, max_events, &ts, nullptr, 0));
+        if(rt >= 0 || errno != ENOSYS)
+        {
+            return rt;
+        }
+        s_has_pwait2.store(false, std::memory_order_relaxed);
+    }
+#endif
+    return epoll_wait(epfd, events, max_events, static_cast<int>((timeout.count() + 999) / 1000));
 }
 
 // 调度协程无调度任务时会阻塞在idle协程上，对于IO调度器而言，idle状态应该关注两件事
@@ -326,39 +541,63 @@ void IOManager::idle()
     epoll_event *events = new epoll_event[MAX_EVENTS];
     std::shared_ptr<epoll_event> shared_events(events, [](epoll_event *ptr)
         {delete [] ptr;}); // 自定义函数
+    std::vector<ScheduleTask> tasks; // 本轮就绪的IO事件
+    Poller &poller = localPoller();
     
     while(true)
     {
+        // 开启忙轮询时先自旋一段时间，期间有事情做就不再阻塞
+        int rt = 0;
+        bool ready = m_options.busy_poll.count() > 0 && busyPoll(poller, events, MAX_EVENTS, rt);
+
         // 判断调度器是否可以停止，同时获取下一次超时时间
-        std::chrono::milliseconds next_timeout(0);
+        std::chrono::microseconds next_timeout(0);
         if(stopping(next_timeout))
         {
             break;
         }
 
-        // 阻塞在epoll_wait上，等待事件发生或者定时器超时
-         int rt = 0;
-        do 
+        // 默认超时5秒，如果下一个定时器的超时时间大于5秒，仍以5秒来计算超时
+        // 避免定时器超时时间太大时，epoll_wait一直阻塞
+        static const std::chrono::microseconds MAX_TIMEOUT = std::chrono::seconds(5);
+        if(next_timeout != std::chrono::microseconds(~0ull))
         {
-            //std::cout<<"epoll_wait...\n";
-            // 默认超时5秒，如果下一个定时器的超时时间大于5秒，仍以5秒来计算超时
-            // 避免定时器超时时间太大时，epoll_wait一直阻塞
-            static const int MAX_TIMEOUT = 5000; // 5 seconds
-            auto temp = std::chrono::milliseconds(~0ull);
-            if(next_timeout != std::chrono::milliseconds(~0ull))
+            next_timeout = std::min(next_timeout, MAX_TIMEOUT);
+        }
+        else next_timeout = MAX_TIMEOUT; // 没有事件，也等待5秒
+
+        if(ready)
+        { // 自旋时epoll事件已经取出，io_uring的完成事件还要收割
+            if(poller.ring) rt = waitRing(poller, events, MAX_EVENTS, std::chrono::microseconds(0), tasks);
+        }
+        else if(poller.ring)
+        { // 阻塞在io_uring_enter上，等待IO请求完成、epoll事件、tickle或者定时器超时
+            TimerClock::time_point start = TimerClock::now();
+            rt = waitRing(poller, events, MAX_EVENTS, next_timeout, tasks);
+            if(m_options.busy_poll.count() > 0)
             {
-                next_timeout = std::min(next_timeout, std::chrono::milliseconds(MAX_TIMEOUT));
+                m_blockedUs += std::chrono::duration_cast<std::chrono::microseconds>(TimerClock::now() - start).count();
             }
-            else next_timeout = std::chrono::milliseconds(MAX_TIMEOUT); // 没有事件，也等待5秒
-
-            // 调用epoll_wait
-            int rt = epoll_wait(m_epfd, events, MAX_EVENTS, static_cast<int>(next_timeout.count()/1000)); // 单位秒
-            if(rt < 0 && errno == EINTR)
-            { // 如果遇到中断，继续处理
-                continue;
+        }
+        else
+        { // 阻塞在epoll_wait上，等待事件发生或者定时器超时
+            TimerClock::time_point start = TimerClock::now();
+            do 
+            {
+                //std::cout<<"epoll_wait...\n";
+                // 调用epoll_wait，超时时间精确到微秒
+                rt = EpollWait(poller.epfd, events, MAX_EVENTS, next_timeout);
+                if(rt < 0 && errno == EINTR)
+                { // 如果遇到中断，继续处理
+                    continue;
+                }
+                else break; // 读取完毕
+            }while(true);
+            if(m_options.busy_poll.count() > 0)
+            {
+                m_blockedUs += std::chrono::duration_cast<std::chrono::microseconds>(TimerClock::now() - start).count();
             }
-            else break; // 读取完毕
-        }while(true);
+        }
 
         // 处理定时器的操作
         // 收集所有已经超时的定时器，执行回调函数
@@ -366,44 +605,149 @@ void IOManager::idle()
         listExpiredCb(cbs);
         if(!cbs.empty())
         {
-            for(auto &cb : cbs)
+            scheduleBatch(cbs.begin(), cbs.end());
+            cbs.clear();
+        }
+
+        processEvents(poller, events, rt, tasks);
+
+        if(m_pollers.size() == 1)
+        { // 共用一个epoll时tickleWorker不能指定唤醒哪个线程，被唤醒的可能不是信箱有任务的那个，把通知传下去
+            size_t self = getWorkerIndex();
+            for(size_t i = 0; i < getWorkerCount(); ++i)
             {
-                schedule(cb);
+                if(i != self && isWorkerIdle(i) && hasMailboxWork(i))
+                {
+                    ticklePoller(poller);
+                    break;
+                }
             }
-            cbs.clear();
         }
 
-        // 遍历所有发生的事情，根据epoll_event的私有指针找到对应的FdContext，进行事件处理
-        for(int i = 0; i < rt; ++i)
+        if(m_options.run_next && !tasks.empty() && runNext(tasks.back()))
+        { // 最后一个就绪的任务由本线程接着执行
+            tasks.pop_back();
+        }
+        if(!tasks.empty())
         {
-            epoll_event &event = events[i];
-            if(event.data.fd == m_tickleFds[0])
-            { // m_tickleFds[0]用于通知协程调度，这时只需要把管道里的内容读完即可
-                std::cout<<"定时器触发"<<std::endl;
-                uint8_t dummy[256];
-                while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0) {}
-                continue;
-            }
+            submitBatch(tasks);
+            tasks.clear();
+        }
 
-            FdContext *fd_ctx = static_cast<FdContext *>(event.data.ptr);
-            std::unique_lock<std::mutex> lk(fd_ctx->mtx); // 临界资源的操作，上锁
+        // 一旦处理完所有事件，idle协程yield，这样可以让调度协程(Scheduler::run)重新检查是否有新的任务需要调度
+        // 上面的triggerEvent实际上也只是将对应的fiber加入调度，实际执行还要等待idle协程退出
+        Fiber::ptr cur = Fiber::GetThis();
+        auto raw_ptr = cur.get();
+        cur.reset();
+        raw_ptr->yield();
+    } // while(true) 结束
 
-            /*
-             * EPOLLERR：出错，比如读写端已经关闭的pipe
-             * EPOLLHUB：套接字对端关闭
-             * 出现这两种事件，应该同时触发fd的读写事件，否则有可能出现注册的事件永远执行不到的情况
-             */
+    // 最后一个任务执行完之后，其他线程可能还阻塞在epoll_wait上，叫醒它们一起退出
+    // 共用一个epoll时一次只唤醒一个线程，被唤醒的线程退出时会接着唤醒下一个
+    for(auto &p : m_pollers)
+    {
+        ticklePoller(*p);
+    }
+}
 
-            if(event.events & (EPOLLERR | EPOLLHUP))
-            {
-                event.events |= ((EPOLLIN | EPOLLOUT) & fd_ctx->events);
-            }
+bool IOManager::busyPoll(Poller &poller, epoll_event *events, int max_events, int &count)
+{
+    TimerClock::time_point start = TimerClock::now();
+    TimerClock::time_point deadline = start + m_options.busy_poll;
+    TimerClock::time_point now = start;
+    bool ready = false;
+    ++poller.spinners;
+    while(!ready && now < deadline)
+    {
+        if(poller.ring)
+        { // epoll事件也是通过ring上的poll请求通知的，只需要看完成队列
+            ready = poller.ring->hasCompletions();
+        }
+        else
+        {
+            count = std::max(epoll_wait(poller.epfd, events, max_events, 0), 0);
+            ready = count > 0;
+        }
+        std::chrono::microseconds next_timer(0);
+        ready = ready || hasPendingWork() || stopping(next_timer) || next_timer.count() == 0;
+        if(!ready)
+        {
+            Spinlock::CpuRelax();
+            now = TimerClock::now();
+        }
+    }
+    --poller.spinners;
+    // 自旋期间的tickle都被省略了，停止自旋之后再检查一次任务队列，和ticklePoller中的检查配合
+    // 定时器由idle重新计算超时时间时检查
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(ready)
+    {
+        ++m_spinHits;
+    }
+    else
+    {
+        ++m_spinMisses;
+        ready = hasPendingWork();
+    }
+    m_spinUs += std::chrono::duration_cast<std::chrono::microseconds>(TimerClock::now() - start).count();
+    return ready;
+}
 
-            
-            int real_events = NONE;
-            if(event.events & EPOLLIN)  real_events |= READ;
-            if(event.events & EPOLLOUT) real_events |= WRITE;
+IOManager::BusyPollStats IOManager::getBusyPollStats() const
+{
+    BusyPollStats stats;
+    stats.spinUs = m_spinUs;
+    stats.blockedUs = m_blockedUs;
+    stats.spinHits = m_spinHits;
+    stats.spinMisses = m_spinMisses;
+    return stats;
+}
 
+void IOManager::processEvents(Poller &poller, epoll_event *events, int count, std::vector<ScheduleTask> &tasks)
+{
+    // 遍历所有发生的事情，根据epoll_event的私有指针找到对应的FdContext，进行事件处理
+    for(int i = 0; i < count; ++i)
+    {
+        epoll_event &event = events[i];
+        if(event.data.ptr == &poller)
+        { // tickleFd用于通知协程调度，读走计数之后清除通知标记，之后的tickle会重新写eventfd
+            // 先清除标记再回到调度协程检查任务队列，exchange和tickle中的exchange同步，标记清除之前添加的任务一定能被看到
+            uint64_t dummy;
+            while(read(poller.tickleFd, &dummy, sizeof(dummy)) > 0) {}
+            poller.notified.exchange(false);
+            continue;
+        }
+
+        FdContext *fd_ctx = static_cast<FdContext *>(event.data.ptr);
+        std::unique_lock<std::mutex> lk(fd_ctx->mtx); // 临界资源的操作，上锁
+
+        /*
+         * EPOLLERR：出错，比如读写端已经关闭的pipe
+         * EPOLLHUB：套接字对端关闭
+         * 出现这两种事件，应该同时触发fd的读写事件，否则有可能出现注册的事件永远执行不到的情况
+         */
+
+        if(event.events & (EPOLLERR | EPOLLHUP))
+        { // 持久注册时没有等待者的事件也要锁存下来，之后的读写才能发现错误
+            event.events |= m_options.persistent_registration ? (EPOLLIN | EPOLLOUT) : ((EPOLLIN | EPOLLOUT) & fd_ctx->events);
+        }
+
+        
+        int real_events = NONE;
+        if(event.events & EPOLLIN)  real_events |= READ;
+        if(event.events & EPOLLOUT) real_events |= WRITE;
+
+        if(m_options.persistent_registration)
+        { // 注册一直保留，不需要epoll_ctl，没有等待者的事件锁存起来，由下一次addEvent触发
+            fd_ctx->ready = static_cast<Event>(fd_ctx->ready | (real_events & ~fd_ctx->events));
+            real_events &= fd_ctx->events;
+            if(real_events == NONE)
+            {
+                continue;
+            }
+        }
+        else
+        {
             if((fd_ctx->events & real_events) == NONE)
             { // 触发的事件类型和对调函数事件类型不匹配，直接跳过
                 continue;
@@ -414,36 +758,158 @@ void IOManager::idle()
             int op = left_events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
             event.events = EPOLLET | left_events;
 
-            if(epoll_ctl(m_epfd, op, fd_ctx->fd, &event))
+            if(epoll_ctl(poller.epfd, op, fd_ctx->fd, &event))
             {
                 std::cerr<<"epoll_ctl faild!\n";
                 assert(false);
                 continue;
             }
+        }
 
-            // 处理已经发生的事件，也就是让调度器调度指定的函数或者协程
-            if(real_events & READ)
-            {
-                fd_ctx->triggerEvent(READ);
-                --m_pendingEventCount;
-            }
-            if(real_events & WRITE)
-            {
-                fd_ctx->triggerEvent(WRITE);
+        // 处理已经发生的事件，也就是让调度器调度指定的函数或者协程，这里先收集起来，最后一次性提交
+        if(real_events & READ)
+        {
+            fd_ctx->triggerEvent(READ, &tasks);
+            --m_pendingEventCount;
+        }
+        if(real_events & WRITE)
+        {
+            fd_ctx->triggerEvent(WRITE, &tasks);
+            --m_pendingEventCount;
+        }
+    }
+}
+
+int IOManager::waitRing(Poller &poller, epoll_event *events, int max_events, std::chrono::microseconds timeout,
+                        std::vector<ScheduleTask> &tasks)
+{
+    // epfd上的poll请求是一次性的，第一次进入时提交，之后由取出epoll事件的线程重新提交
+    if(!poller.epollArmed.exchange(true))
+    {
+        poller.ring->submitPoll(poller.epfd, RING_TAG_EPOLL);
+    }
+
+    // 超时或者被信号打断都直接返回，由idle处理定时器之后重新等待
+    poller.ring->wait(timeout.count());
+
+    static thread_local std::vector<IoUring::Completion> t_completions;
+    poller.ring->reap(t_completions);
+    bool epoll_ready = false;
+    for(auto &completion : t_completions)
+    {
+        switch(completion.userData)
+        {
+            case RING_TAG_TICKLE:
+                // 和epoll后端一样，清除标记之后才回到调度协程检查任务队列
+                poller.notified.exchange(false);
+                break;
+            case RING_TAG_EPOLL:
+                epoll_ready = true;
+                break;
+            case RING_TAG_IGNORE:
+                break;
+            default:
+            { // IO请求完成，取走协程之后就不能再访问req，协程恢复之后req就失效了
+                IoRequest *req = reinterpret_cast<IoRequest *>(completion.userData & IO_REQUEST_ADDR_MASK);
+                req->result = completion.res;
+                tasks.emplace_back(std::move(req->fiber));
                 --m_pendingEventCount;
+                break;
             }
-        } // for 循环结束
+        }
+    }
+    t_completions.clear();
+
+    int count = 0;
+    if(epoll_ready)
+    { // 先取走就绪事件再重新提交poll请求，取完之后又有新事件时poll请求会立即完成
+        count = epoll_wait(poller.epfd, events, max_events, 0);
+        if(count < 0) count = 0;
+        poller.ring->submitPoll(poller.epfd, RING_TAG_EPOLL);
+    }
+    return count;
+}
 
-        // 一旦处理完所有事件，idle协程yield，这样可以让调度协程(Scheduler::run)重新检查是否有新的任务需要调度
-        // 上面的triggerEvent实际上也只是将对应的fiber加入调度，实际执行还要等待idle协程退出
-        Fiber::ptr cur = Fiber::GetThis();
-        auto raw_ptr = cur.get();
-        cur.reset();
-        raw_ptr->yield();
-    } // while(true) 结束
+ssize_t IOManager::submitIo(const IoUringOp &op, std::chrono::microseconds timeout)
+{
+    Poller &poller = localPoller();
+    assert(poller.ring);
+
+    IoRequest req;
+    req.fiber = Fiber::GetThis();
+    req.ring = poller.ring.get();
+    req.userData = reinterpret_cast<uint64_t>(&req) | (++t_io_request_seq << IO_REQUEST_ADDR_BITS);
+    int64_t timeout_us = timeout.count() < 0 ? -1 : timeout.count();
+    auto start = std::chrono::steady_clock::now();
+    ++m_pendingEventCount;
+    poller.ring->submit(op, req.userData, timeout_us, RING_TAG_IGNORE);
+
+    FiberInterrupt *interrupt = FiberInterrupt::GetThis(false);
+    if(interrupt)
+    {
+        int err = interrupt->beginWait(&IOManager::OnIoInterrupt, &req);
+        if(err) OnIoInterrupt(&req, err);
+    }
+
+    // 完成事件可能在yield之前就被其他线程收割，调度器会等协程切出之后再恢复它
+    Fiber::GetThis()->yield();
+    if(interrupt) interrupt->endWait();
+
+    if(req.result == -ECANCELED)
+    { // 协程被打断时请求被取消；链接的超时请求到期时IO请求也以ECANCELED完成，否则是fd关闭时被cancelIo取消
+        if(req.interrupted)
+        {
+            return -req.interrupted;
+        }
+        bool expired = timeout_us >= 0 && std::chrono::steady_clock::now() - start >= timeout;
+        return expired ? -ETIMEDOUT : -EBADF;
+    }
+    return req.result;
+}
+
+void IOManager::OnIoInterrupt(void *arg, int err)
+{
+    // 取消请求在提交时同步执行，这里返回之前请求已经被取消或者已经完成，user_data不会被之后的请求复用
+    IoRequest *req = static_cast<IoRequest *>(arg);
+    req->interrupted = err;
+    req->ring->submitCancel(req->userData, RING_TAG_IGNORE);
+}
+
+void IOManager::cancelIo(int fd)
+{
+    // 请求可能提交在任意一个Poller的ring上
+    for(auto &poller : m_pollers)
+    {
+        if(poller->ring) poller->ring->submitCancelFd(fd, RING_TAG_IGNORE);
+    }
 }
 
 void IOManager::onTimerInsertedAtFront()
 {
     tickle();
+}
+
+void IOManager::tickleTimerShard(size_t shard)
+{
+    tickleWorker(shard);
+}
+
+size_t IOManager::getTimerShard()
+{
+    size_t index = getWorkerIndex();
+    if(index < getWorkerCount() && isWorkerRunning(index))
+    {
+        return index;
+    }
+    return static_cast<size_t>(-1);
+}
+
+size_t IOManager::chooseTimerShard()
+{
+    size_t n = getWorkerCount();
+    if(n == 1)
+    {
+        return 0;
+    }
+    return chooseWorker();
 }
\ No newline at end of file
@@ -3,6 +3,52 @@
 #pragma once
 #include "Scheduler.h"
 #include "Timer.h"
+#include "IoUring.h"
+
+// IOManager的可选配置
+struct IOManagerOptions
+{
+    // 每个工作线程使用自己的epoll，fd注册在第一次对它addEvent的工作线程上，事件总是由这个线程检测
+    // 默认所有工作线程共用一个epoll，事件可能在任意一个线程上被检测到
+    bool per_worker_epoll = false;
+
+    // 使用io_uring后端：hook的read/write/recv/send/accept/connect直接提交IO请求，完成后恢复协程
+    // 空闲线程阻塞在io_uring_enter上，epoll只作为一个poll请求挂在ring上，继续服务addEvent
+    // 内核不支持io_uring时自动退回epoll，可以通过isIoUring()查看实际使用的后端
+    bool use_io_uring = false;
+
+    // 持久注册：fd第一次addEvent时以EPOLLIN|EPOLLOUT|EPOLLET加入epoll，之后一直留在epoll中直到hook的close
+    // 事件触发时不再EPOLL_CTL_MOD/DEL，没有等待者的就绪事件锁存在FdContext中，addEvent发现已经就绪时直接触发
+    // 默认每次addEvent都要EPOLL_CTL_ADD/MOD，触发之后再EPOLL_CTL_MOD/DEL
+    // 开启之后fd必须通过hook的close(或者先调用cancalAll)关闭，否则fd值被复用时不会重新注册
+    bool persistent_registration = false;
+
+    // 直接交接：idle检测到IO事件之后，最后一个就绪的协程放入当前工作线程的runnext槽位，idle让出之后立即执行
+    // 不经过共享的任务队列，也不会被其他线程取走，协程在看到事件的线程上继续运行，缓存是热的
+    // 其余就绪的任务照常提交，由空闲线程窃取。默认所有就绪的任务都提交到队列中
+    bool run_next = false;
+
+    // 忙轮询：空闲线程先在这段时间内不断检查epoll(epoll_wait超时为0)/io_uring完成队列、任务队列和定时器，
+    // 仍然没有事情做才阻塞。线程自旋期间tickle不需要写eventfd。用一个核的CPU换取更低的唤醒延迟
+    // 默认为0，空闲线程直接阻塞
+    std::chrono::microseconds busy_poll {0};
+
+    // 大于0时，hook的socket/accept创建的socket设置SO_BUSY_POLL，让内核在读socket时忙轮询网卡队列
+    // 超过net.core.busy_read的值需要CAP_NET_ADMIN权限，设置失败时忽略
+    std::chrono::microseconds socket_busy_poll {0};
+
+    // 大于0时定时器存放在以它为精度的分层时间轮中，添加和取消都是O(1)，定时器最多晚一个tick触发
+    // 适合大量连接各自带有读写超时、空闲超时的场景。默认使用按到期时间排序的std::set
+    std::chrono::microseconds timer_wheel_tick {0};
+
+    // 每个工作线程有自己的定时器分片，工作线程添加的定时器放在自己的分片中，idle只看自己分片的超时时间，不需要加锁
+    // 其他线程取消、重置定时器时发送消息给分片所在的线程处理；外部线程添加的定时器轮流分给各个工作线程
+    // 定时器总是在添加它的线程上触发，这个线程忙的时候不会被其他空闲线程代替。只在per_worker_epoll时生效
+    // 默认所有线程共用一个加锁的定时器存储
+    bool per_worker_timers = false;
+};
+
+struct epoll_event;
 
 class IOManager : public Scheduler, public TimerManager
 {
@@ -20,7 +66,8 @@ public:
 private:
     // socket fd上下文类
     // 每一个socket fd都对应一个FdContext，包括fd值，fd上的事件以及fd的读写事件上下文
-    struct FdContext
+    // 按缓存行对齐，相邻fd的上下文被不同线程使用时不会互相影响
+    struct alignas(64) FdContext
     {
         typedef std::mutex MutexType; 
         // 事件上下文
@@ -39,23 +86,61 @@ private:
         void resetEventContext(EventContext &ctx);
 
         // 触发事件
-        void triggerEvent(Event event);
+        // batch不为空并且事件由当前线程的调度器执行时，任务放入batch由调用者批量提交
+        void triggerEvent(Event event, std::vector<ScheduleTask> *batch = nullptr);
 
         EventContext read;          // 读事件上下文
         EventContext write;         // 写事件上下文
         int fd = 0;                 // 事件
         Event events = NONE;        // fd关心什么时间
+        int poller = -1;            // fd注册在哪个Poller上，-1表示还没有注册过
+        bool registered = false;    // 持久注册模式下fd是否已经在epoll中
+        Event ready = NONE;         // 持久注册模式下已经就绪但当时没有等待者的事件
         MutexType mtx;              // 互斥锁
     };
 
+    // epoll实例和用于唤醒epoll_wait的eventfd
+    // io_uring后端时每个Poller还有一个ring，空闲线程等待在ring上，tickle改为提交NOP请求
+    struct Poller
+    {
+        int epfd = -1;                          // epoll 文件句柄
+        int tickleFd = -1;                      // eventfd，用于在有新任务或者定时器时及时退出epoll_wait
+        std::atomic<bool> notified {false};     // 已经写过eventfd还没被读走，这期间的tickle不用再写
+        std::unique_ptr<IoUring> ring;          // io_uring后端时不为空
+        std::atomic<bool> epollArmed {false};   // epfd上的poll请求已经提交还没完成
+        std::atomic<int> spinners {0};          // 正在忙轮询的线程数量，大于0时tickle不用唤醒
+    };
+
+    // 一次通过io_uring提交的IO请求，放在发起请求的协程栈上，完成时由idle协程填写结果并重新调度协程
+    struct IoRequest
+    {
+        Fiber::ptr fiber;           // 等待完成的协程
+        int result = 0;             // 完成事件的res
+        IoUring *ring = nullptr;    // 请求提交到的ring
+        int interrupted = 0;        // 协程被打断时为打断的原因，请求被取消
+        uint64_t userData = 0;      // 提交时使用的user_data，取消请求时按它查找
+    };
+
+    // io_uring完成事件的user_data，除了下面几个值以外低48位是IoRequest的地址，高16位是提交序号
+    // IoRequest在协程栈上，同一个地址很快会被下一个请求复用；链接的超时到期和请求完成同时发生时，
+    // 内核会在之后按user_data取消请求，带上序号才不会取消掉复用了同一个地址的下一个请求
+    enum RingTag : uint64_t
+    {
+        RING_TAG_TICKLE = 1,    // tickle提交的NOP
+        RING_TAG_EPOLL = 2,     // epfd上的poll请求
+        RING_TAG_IGNORE = 3     // 不需要处理的完成事件：链接的超时请求、取消请求
+    };
+
 public: 
     // 构造函数
-    IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager");
+    IOManager(size_t threads = 1, bool use_caller = true, const std::string &name = "IOManager",
+              const IOManagerOptions &options = IOManagerOptions());
 
     // 析构函数
     ~IOManager();
 
     // 添加事件，添加成功返回0，添加失败返回-1
+    // 持久注册模式下事件已经就绪时会立即触发，调用者yield之后马上就会被重新调度
     int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
 
     // 删除事件
@@ -67,6 +152,33 @@ public:
     // 取消所有事件
     bool cancalAll(int fd);
 
+    // 忙轮询统计，时间单位微秒，只在开启busy_poll时统计
+    struct BusyPollStats
+    {
+        uint64_t spinUs = 0;        // 自旋的总时间
+        uint64_t blockedUs = 0;     // 阻塞在epoll_wait/io_uring_enter上的总时间
+        uint64_t spinHits = 0;      // 自旋期间等到事件、任务或者定时器的次数
+        uint64_t spinMisses = 0;    // 自旋预算用完，转为阻塞的次数
+    };
+
+    // 获取忙轮询统计
+    BusyPollStats getBusyPollStats() const;
+
+    // 获取配置
+    const IOManagerOptions &getOptions() const { return m_options; }
+
+    // 是否在使用io_uring后端
+    bool isIoUring() const { return !m_pollers.empty() && m_pollers[0]->ring != nullptr; }
+
+    // 通过io_uring执行一次IO请求，挂起当前协程直到请求完成
+    // 返回值和完成事件的res一样，失败时为负的错误码，timeout为负时不超时，超时返回-ETIMEDOUT
+    // 协程的截止时间到了或者被取消时取消请求，返回-ETIMEDOUT/-ECANCELED
+    // 只能在使用io_uring后端的工作线程上、运行在私有栈上的协程中调用
+    ssize_t submitIo(const IoUringOp &op, std::chrono::microseconds timeout);
+
+    // 取消fd上所有还没完成的io_uring请求，fd关闭之前调用
+    void cancelIo(int fd);
+
     // 返回当前的IOManager
     static IOManager *GetThis();
 
@@ -74,12 +186,15 @@ protected:
     // 通知调度器有任务要调度
     void tickle() override;
 
+    // 通知指定的工作线程，所有线程共用一个epoll时无法只唤醒指定的线程，和tickle()相同
+    void tickleWorker(size_t index) override;
+
     // 判断是否可以停止
     // 判断条件是Scheduler::stopping()外加IOManager的m_pendingEventCount为0，表示没有IO事件可调度了
     bool stopping() override;
 
-    // 判断是否可以停止，同时获取最近一个定时器的超时时间
-    bool stopping(std::chrono::milliseconds &timeout);
+    // 判断是否可以停止，同时获取最近一个定时器的超时时间(微秒)
+    bool stopping(std::chrono::microseconds &timeout);
 
     // idle协程，空闲调度
     void idle() override;
@@ -88,13 +203,57 @@ protected:
     // 这里是唤醒idle协程以便使用新的超时时间
     void onTimerInsertedAtFront() override;
 
-    // 重置socket句柄上下文的容器大小
-    void contextResize(size_t size);
+    // 定时器分片收到消息时唤醒分片所在的工作线程
+    void tickleTimerShard(size_t shard) override;
+
+    // 当前线程的定时器分片，只有正在调度的工作线程拥有分片
+    size_t getTimerShard() override;
+
+    // 外部线程添加的定时器和外部线程注册的fd一样，轮流分给可以及时处理的工作线程
+    size_t chooseTimerShard() override;
+
+    // 找到fd对应的FdContext，所在的块还没有分配时auto_create为true则分配，否则返回nullptr
+    // fd超出上限时返回nullptr
+    FdContext *getFdContext(int fd, bool auto_create);
+
+    // 当前线程的idle协程等待的Poller
+    Poller &localPoller();
+
+    // 为还没有注册过的fd选择Poller，和工作线程一一对应，见chooseWorker
+    int choosePoller();
+
+    // 选择工作线程：当前线程是可以及时处理的工作线程时选自己，否则在可以及时处理的工作线程中轮流选择
+    size_t chooseWorker();
+
+    // 唤醒等待在Poller上的线程
+    void ticklePoller(Poller &poller);
+
+    // io_uring后端时等待完成事件，完成的IO请求放入tasks，epfd可读时取出epoll事件，返回epoll事件数量
+    int waitRing(Poller &poller, epoll_event *events, int max_events, std::chrono::microseconds timeout,
+                 std::vector<ScheduleTask> &tasks);
+
+    // 忙轮询，在预算时间内有IO事件、任务或者到期的定时器时返回true，epoll后端取到的事件数量写入count
+    bool busyPoll(Poller &poller, epoll_event *events, int max_events, int &count);
+
+    // 处理epoll_wait返回的事件，就绪的协程或回调放入tasks
+    void processEvents(Poller &poller, epoll_event *events, int count, std::vector<ScheduleTask> &tasks);
+
+    // 等待io_uring请求的协程被打断，按照user_data取消请求
+    static void OnIoInterrupt(void *arg, int err);
 
 private:
-    int m_epfd = 0;                                 // epoll 文件句柄
-    int m_tickleFds[2];                             // pipe文件句柄，fd[0]读端口，fd[1]写端口，用于在定时器触发时及时退出epoll_wait
+    IOManagerOptions m_options;                     // 配置
+    std::vector<std::unique_ptr<Poller>> m_pollers; // 共用epoll时只有一个，否则每个工作线程一个
+    std::atomic<size_t> m_nextPoller {0};           // 轮流选择Poller/唤醒工作线程的游标
     std::atomic<size_t> m_pendingEventCount {0};    // 当前等待执行的IO事件数量
-    RWMutexType m_mutex;                            // IOManager的mutex
-    std::vector<FdContext *> m_fdContexts;          // socket事件上下文容器
+    std::atomic<uint64_t> m_spinUs {0};             // 忙轮询统计，见BusyPollStats
+    std::atomic<uint64_t> m_blockedUs {0};
+    std::atomic<uint64_t> m_spinHits {0};
+    std::atomic<uint64_t> m_spinMisses {0};
+    // fd上下文表分为两级：第一级是固定长度的块指针数组，第二级的块在第一次用到时分配
+    // 查找不需要加锁，分配之后的块不会移动，FdContext的地址在IOManager的整个生命周期内不变
+    static const int FD_CHUNK_SHIFT = 10;                           // 每块1024个fd
+    static const int FD_CHUNK_SIZE = 1 << FD_CHUNK_SHIFT;
+    static const int FD_MAX_CHUNKS = 1 << 14;                       // 最多支持16M个fd
+    std::unique_ptr<std::atomic<FdContext *>[]> m_fdChunks;         // socket事件上下文表
 };
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <algorithm>
+#include "Interrupt.h"
+#include "IOManager.h"
+
+FiberInterrupt *FiberInterrupt::GetThis(bool create)
+{
+    return Fiber::GetThis()->getInterrupt(create);
+}
+
+FiberInterrupt::~FiberInterrupt()
+{
+    if(m_timers) m_timers->disarmTimeout(m_node);
+}
+
+int FiberInterrupt::beginWait(Callback cb, void *arg)
+{
+    std::lock_guard<Spinlock> lock(m_mutex);
+    // 超时节点不会提前触发，令牌先设置取消标记再打断：打断在登记之前到来过的话，这里一定能看到
+    int err = pending();
+    if(err)
+    {
+        return err;
+    }
+    m_cb = cb;
+    m_arg = arg;
+    return 0;
+}
+
+void FiberInterrupt::endWait()
+{
+    std::lock_guard<Spinlock> lock(m_mutex);
+    m_cb = nullptr;
+    m_arg = nullptr;
+}
+
+int FiberInterrupt::pending() const
+{
+    for(CancellationToken *token : m_tokens)
+    {
+        if(token->isCancelled()) return ECANCELED;
+    }
+    if(m_deadline != TimerClock::time_point::max() && getNow() >= m_deadline)
+    {
+        return ETIMEDOUT;
+    }
+    return 0;
+}
+
+void FiberInterrupt::interrupt(int err)
+{
+    std::lock_guard<Spinlock> lock(m_mutex);
+    if(m_cb)
+    { // 协程没有在等待时什么都不用做
+        m_cb(m_arg, err);
+    }
+}
+
+std::chrono::microseconds FiberInterrupt::remaining() const
+{
+    if(m_deadline == TimerClock::time_point::max())
+    {
+        return std::chrono::microseconds(-1);
+    }
+    TimerClock::time_point now = getNow();
+    if(now >= m_deadline)
+    {
+        return std::chrono::microseconds(0);
+    }
+    // 向上取整，还没到截止时间时不会返回0
+    return std::chrono::ceil<std::chrono::microseconds>(m_deadline - now);
+}
+
+void FiberInterrupt::setDeadline(TimerClock::time_point deadline)
+{
+    if(m_timers)
+    { // 回调正在执行时等它执行完，之后节点可以重新启动
+        m_timers->disarmTimeout(m_node);
+        m_timers = nullptr;
+    }
+    m_deadline = deadline;
+    IOManager *iom = IOManager::GetThis();
+    if(deadline == TimerClock::time_point::max() || !iom)
+    {
+        return;
+    }
+    std::chrono::microseconds left = remaining();
+    if(left.count() > 0)
+    { // 已经过了的截止时间不需要定时器，之后的等待在登记时就会失败
+        m_timers = iom;
+        iom->armTimeout(m_node, left, &FiberInterrupt::OnDeadline, this);
+    }
+}
+
+void FiberInterrupt::OnDeadline(void *arg)
+{
+    static_cast<FiberInterrupt *>(arg)->interrupt(ETIMEDOUT);
+}
+
+DeadlineScope::DeadlineScope(std::chrono::microseconds budget)
+    : m_interrupt(FiberInterrupt::GetThis(true)), m_prev(m_interrupt->getDeadline())
+{
+    TimerClock::time_point deadline = getNow() + budget;
+    if(deadline < m_prev)
+    {
+        m_interrupt->setDeadline(deadline);
+    }
+}
+
+DeadlineScope::~DeadlineScope()
+{
+    if(m_interrupt->getDeadline() != m_prev)
+    {
+        m_interrupt->setDeadline(m_prev);
+    }
+}
+
+std::chrono::microseconds DeadlineScope::Remaining()
+{
+    FiberInterrupt *interrupt = FiberInterrupt::GetThis(false);
+    return interrupt ? interrupt->remaining() : std::chrono::microseconds(-1);
+}
+
+void CancellationToken::cancel()
+{
+    if(m_cancelled.exchange(true, std::memory_order_acq_rel))
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(FiberInterrupt *fiber : m_fibers)
+    {
+        fiber->interrupt(ECANCELED);
+    }
+}
+
+CancellationScope::CancellationScope(CancellationToken::ptr token)
+    : m_interrupt(FiberInterrupt::GetThis(true)), m_token(std::move(token))
+{
+    m_interrupt->m_tokens.push_back(m_token.get());
+    std::lock_guard<std::mutex> lock(m_token->m_mutex);
+    m_token->m_fibers.push_back(m_interrupt);
+}
+
+CancellationScope::~CancellationScope()
+{
+    {
+        // 解除关联之后cancel不会再访问这个协程的打断状态
+        std::lock_guard<std::mutex> lock(m_token->m_mutex);
+        auto &fibers = m_token->m_fibers;
+        fibers.erase(std::find(fibers.begin(), fibers.end(), m_interrupt));
+    }
+    auto &tokens = m_interrupt->m_tokens;
+    tokens.erase(std::find(tokens.begin(), tokens.end(), m_token.get()));
+}
@@ -0,0 +1,143 @@
+// 协程阻塞等待的打断
+// 协程级别的截止时间和取消令牌通过它唤醒阻塞在hook调用、通道和同步原语中的协程
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "Fiber.h"
+#include "FiberSync.h"
+#include "Timer.h"
+
+class CancellationToken;
+
+// 每个协程一份，第一次使用时创建，随协程一起释放
+// 协程同一时刻最多有一个正在进行的可打断等待(hook的IO、connect、sleep，通道和同步原语的等待)，等待者登记唤醒自己的方法，
+// 截止时间到期时在idle中调用它，等待以ETIMEDOUT结束；关联的取消令牌被取消时在cancel中调用它，等待以ECANCELED结束
+// 截止时间和关联的令牌只由协程自己修改，超时节点每个协程只有一个，截止时间变化时重新启动
+class FiberInterrupt
+{
+    friend class CancellationScope;
+
+public:
+    // 打断回调，err为等待结束的错误码，在持有内部锁时调用，不能yield也不能再登记等待
+    typedef void (*Callback)(void *arg, int err);
+
+    // 当前协程的打断状态，create为false时不创建，还没有创建过返回nullptr
+    static FiberInterrupt *GetThis(bool create);
+
+    FiberInterrupt() {}
+
+    // 停止截止时间的超时节点
+    ~FiberInterrupt();
+
+    FiberInterrupt(const FiberInterrupt &) = delete;
+    FiberInterrupt &operator=(const FiberInterrupt &) = delete;
+
+    // 登记可打断的等待，之后到来的打断通过cb(arg, err)唤醒协程
+    // 已经被打断(见pending)时不登记，直接返回打断的原因，否则返回0
+    // 登记之后打断可能在yield之前就到来，cb要能处理协程还没有切出的情况
+    int beginWait(Callback cb, void *arg);
+
+    // 取消登记，打断回调正在执行时等它执行完，返回之后arg不会再被访问
+    void endWait();
+
+    // 已经到来的打断：关联的令牌被取消了返回ECANCELED，截止时间过了返回ETIMEDOUT，否则返回0
+    int pending() const;
+
+    // 打断正在进行的等待，没有等待时什么都不做
+    void interrupt(int err);
+
+    // 截止时间，没有时为TimerClock::time_point::max()
+    TimerClock::time_point getDeadline() const { return m_deadline; }
+
+    // 距离截止时间还有多久，没有截止时间时返回-1，已经过了时返回0
+    std::chrono::microseconds remaining() const;
+
+    // 修改截止时间，只能由协程自己调用
+    // 在IOManager中时启动超时节点，到期时打断正在进行的等待
+    void setDeadline(TimerClock::time_point deadline);
+
+private:
+    // 截止时间到期，在idle中执行
+    static void OnDeadline(void *arg);
+
+private:
+    Spinlock m_mutex;                                               // 保护m_cb和m_arg
+    Callback m_cb = nullptr;                                        // 正在进行的等待的打断方法
+    void *m_arg = nullptr;
+    TimerClock::time_point m_deadline = TimerClock::time_point::max();  // 截止时间
+    TimeoutNode m_node;                                             // 截止时间的超时节点
+    TimerManager *m_timers = nullptr;                               // 超时节点启动在哪个定时器管理器上
+    std::vector<CancellationToken *> m_tokens;                      // 关联的取消令牌
+};
+
+// 协程的截止时间
+// 作用域内当前协程hook的阻塞调用等待自己的超时(SO_RCVTIMEO/SO_SNDTIMEO、connect超时、sleep时长)和截止时间中较早的一个，
+// 截止时间到了IO和connect以ETIMEDOUT失败，sleep提前返回
+// 截止时间过了之后，作用域内的IO和connect不再执行，直接以ETIMEDOUT失败，迟到的工作可以尽早放弃
+// 通道的send/recv和同步原语的*_interruptible等待也在截止时间以ETIMEDOUT结束
+// 嵌套时取较早的截止时间，析构时恢复外层的截止时间，只能在同一个协程中构造和析构
+class DeadlineScope
+{
+public:
+    // 截止时间为现在加上budget
+    explicit DeadlineScope(std::chrono::microseconds budget);
+
+    ~DeadlineScope();
+
+    DeadlineScope(const DeadlineScope &) = delete;
+    DeadlineScope &operator=(const DeadlineScope &) = delete;
+
+    // 当前协程距离截止时间还有多久，没有截止时间时返回-1，已经过了时返回0
+    static std::chrono::microseconds Remaining();
+
+private:
+    FiberInterrupt *m_interrupt;        // 当前协程的打断状态
+    TimerClock::time_point m_prev;      // 外层的截止时间
+};
+
+// 取消令牌
+// 通过CancellationScope关联到协程，可以同时关联多个协程(比如对冲请求的几个副本)
+// cancel之后关联协程正在进行的可打断等待马上以ECANCELED结束，之后的等待也直接以ECANCELED失败，
+// 只唤醒这个协程，不影响在同一个fd或者同一个同步原语上等待的其他协程
+class CancellationToken
+{
+    friend class CancellationScope;
+public:
+    typedef std::shared_ptr<CancellationToken> ptr;
+
+    CancellationToken() {}
+
+    CancellationToken(const CancellationToken &) = delete;
+    CancellationToken &operator=(const CancellationToken &) = delete;
+
+    // 取消，可以在任意线程调用，多次调用只有第一次有效
+    void cancel();
+
+    bool isCancelled() const { return m_cancelled.load(std::memory_order_acquire); }
+
+private:
+    std::atomic<bool> m_cancelled {false};
+    std::mutex m_mutex;                         // 保护m_fibers，cancel持有它打断各个协程
+    std::vector<FiberInterrupt *> m_fibers;     // 关联的协程
+};
+
+// 把取消令牌关联到当前协程，析构时解除关联，只能在同一个协程中构造和析构
+// 可以嵌套，任何一个关联的令牌被取消都会打断协程
+class CancellationScope
+{
+public:
+    explicit CancellationScope(CancellationToken::ptr token);
+
+    ~CancellationScope();
+
+    CancellationScope(const CancellationScope &) = delete;
+    CancellationScope &operator=(const CancellationScope &) = delete;
+
+private:
+    FiberInterrupt *m_interrupt;        // 当前协程的打断状态
+    CancellationToken::ptr m_token;
+};
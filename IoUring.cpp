@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include "IoUring.h"
+
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define FIBER_HAVE_IO_URING 1
+#endif
+
+#ifdef FIBER_HAVE_IO_URING
+
+static int IoUringSetup(unsigned entries, io_uring_params *params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int IoUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    int rt = static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+    return rt < 0 ? -errno : rt;
+}
+
+IoUring::~IoUring()
+{
+    if(m_sqes) munmap(m_sqes, m_sqesSize);
+    if(m_cqRing && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+    if(m_sqRing) munmap(m_sqRing, m_sqRingSize);
+    if(m_ringFd >= 0) close(m_ringFd);
+}
+
+bool IoUring::init(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_ringFd = IoUringSetup(entries, &params);
+    if(m_ringFd < 0)
+    { // ENOSYS: 内核不支持，EPERM: 被禁用(kernel.io_uring_disabled或者seccomp)
+        return false;
+    }
+    // 等待时需要通过IORING_ENTER_EXT_ARG传入超时时间，NODROP保证CQ满时不会丢失完成事件
+    if(!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        close(m_ringFd);
+        m_ringFd = -1;
+        return false;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap)
+    { // SQ和CQ共用一次映射
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+    if(m_sqRing == MAP_FAILED)
+    {
+        m_sqRing = nullptr;
+        return false;
+    }
+    if(single_mmap)
+    {
+        m_cqRing = m_sqRing;
+    }
+    else
+    {
+        m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+        if(m_cqRing == MAP_FAILED)
+        {
+            m_cqRing = nullptr;
+            return false;
+        }
+    }
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+    {
+        return false;
+    }
+    m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(m_sqRing);
+    m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sqEntries = params.sq_entries;
+
+    char *cq = static_cast<char *>(m_cqRing);
+    m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+    // 关闭fd时通过submitCancelFd取消fd上的请求，不支持时不能使用io_uring
+    return probeCancelFd();
+}
+
+bool IoUring::probeCancelFd()
+{
+    // 按fd取消(IORING_ASYNC_CANCEL_FD/ALL)需要5.19以上，更早的内核在cancel_flags不为0时以-EINVAL拒绝请求
+    // 用ring自己的fd试一次，上面没有请求，支持时以-ENOENT或者0完成
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = m_ringFd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    flush();
+    int rt;
+    while((rt = IoUringEnter(m_ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0)) == -EINTR) {}
+    if(rt < 0 || !hasCompletions())
+    {
+        return false;
+    }
+    std::vector<Completion> completions;
+    reap(completions);
+    return completions[0].res != -EINVAL;
+}
+
+void IoUring::reserveSqes(unsigned count)
+{
+    if(*m_sqTail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) + count > m_sqEntries)
+    { // 空位不够，先把已经填写的请求交给内核
+        flush();
+    }
+}
+
+io_uring_sqe *IoUring::getSqe()
+{
+    reserveSqes(1);
+    unsigned tail = *m_sqTail;
+    unsigned index = tail & m_sqMask;
+    io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++m_sqPending;
+    return sqe;
+}
+
+void IoUring::flush()
+{
+    while(m_sqPending > 0)
+    {
+        int rt = IoUringEnter(m_ringFd, m_sqPending, 0, 0, nullptr, 0);
+        if(rt > 0)
+        {
+            m_sqPending -= rt;
+        }
+        else if(rt == 0 || (rt != -EINTR && rt != -EAGAIN && rt != -EBUSY))
+        { // 内核一个请求都没有取走，或者其他错误，说明ring本身有问题，重试只会持有锁一直空转
+            // 不可恢复，已经放入SQ的请求留给下一次提交
+            m_sqPending = 0;
+            break;
+        }
+    }
+}
+
+void IoUring::submit(const IoUringOp &op, uint64_t user_data, int64_t timeout_us, uint64_t timeout_data)
+{
+    std::lock_guard<std::mutex> lk(m_sqMutex);
+    // 带超时时两个SQE一起预留，否则取第二个时SQ满了会先提交带IOSQE_IO_LINK的请求，超时请求单独提交会被拒绝
+    reserveSqes(timeout_us >= 0 ? 2 : 1);
+    io_uring_sqe *sqe = getSqe();
+    sqe->fd = op.fd;
+    sqe->addr = reinterpret_cast<uint64_t>(op.addr);
+    sqe->user_data = user_data;
+    switch(op.type)
+    {
+        case IoUringOp::READ:
+        case IoUringOp::WRITE:
+            sqe->opcode = op.type == IoUringOp::READ ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->len = static_cast<uint32_t>(op.len);
+            sqe->off = static_cast<uint64_t>(-1); // 使用并更新文件当前偏移
+            break;
+        case IoUringOp::RECV:
+        case IoUringOp::SEND:
+            sqe->opcode = op.type == IoUringOp::RECV ? IORING_OP_RECV : IORING_OP_SEND;
+            sqe->len = static_cast<uint32_t>(op.len);
+            sqe->msg_flags = op.flags;
+            break;
+        case IoUringOp::ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->addr2 = reinterpret_cast<uint64_t>(op.addrlen);
+            break;
+        case IoUringOp::CONNECT:
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->off = op.len;
+            break;
+    }
+
+    // 链接的超时请求在提交时就会读取超时时间，ts放在栈上即可
+    __kernel_timespec ts;
+    if(timeout_us >= 0)
+    {
+        sqe->flags |= IOSQE_IO_LINK;
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        io_uring_sqe *timeout = getSqe();
+        timeout->opcode = IORING_OP_LINK_TIMEOUT;
+        timeout->fd = -1;
+        timeout->addr = reinterpret_cast<uint64_t>(&ts);
+        timeout->len = 1;
+        timeout->user_data = timeout_data;
+    }
+    flush();
+}
+
+void IoUring::submitNop(uint64_t user_data)
+{
+    std::lock_guard<std::mutex> lk(m_sqMutex);
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_NOP;
+    sqe->fd = -1;
+    sqe->user_data = user_data;
+    flush();
+}
+
+void IoUring::submitPoll(int fd, uint64_t user_data)
+{
+    std::lock_guard<std::mutex> lk(m_sqMutex);
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+    flush();
+}
+
+void IoUring::submitCancelFd(int fd, uint64_t user_data)
+{
+    std::lock_guard<std::mutex> lk(m_sqMutex);
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+    flush();
+}
+
+void IoUring::submitCancel(uint64_t target, uint64_t user_data)
+{
+    std::lock_guard<std::mutex> lk(m_sqMutex);
+    io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    flush();
+}
+
+int IoUring::wait(int64_t timeout_us)
+{
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    __kernel_timespec ts;
+    if(timeout_us >= 0)
+    {
+        ts.tv_sec = timeout_us / 1000000;
+        ts.tv_nsec = (timeout_us % 1000000) * 1000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+    int rt = IoUringEnter(m_ringFd, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    return rt < 0 ? rt : 0;
+}
+
+bool IoUring::hasCompletions() const
+{
+    return __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE) != __atomic_load_n(m_cqHead, __ATOMIC_RELAXED);
+}
+
+size_t IoUring::reap(std::vector<Completion> &completions)
+{
+    std::lock_guard<std::mutex> lk(m_cqMutex);
+    io_uring_cqe *cqes = static_cast<io_uring_cqe *>(m_cqes);
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    size_t n = tail - head;
+    for(; head != tail; ++head)
+    {
+        io_uring_cqe &cqe = cqes[head & m_cqMask];
+        completions.push_back({cqe.user_data, cqe.res});
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+#else // 没有io_uring头文件，init总是失败，IOManager退回epoll
+
+IoUring::~IoUring() {}
+bool IoUring::init(unsigned) { return false; }
+void IoUring::submit(const IoUringOp &, uint64_t, int64_t, uint64_t) {}
+void IoUring::submitNop(uint64_t) {}
+void IoUring::submitPoll(int, uint64_t) {}
+void IoUring::submitCancelFd(int, uint64_t) {}
+void IoUring::submitCancel(uint64_t, uint64_t) {}
+int IoUring::wait(int64_t) { return -ENOSYS; }
+bool IoUring::hasCompletions() const { return false; }
+size_t IoUring::reap(std::vector<Completion> &) { return 0; }
+
+#endif
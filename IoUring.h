@@ -0,0 +1,113 @@
+// io_uring 封装
+// 直接使用io_uring_setup/io_uring_enter系统调用，不依赖liburing
+
+#pragma once
+#include <stdint.h>
+#include <sys/socket.h>
+#include <mutex>
+#include <vector>
+
+struct io_uring_sqe;
+
+// 一次IO请求，由hook函数填写，IoUring转换成对应的SQE
+struct IoUringOp
+{
+    enum Type
+    {
+        READ = 0,   // read
+        WRITE,      // write
+        RECV,       // recv
+        SEND,       // send
+        ACCEPT,     // accept
+        CONNECT     // connect
+    };
+
+    Type type;
+    int fd;
+    const void *addr = nullptr;     // 读写缓冲区，accept/connect时为sockaddr
+    uint64_t len = 0;               // 缓冲区长度，connect时为addrlen
+    int flags = 0;                  // recv/send的flags
+    socklen_t *addrlen = nullptr;   // accept的addrlen
+};
+
+class IoUring
+{
+public:
+    // 一个完成事件
+    struct Completion
+    {
+        uint64_t userData;
+        int32_t res;
+    };
+
+    IoUring() = default;
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // 创建ring，内核不支持io_uring或者缺少需要的特性(IORING_FEAT_EXT_ARG，5.11以上；按fd取消请求，5.19以上)时返回false
+    bool init(unsigned entries);
+
+    // 提交一个IO请求，timeout_us >= 0时链接一个超时请求，超时后IO请求以-ECANCELED完成
+    // 超时请求自己的完成事件使用timeout_data
+    void submit(const IoUringOp &op, uint64_t user_data, int64_t timeout_us, uint64_t timeout_data);
+
+    // 提交一个空操作，用于唤醒等待完成事件的线程
+    void submitNop(uint64_t user_data);
+
+    // 提交一次性的poll请求，fd可读时完成
+    void submitPoll(int fd, uint64_t user_data);
+
+    // 取消fd上所有还没完成的请求，被取消的请求以-ECANCELED完成
+    void submitCancelFd(int fd, uint64_t user_data);
+
+    // 取消user_data为target的请求，被取消的请求以-ECANCELED完成
+    void submitCancel(uint64_t target, uint64_t user_data);
+
+    // 等待至少一个完成事件，timeout_us < 0时一直等待
+    // 超时或者被信号打断时返回负的错误码
+    int wait(int64_t timeout_us);
+
+    // 完成队列中是否有还没取出的事件，不需要系统调用，用于忙轮询
+    bool hasCompletions() const;
+
+    // 取出所有已经完成的事件，返回数量
+    size_t reap(std::vector<Completion> &completions);
+
+private:
+    // 保证SQ中至少有count个空位，不够时先提交已经填写的请求，调用者持有m_sqMutex
+    void reserveSqes(unsigned count);
+
+    // 取一个空闲的SQE，SQ满时先提交，调用者持有m_sqMutex
+    io_uring_sqe *getSqe();
+
+    // 把SQ中的请求提交给内核，调用者持有m_sqMutex
+    void flush();
+
+    // 内核是否支持按fd取消请求，只在init中调用
+    bool probeCancelFd();
+
+private:
+    int m_ringFd = -1;
+    // SQ
+    void *m_sqRing = nullptr;
+    size_t m_sqRingSize = 0;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sqesSize = 0;
+    unsigned *m_sqHead = nullptr;
+    unsigned *m_sqTail = nullptr;
+    unsigned *m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned m_sqPending = 0;       // 已经填写还没有提交的SQE数量
+    // CQ
+    void *m_cqRing = nullptr;
+    size_t m_cqRingSize = 0;
+    unsigned *m_cqHead = nullptr;
+    unsigned *m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    void *m_cqes = nullptr;
+    std::mutex m_sqMutex;           // 多个线程都会提交请求
+    std::mutex m_cqMutex;           // 多个空闲线程可能同时收割完成事件
+};
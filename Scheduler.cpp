@@ -1,3 +1,9 @@
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sched.h>
+#include <algorithm>
+#include <climits>
 #include "Scheduler.h"
 
 // 当前线程的调度器，同一个调度器下所有协程共享同一个实例
@@ -6,6 +12,35 @@ static thread_local Scheduler *t_scheduler = nullptr;
 // 当前线程的调度协程
 static thread_local Fiber *t_scheduler_fiber = nullptr;
 
+// 当前线程在调度器中的工作线程编号，和t_scheduler一起使用
+static thread_local size_t t_worker_index = static_cast<size_t>(-1);
+
+// park时自旋的轮数，前PAUSE_ROUNDS轮执行指数增长次数的pause，之后每轮sched_yield
+static const int SPIN_ROUNDS = 16;
+static const int PAUSE_ROUNDS = 6;
+
+// 每个工作线程最多缓存的空闲任务节点数量，窃取多于放入的线程超出的部分直接释放
+static const size_t MAX_FREE_TASK_NODES = 256;
+
+static inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void FutexWait(std::atomic<uint32_t> *addr, uint32_t expected)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+static inline void FutexWake(std::atomic<uint32_t> *addr, int count)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+}
+
 Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
 {
     assert(threads > 0);
@@ -27,10 +62,24 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string &name)
         t_scheduler_fiber = m_rootFiber.get();
         m_rootThread = std::this_thread::get_id();
         m_threadIds.emplace_back(m_rootThread);
+        t_worker_index = 0; // caller线程是0号工作线程
     }
     else m_rootThread = std::thread::id(-1);
 
     m_threadCount = threads;
+
+    // 每个工作线程一个本地任务队列和一个信箱
+    size_t worker_count = m_threadCount + (use_caller ? 1 : 0);
+    for(size_t i = 0; i < worker_count; ++i)
+    {
+        m_workers.emplace_back(new Worker);
+        m_workers[i]->index = i;
+        m_workers[i]->seed = i * 0x9E3779B97F4A7C15ull + 1;
+    }
+    if(use_caller)
+    {
+        m_workers[0]->threadId = m_rootThread;
+    }
 }
 
 Scheduler *Scheduler::GetThis()
@@ -52,6 +101,147 @@ Scheduler::~Scheduler()
 {
     assert(this->m_stopping);
     if(GetThis() == this) t_scheduler = nullptr;
+    // 正常停止时所有队列都已经清空，这里只是保险
+    for(auto &worker : m_workers)
+    {
+        ScheduleTask *task = nullptr;
+        while(worker->local.steal(task) != WorkStealingQueue<ScheduleTask *>::EMPTY)
+        {
+            delete task;
+            task = nullptr;
+        }
+    }
+}
+
+Scheduler::Worker *Scheduler::localWorker()
+{
+    if(t_scheduler != this || t_worker_index >= m_workers.size())
+    {
+        return nullptr;
+    }
+    return m_workers[t_worker_index].get();
+}
+
+size_t Scheduler::getWorkerIndex()
+{
+    Worker *worker = localWorker();
+    return worker ? worker->index : static_cast<size_t>(-1);
+}
+
+Scheduler::Worker *Scheduler::findWorker(std::thread::id id)
+{
+    for(auto &worker : m_workers)
+    {
+        if(worker->threadId.load() == id) return worker.get();
+    }
+    return nullptr;
+}
+
+bool Scheduler::postToMailbox(Worker &worker, ScheduleTask &task)
+{
+    {
+        std::lock_guard<std::mutex> lk(worker.mailboxMutex);
+        ++m_taskCount;
+        worker.mailbox.push_back(std::move(task));
+        ++worker.mailboxCount;
+    }
+    return worker.idle;
+}
+
+void Scheduler::submit(ScheduleTask &task)
+{
+    if(task.thread != std::thread::id(-1))
+    { // 指定了线程的任务直接放入目标线程的信箱，只唤醒目标线程
+        // 找不到目标线程时(例如工作线程还没启动)退回注入队列
+        Worker *target = findWorker(task.thread);
+        if(target)
+        {
+            if(postToMailbox(*target, task)) tickleWorker(target->index);
+            return;
+        }
+    }
+
+    Worker *worker = localWorker();
+    if(worker)
+    { // 工作线程自己添加的任务，放入本地队列，无锁
+        ++m_taskCount;
+        pushLocal(*worker, task);
+        // 和park中先标记parked再检查任务配合，保证要么空闲线程看到任务，要么这里看到空闲线程
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        scheduleNoLock(task);
+    }
+    // 有空闲线程时通知它们来取任务或者窃取任务
+    if(hasIdleThreads()) tickle();
+}
+
+void Scheduler::submitBatch(std::vector<ScheduleTask> &tasks)
+{
+    size_t count = 0; // 放入本地队列或注入队列的任务数量
+    Worker *worker = localWorker();
+    std::unique_lock<std::mutex> lk(m_mutex, std::defer_lock);
+    for(ScheduleTask &task : tasks)
+    {
+        if(task.thread != std::thread::id(-1))
+        { // 指定了线程的任务仍然放入目标线程的信箱
+            Worker *target = findWorker(task.thread);
+            if(target)
+            {
+                if(postToMailbox(*target, task)) tickleWorker(target->index);
+                continue;
+            }
+        }
+
+        ++count;
+        if(worker)
+        {
+            ++m_taskCount;
+            pushLocal(*worker, task);
+        }
+        else
+        { // 整批任务只加一次锁
+            if(!lk.owns_lock()) lk.lock();
+            scheduleNoLock(task);
+        }
+    }
+    if(lk.owns_lock()) lk.unlock();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    // 最多唤醒和新任务数量一样多的空闲线程
+    size_t wake = std::min(count, m_idleThreadCount.load());
+    for(size_t i = 0; i < wake; ++i)
+    {
+        tickle();
+    }
+}
+
+bool Scheduler::runNext(ScheduleTask &task)
+{
+    Worker *worker = localWorker();
+    if(!worker || (task.thread != std::thread::id(-1) && task.thread != std::this_thread::get_id()))
+    {
+        return false;
+    }
+    if(worker->runNext.fiber || worker->runNext.cb)
+    { // 槽位被占用，原来的任务放入本地队列，它已经计入m_taskCount
+        pushLocal(*worker, worker->runNext);
+        worker->runNext.reset();
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(hasIdleThreads()) tickle();
+    }
+    ++m_taskCount;
+    worker->runNext = std::move(task);
+    return true;
+}
+
+void Scheduler::scheduleNoLock(ScheduleTask &task)
+{
+    ++m_taskCount;
+    m_tasks.push_back(std::move(task));
+    ++m_injectedCount;
 }
 
 void Scheduler::start()
@@ -68,26 +258,111 @@ void Scheduler::start()
     {
         m_threads[i].reset(new std::thread(std::bind(&Scheduler::run, this), m_name + "_" + std::to_string(i)));
         m_threadIds.emplace_back(m_threads[i]->get_id());
+        m_workers[m_threadIds.size() - 1]->threadId = m_threadIds.back();
     }
 }
 
 bool Scheduler::stopping()
 {
-    std::lock_guard<std::mutex> lk(m_mutex);
-    return (m_stopping && m_tasks.empty() && m_activeThreadCount == 0);
+    // 取任务时先增加活跃线程数再减少任务数，所以这里先读任务数再读活跃线程数，不会漏掉正在转手的任务
+    return (m_stopping && m_taskCount == 0 && m_activeThreadCount == 0);
 }
 
 void Scheduler::idle()
 {
+    Worker *worker = localWorker();
     while(!stopping())
     {
+        if(worker) park(*worker);
         Fiber::GetThis()->yield();
     }
+    // 最后一个任务执行完之后，其他线程可能还在睡眠，叫醒它们一起退出
+    unparkAll();
+}
+
+bool Scheduler::hasWork(Worker &worker)
+{
+    if(worker.runNext.fiber || worker.runNext.cb || worker.mailboxCount > 0 || m_injectedCount > 0)
+    {
+        return true;
+    }
+    for(auto &w : m_workers)
+    {
+        if(!w->local.empty()) return true;
+    }
+    return false;
+}
+
+bool Scheduler::hasPendingWork()
+{
+    Worker *worker = localWorker();
+    return worker && hasWork(*worker);
+}
+
+void Scheduler::park(Worker &worker)
+{
+    // 先自旋，任务很快到来时避免一次睡眠和唤醒的系统调用
+    for(int i = 0; i < SPIN_ROUNDS; ++i)
+    {
+        if(hasWork(worker) || stopping())
+        {
+            return;
+        }
+        if(i < PAUSE_ROUNDS)
+        {
+            for(int j = 0; j < (1 << i); ++j) CpuRelax();
+        }
+        else sched_yield();
+    }
+
+    // 先读取序号再标记parked，之后的唤醒都会改变序号，futex_wait会立即返回，不会丢失唤醒
+    uint32_t seq = worker.parkSeq.load();
+    worker.parked = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(hasWork(worker) || stopping())
+    {
+        worker.parked = false;
+        return;
+    }
+    FutexWait(&worker.parkSeq, seq);
+    worker.parked = false;
+}
+
+void Scheduler::unpark(Worker &worker)
+{
+    ++worker.parkSeq;
+    if(worker.parked)
+    {
+        FutexWake(&worker.parkSeq, 1);
+    }
+}
+
+void Scheduler::unparkAll()
+{
+    for(auto &worker : m_workers)
+    {
+        unpark(*worker);
+    }
 }
 
+// 唤醒一个睡眠的工作线程，没有线程睡眠时说明空闲线程还在自旋，它们自己会发现新任务
 void Scheduler::tickle()
 {
+    for(auto &worker : m_workers)
+    {
+        bool expected = true;
+        if(worker->parked && worker->parked.compare_exchange_strong(expected, false))
+        {
+            ++worker->parkSeq;
+            FutexWake(&worker->parkSeq, 1);
+            return;
+        }
+    }
+}
 
+void Scheduler::tickleWorker(size_t index)
+{
+    unpark(*m_workers[index]);
 }
 
 void Scheduler::stop()
@@ -128,6 +403,144 @@ void Scheduler::stop()
     for(auto &t : thrs) t->join();
 }
 
+bool Scheduler::takeInjected(ScheduleTask &task)
+{
+    if(m_injectedCount == 0)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(m_mutex);
+    auto it = m_tasks.begin();
+    // 遍历所有任务
+    while(it != m_tasks.end())
+    {
+        if(it->thread != std::thread::id(-1) && it->thread != std::this_thread::get_id())
+        { // 指定了调度线程，但是不是在当前线程上调度
+            ++it;
+            continue;
+        }
+        // [fix bug]
+        // 多线程高并发情境下，有可能发生刚添加事件就被触发的情况，如果此时当前协程还未来得及yield，则这里就有可能出现协程状态仍为RUNNING的情况
+        // 这里简单地跳过这种情况，以损失一点性能为代价，否则整个协程框架都要大改
+        if(it->fiber && it->fiber->getState() == Fiber::RUNNING)
+        {
+            ++it;
+            continue;
+        }
+
+        // 到此位置，找到一个调度任务，准备开始调度，将其从任务队列中剔除
+        task = std::move(*it);
+        m_tasks.erase(it);
+        --m_injectedCount;
+        return true;
+    }
+    return false;
+}
+
+bool Scheduler::stealTask(Worker &worker, ScheduleTask &task)
+{
+    size_t n = m_workers.size();
+    if(n <= 1)
+    {
+        return false;
+    }
+    // xorshift随机选择一个起点，依次尝试其他工作线程
+    worker.seed ^= worker.seed << 13;
+    worker.seed ^= worker.seed >> 7;
+    worker.seed ^= worker.seed << 17;
+    size_t start = worker.seed % n;
+    for(size_t i = 0; i < n; ++i)
+    {
+        Worker &victim = *m_workers[(start + i) % n];
+        if(&victim == &worker)
+        {
+            continue;
+        }
+        ScheduleTask *stolen = nullptr;
+        WorkStealingQueue<ScheduleTask *>::StealResult rt;
+        while((rt = victim.local.steal(stolen)) == WorkStealingQueue<ScheduleTask *>::ABORT) {}
+        if(rt == WorkStealingQueue<ScheduleTask *>::SUCCESS)
+        {
+            task = std::move(*stolen);
+            freeTaskNode(worker, stolen);
+            return true;
+        }
+    }
+    return false;
+}
+
+void Scheduler::pushLocal(Worker &worker, ScheduleTask &task)
+{
+    // 节点由取走任务的工作线程交还给自己的空闲链表，每个线程只访问自己的链表，不需要同步
+    // 稳定状态下放入和取出的节点数量相当，调度任务不再需要分配内存
+    ScheduleTask *node;
+    if(!worker.freeNodes.empty())
+    {
+        node = worker.freeNodes.back();
+        worker.freeNodes.pop_back();
+        *node = std::move(task);
+    }
+    else
+    {
+        node = new ScheduleTask(std::move(task));
+    }
+    worker.local.push(node);
+}
+
+void Scheduler::freeTaskNode(Worker &worker, ScheduleTask *node)
+{
+    if(worker.freeNodes.size() < MAX_FREE_TASK_NODES)
+    { // 任务已经被移走，节点不再持有协程和回调
+        node->reset();
+        worker.freeNodes.push_back(node);
+    }
+    else
+    {
+        delete node;
+    }
+}
+
+bool Scheduler::takeTask(Worker &worker, ScheduleTask &task)
+{
+    if(worker.runNext.fiber || worker.runNext.cb)
+    { // runnext槽位中的任务是刚刚在本线程就绪的，缓存还是热的，最先执行
+        task = std::move(worker.runNext);
+        worker.runNext.reset();
+        return true;
+    }
+    if(worker.mailboxCount > 0)
+    { // 信箱里的任务只能由自己执行，优先处理
+        std::lock_guard<std::mutex> lk(worker.mailboxMutex);
+        for(auto it = worker.mailbox.begin(); it != worker.mailbox.end(); ++it)
+        {
+            // 和注入队列一样，跳过还没来得及yield的协程
+            if(it->fiber && it->fiber->getState() == Fiber::RUNNING)
+            {
+                continue;
+            }
+            task = std::move(*it);
+            worker.mailbox.erase(it);
+            --worker.mailboxCount;
+            return true;
+        }
+    }
+
+    ScheduleTask *local = nullptr;
+    WorkStealingQueue<ScheduleTask *>::StealResult rt;
+    while((rt = worker.local.steal(local)) == WorkStealingQueue<ScheduleTask *>::ABORT) {}
+    if(rt == WorkStealingQueue<ScheduleTask *>::SUCCESS)
+    {
+        task = std::move(*local);
+        freeTaskNode(worker, local);
+        return true;
+    }
+    if(takeInjected(task))
+    {
+        return true;
+    }
+    return stealTask(worker, task);
+}
+
 // 协程调度函数
 void Scheduler::run()
 {
@@ -137,6 +550,20 @@ void Scheduler::run()
     { // 在非caller线程里，调度协程就是非caller线程的主协程，也就是说每个线程都必须有自己的调度协程用于进行协程间的切换
         t_scheduler_fiber = Fiber::GetThis().get();
     }
+    {
+        // start()持有锁时记录线程id，这里加锁保证能找到自己的编号
+        std::lock_guard<std::mutex> lk(m_mutex);
+        for(size_t i = 0; i < m_threadIds.size(); ++i)
+        {
+            if(m_threadIds[i] == std::this_thread::get_id())
+            {
+                t_worker_index = i;
+                break;
+            }
+        }
+    }
+    Worker &worker = *m_workers[t_worker_index];
+    worker.running = true;
     Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
 
     // 进行协程调度
@@ -145,42 +572,26 @@ void Scheduler::run()
     for(;;)
     {
         task.reset();
-        bool tickle_me = false;
-        {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            auto it = m_tasks.begin();
-            // 遍历所有任务
-            while(it != m_tasks.end())
-            {
-                if(it->thread != std::thread::id(-1) && it->thread != std::this_thread::get_id())
-                { // 指定了调度线程，但是不是在当前线程上调度，标记一下需要通知其他线程进行调度
-                    ++it;
-                    tickle_me = true;
-                    continue;
+        if(takeTask(worker, task))
+        { // 取到一个任务，活跃线程数加1
+            ++m_activeThreadCount;
+            --m_taskCount;
+            if(task.fiber && task.fiber->getState() == Fiber::RUNNING)
+            { // 协程刚被加入调度还没来得及yield，放回注入队列等它yield之后再执行
+                if(task.thread != std::thread::id(-1))
+                {
+                    postToMailbox(worker, task);
                 }
-                // [fix bug]
-                // 多线程高并发情境下，有可能发生刚添加事件就被触发的情况，如果此时当前协程还未来得及yield，则这里就有可能出现协程状态仍为RUNNING的情况
-                // 这里简单地跳过这种情况，以损失一点性能为代价，否则整个协程框架都要大改
-                if(it->fiber && it->fiber->getState() == Fiber::RUNNING)
+                else
                 {
-                    ++it;
-                    continue;
+                    std::lock_guard<std::mutex> lk(m_mutex);
+                    scheduleNoLock(task);
                 }
-
-                // 到此位置，找到一个调度任务，准备开始调度，将其从任务队列中剔除，活动线程数加1
-                task = *it;
-                m_tasks.erase(it++);
-                ++m_activeThreadCount;
-                break;
+                --m_activeThreadCount;
+                continue;
             }
-            // 当前线程拿完一个任务后，发现任务队列还有剩余，那么tickle一下其他线程
-            tickle_me |= (it != m_tasks.end());
         }
 
-        if(tickle_me)
-        {
-            tickle();
-        }
         // 执行任务
         if(task.fiber)
         {
@@ -190,23 +601,42 @@ void Scheduler::run()
             task.reset();
         }
         else if(task.cb)
-        { // 转化为协程
+        { // 转化为协程，上一个回调协程已经执行完毕时直接复用它和它的栈
             if(cb_fiber) cb_fiber->reset(task.cb);
             else cb_fiber.reset(new Fiber(task.cb));
             task.reset();
             cb_fiber->resume();
             --m_activeThreadCount;
-            cb_fiber.reset();
+            // 现在是TERM也可能是回调中途yield之后被其他线程resume执行完的，那个线程可能还没有从最后一次切换中返回，
+            // 只有没有其他人持有它时才能确定它已经完全切出，可以复用
+            if(cb_fiber->getState() != Fiber::TERM || cb_fiber.use_count() != 1)
+            { // 回调中途yield了，协程已经交给别人管理，下一个回调需要新建协程
+                cb_fiber.reset();
+            }
+            else
+            { // 和其他线程释放引用时的release配对，看到它切出时保存的上下文
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
         }
         else
         { // 至此，任务队列空了，调度idle协程
             if(idle_fiber->getState() == Fiber::TERM)
             { // 如果调度器没有调度任务，那么idle协程会不停地resume/yield，不会结束，如果idle协程结束了，那一定是调度器停止了
+                worker.running = false;
                 break;
             }
 
             ++m_idleThreadCount;
+            worker.idle = true;
+            // 先标记idle再检查信箱，和postToMailbox中先放任务再检查idle配合，保证不会漏掉唤醒
+            if(worker.mailboxCount > 0)
+            {
+                worker.idle = false;
+                --m_idleThreadCount;
+                continue;
+            }
             idle_fiber->resume();
+            worker.idle = false;
             --m_idleThreadCount;
         }
     }
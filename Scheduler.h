@@ -1,15 +1,23 @@
 // 协程调度器
 #pragma once
 #include <functional>
+#include <deque>
 #include <list>
 #include <memory>
 #include <string>
 #include <mutex>
 #include <thread>
+#include <vector>
 #include "Fiber.h"
+#include "WorkStealingQueue.h"
 
 // 协程调度器
 // 封装的是N-M的协程调度器，内部有一个线程池，支持协程在线程池里面切换
+// 每个工作线程有自己的本地任务队列，工作线程自己添加的任务直接放入本地队列，不需要加锁
+// 外部线程添加的任务放入全局注入队列，本地队列和注入队列都空了的线程会去窃取其他线程本地队列中的任务
+// 指定了线程的任务放入目标线程自己的信箱，取任务时不需要遍历其他线程的任务，也只唤醒目标线程
+// 没有任务的工作线程先自旋，再通过futex睡眠，tickle()只唤醒一个睡眠的线程
+// 每个工作线程还有一个runnext槽位，放在里面的任务是该线程下一个执行的任务，不会被窃取
 
 
 class Scheduler
@@ -37,24 +45,89 @@ public:
     template <typename FiberOrcb>
     void schedule(FiberOrcb fc, std::thread::id thread = std::thread::id(-1))
     {
-        bool need_tickle = false;
+        ScheduleTask task(fc, thread);
+        if(task.fiber || task.cb)
+        {
+            submit(task);
+        }
+    }
+
+    // 批量添加调度任务，[first, last)中的元素是协程或者函数
+    // 只加一次锁，并且最多唤醒和任务数量一样多的空闲线程
+    template <typename Iterator>
+    void scheduleBatch(Iterator first, Iterator last, std::thread::id thread = std::thread::id(-1))
+    {
+        std::vector<ScheduleTask> tasks;
+        for(; first != last; ++first)
         {
-            std::lock_guard<std::mutex> lk(m_mutex);
-            need_tickle = scheduleNoLock(fc, thread);
+            ScheduleTask task(*first, thread);
+            if(task.fiber || task.cb)
+            {
+                tasks.emplace_back(std::move(task));
+            }
         }
-        if(need_tickle) tickle(); // 唤醒idle协程
+        submitBatch(tasks);
     }
 
     // 启动调度器
     void start();
 
+    // 工作线程数量，包含 use_caller 的主线程
+    size_t getWorkerCount() const { return m_workers.size(); }
+
+    // 指定编号的工作线程的线程id，start()之前还没有创建的线程返回std::thread::id(-1)
+    // 编号从0开始，use_caller时0号是调度器所在的线程
+    std::thread::id getWorkerThreadId(size_t index) const { return m_workers[index]->threadId; }
+
     // 停止调度器
     void stop();
 
 protected:
+    // 调度任务，协程/函数二选一，可指定在哪个线程上调度
+    struct ScheduleTask
+    {
+        Fiber::ptr fiber; 
+        std::function<void()> cb;
+        std::thread::id thread; // 在哪个线程上调度
+        
+        // 在这里创建协程
+        // 共享栈协程只能在绑定的线程上运行，这里强制指定调度线程
+        ScheduleTask(Fiber::ptr f, std::thread::id thr = std::thread::id(-1)) : fiber(f), thread(thr) { bindThread(); }
+        ScheduleTask(Fiber::ptr *f, std::thread::id thr = std::thread::id(-1))
+        {
+            fiber.swap(*f);
+            thread = thr;
+            bindThread();
+        }
+        ScheduleTask(std::function<void()> f, std::thread::id thr = std::thread::id(-1))
+        {
+            cb = f;
+            thread = thr;
+        }
+        ScheduleTask() { thread = std::thread::id(-1); }
+
+        void bindThread()
+        {
+            if(fiber && fiber->getBoundThread() != std::thread::id(-1))
+            {
+                thread = fiber->getBoundThread();
+            }
+        }
+
+        void reset()
+        {
+            fiber = nullptr;
+            cb = nullptr;
+            thread = std::thread::id(-1);
+        }
+    };
+
     // 通知协程调度器有任务了
     virtual void tickle();
 
+    // 通知指定的工作线程有任务了，默认唤醒该线程的park
+    virtual void tickleWorker(size_t index);
+
     // 协程调度函数
     void run();
 
@@ -70,59 +143,111 @@ protected:
     // 返回是否有空闲线程
     bool hasIdleThreads() { return m_idleThreadCount > 0; }
 
+    // 当前线程的工作线程编号，不是本调度器的工作线程时返回-1
+    size_t getWorkerIndex();
+
+    // 指定的工作线程是否正在执行idle协程
+    bool isWorkerIdle(size_t index) const { return m_workers[index]->idle; }
+
+    // 指定的工作线程的信箱中是否有任务
+    bool hasMailboxWork(size_t index) const { return m_workers[index]->mailboxCount > 0; }
+
+    // 指定的工作线程是否正在run()中调度，use_caller时0号线程只有在stop()中才会进入调度
+    bool isWorkerRunning(size_t index) const { return m_workers[index]->running; }
+
+    // 分配给指定工作线程的fd和定时器能否及时处理
+    // 普通工作线程启动之后就会进入调度；use_caller时0号线程只有在stop()中进入调度之后才可以
+    bool isWorkerAvailable(size_t index) const { return index != 0 || !m_useCaller || isWorkerRunning(0); }
+
+    // 批量提交任务，提交之后tasks中的元素被移走
+    void submitBatch(std::vector<ScheduleTask> &tasks);
+
+    // 把任务放入当前工作线程的runnext槽位，回到调度协程之后最先执行，不经过任何队列
+    // 槽位中原来的任务被挤到本地队列；当前线程不是本调度器的工作线程，或者任务指定了其他线程时返回false
+    bool runNext(ScheduleTask &task);
+
+    // 当前工作线程是否有可以执行的任务，不是本调度器的工作线程时返回false
+    bool hasPendingWork();
+
 
 private:
-    // 添加调度任务，无锁
-    // FiberOrCB 可以是协程对象也可以是函数指针
-    template <typename FiberOrCb>
-    bool scheduleNoLock(FiberOrCb fc, std::thread::id thread)
-    {
-        bool need_tickle = m_tasks.empty();
-        ScheduleTask task(fc, thread);
-        if(task.fiber || task.cb)
-        {
-            m_tasks.push_back(task);
-        }
-        return need_tickle;
-    }
+    struct Worker;
+
+    // 提交一个任务：指定了线程的任务放入目标线程的信箱；当前线程是本调度器的工作线程时放入本地队列，否则放入注入队列
+    void submit(ScheduleTask &task);
+
+    // 查找线程id对应的工作线程，找不到返回nullptr
+    Worker *findWorker(std::thread::id id);
+
+    // 向工作线程的信箱添加任务，返回是否需要唤醒该线程
+    bool postToMailbox(Worker &worker, ScheduleTask &task);
+
+    // 向注入队列添加调度任务，调用者需要持有m_mutex
+    void scheduleNoLock(ScheduleTask &task);
+
+    // 为当前工作线程取一个任务：信箱 -> 本地队列 -> 注入队列 -> 窃取其他线程
+    bool takeTask(Worker &worker, ScheduleTask &task);
+
+    // 从注入队列中取一个可以在当前线程执行的任务
+    bool takeInjected(ScheduleTask &task);
+
+    // 从其他工作线程的本地队列中窃取一个任务
+    bool stealTask(Worker &worker, ScheduleTask &task);
+
+    // 把任务放入工作线程的本地队列，只能由该工作线程调用
+    void pushLocal(Worker &worker, ScheduleTask &task);
+
+    // 从本地队列取出的任务节点用完之后交还给当前工作线程的空闲链表
+    void freeTaskNode(Worker &worker, ScheduleTask *node);
+
+    // 当前线程对应的工作线程，不是本调度器的工作线程时返回nullptr
+    Worker *localWorker();
+
+    // 是否有当前工作线程可以执行的任务
+    bool hasWork(Worker &worker);
+
+    // 没有任务时挂起当前工作线程：先自旋一会儿，仍然没有任务再用futex睡眠
+    void park(Worker &worker);
+
+    // 唤醒指定的工作线程，线程还没睡眠时它下一次park会立即返回
+    void unpark(Worker &worker);
+
+    // 唤醒所有睡眠的工作线程
+    void unparkAll();
 
 private:
 
-    // 调度任务，协程/函数二选一，可指定在哪个线程上调度
-    struct ScheduleTask
+    // 工作线程
+    struct Worker
     {
-        Fiber::ptr fiber; 
-        std::function<void()> cb;
-        std::thread::id thread; // 在哪个线程上调度
-        
-        // 在这里创建协程
-        ScheduleTask(Fiber::ptr f, std::thread::id thr) : fiber(f), thread(thr) {}
-        ScheduleTask(Fiber::ptr *f, std::thread::id thr)
-        {
-            fiber.swap(*f);
-            thread = thr;
-        }
-        ScheduleTask(std::function<void()> f, std::thread::id thr)
-        {
-            cb = f;
-            thread = thr;
-        }
-        ScheduleTask() { thread = std::thread::id(-1); }
+        size_t index = 0;                                       // 工作线程编号
+        std::atomic<std::thread::id> threadId {std::thread::id(-1)}; // 线程id，start()之后才确定
+        WorkStealingQueue<ScheduleTask *> local;                // 本地任务队列
+        uint64_t seed = 0;                                      // 选择窃取目标的随机数种子
+        std::atomic<bool> idle {false};                         // 是否正在执行idle协程
+        std::atomic<bool> running {false};                      // 是否正在run()中调度
+        std::atomic<uint32_t> parkSeq {0};                      // futex等待的地址，每次唤醒加1
+        std::atomic<bool> parked {false};                       // 是否正在(或即将)futex睡眠
 
-        void reset()
-        {
-            fiber = nullptr;
-            cb = nullptr;
-            thread = std::thread::id(-1);
-        }
+        MutexType mailboxMutex;                                 // 信箱的锁
+        std::deque<ScheduleTask> mailbox;                       // 信箱，指定在该线程上执行的任务
+        std::atomic<size_t> mailboxCount {0};                   // 信箱中的任务数量，用于不加锁判断信箱是否为空
+
+        ScheduleTask runNext;                                   // 下一个执行的任务，只有工作线程自己访问
+        std::vector<ScheduleTask *> freeNodes;                  // 本地队列任务节点的空闲链表，只有工作线程自己访问
+
+        ~Worker() { for(ScheduleTask *node : freeNodes) delete node; }
     };
 
 private:
     std::string m_name;                                 // 协程调度器名称
     MutexType m_mutex;                                  // 互斥锁
     std::vector<std::shared_ptr<std::thread>> m_threads;// 线程池
-    std::list<ScheduleTask> m_tasks;                    // 任务队列
+    std::list<ScheduleTask> m_tasks;                    // 注入队列，外部线程添加的任务
+    std::atomic<size_t> m_injectedCount {0};            // 注入队列中的任务数量，用于不加锁判断注入队列是否为空
+    std::atomic<size_t> m_taskCount {0};                // 所有队列中等待执行的任务总数
     std::vector<std::thread::id> m_threadIds;           // 记录工作线程的id
+    std::vector<std::unique_ptr<Worker>> m_workers;     // 工作线程，与m_threadIds一一对应
     size_t m_threadCount = 0;                           // 工作线程的数量，不包含 use_caller 的主线程
     std::atomic<size_t> m_activeThreadCount {0};        // 活跃的线程数量
     std::atomic<size_t> m_idleThreadCount {0};          // idle线程数量
@@ -131,5 +256,5 @@ private:
     Fiber::ptr m_rootFiber;                             // m_useCaller为true时，调度器所在线程的调度协程
     std::thread::id m_rootThread = std::thread::id(-1); // m_userCaller为true时，调度器所在线程的ID
 
-    bool m_stopping = false;                            // 调度器是否正在停止
+    std::atomic<bool> m_stopping {false};               // 调度器是否正在停止
 };
\ No newline at end of file
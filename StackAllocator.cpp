@@ -0,0 +1,224 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
+#include "StackAllocator.h"
+#include "Fiber.h"
+
+// 最小的栈级别 16KB，共8个级别，最大 2MB
+static const size_t MIN_CLASS_SIZE = 16 * 1024;
+static const int CLASS_COUNT = 8;
+
+// 每个线程每个级别默认最多缓存的栈数量
+static std::atomic<size_t> s_pool_capacity{128};
+
+// 通过mmap新建的栈总数
+static std::atomic<uint64_t> s_mapped_count{0};
+
+static size_t PageSize()
+{
+    static const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page;
+}
+
+// 根据大小计算所属级别，超出最大级别返回-1
+static int SizeClass(size_t size)
+{
+    size_t class_size = MIN_CLASS_SIZE;
+    for(int i = 0; i < CLASS_COUNT; ++i)
+    {
+        if(size <= class_size) return i;
+        class_size <<= 1;
+    }
+    return -1;
+}
+
+static size_t ClassSize(int cls)
+{
+    return MIN_CLASS_SIZE << cls;
+}
+
+// 空闲栈链表节点，直接存放在空闲栈的栈顶
+struct FreeStack
+{
+    FreeStack *next;
+};
+
+static FreeStack *ToNode(void *vp, size_t size)
+{
+    return reinterpret_cast<FreeStack *>(static_cast<char *>(vp) + size - sizeof(FreeStack));
+}
+
+static void *FromNode(FreeStack *node, size_t size)
+{
+    return reinterpret_cast<char *>(node) + sizeof(FreeStack) - size;
+}
+
+// 线程局部栈缓存
+struct ThreadStackCache
+{
+    FreeStack *heads[CLASS_COUNT] = {};  // 每个级别的空闲链表
+    size_t counts[CLASS_COUNT] = {};     // 每个级别的空闲栈数量
+
+    ~ThreadStackCache();
+};
+
+// 线程退出时栈缓存已经析构，之后释放的栈直接munmap
+static thread_local bool t_stack_cache_dead = false;
+static thread_local ThreadStackCache t_stack_cache;
+
+ThreadStackCache::~ThreadStackCache()
+{
+    t_stack_cache_dead = true;
+    for(int i = 0; i < CLASS_COUNT; ++i)
+    {
+        while(heads[i])
+        {
+            FreeStack *node = heads[i];
+            heads[i] = node->next;
+            PooledStackAllocator::UnmapStack(FromNode(node, ClassSize(i)), ClassSize(i));
+        }
+        counts[i] = 0;
+    }
+}
+
+void *PooledStackAllocator::MapStack(size_t size)
+{
+    size_t page = PageSize();
+    size = (size + page - 1) & ~(page - 1);
+    void *base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if(base == MAP_FAILED)
+    {
+        error_handling("mmap fiber stack failed");
+        return nullptr;
+    }
+    // 栈向低地址增长，保护页放在最低处
+    if(mprotect(base, page, PROT_NONE))
+    {
+        error_handling("mprotect guard page failed");
+    }
+    ++s_mapped_count;
+    return static_cast<char *>(base) + page;
+}
+
+void PooledStackAllocator::UnmapStack(void *vp, size_t size)
+{
+    size_t page = PageSize();
+    size = (size + page - 1) & ~(page - 1);
+    munmap(static_cast<char *>(vp) - page, size + page);
+}
+
+void *PooledStackAllocator::Alloc(size_t size)
+{
+    int cls = SizeClass(size);
+    if(cls < 0 || t_stack_cache_dead)
+    {
+        return MapStack(cls < 0 ? size : ClassSize(cls));
+    }
+
+    ThreadStackCache &cache = t_stack_cache;
+    FreeStack *node = cache.heads[cls];
+    if(node)
+    { // 栈池命中，直接从链表头取一个
+        cache.heads[cls] = node->next;
+        --cache.counts[cls];
+        return FromNode(node, ClassSize(cls));
+    }
+    return MapStack(ClassSize(cls));
+}
+
+void PooledStackAllocator::Dealloc(void *vp, size_t size)
+{
+    int cls = SizeClass(size);
+    if(cls < 0)
+    {
+        UnmapStack(vp, size);
+        return;
+    }
+    if(t_stack_cache_dead || t_stack_cache.counts[cls] >= s_pool_capacity)
+    { // 栈池已满，直接释放
+        UnmapStack(vp, ClassSize(cls));
+        return;
+    }
+
+    ThreadStackCache &cache = t_stack_cache;
+    FreeStack *node = ToNode(vp, ClassSize(cls));
+    node->next = cache.heads[cls];
+    cache.heads[cls] = node;
+    ++cache.counts[cls];
+}
+
+void PooledStackAllocator::Prewarm(size_t size, size_t count)
+{
+    int cls = SizeClass(size);
+    if(cls < 0 || t_stack_cache_dead) return;
+    ThreadStackCache &cache = t_stack_cache;
+    while(cache.counts[cls] < count && cache.counts[cls] < s_pool_capacity)
+    {
+        void *vp = MapStack(ClassSize(cls));
+        FreeStack *node = ToNode(vp, ClassSize(cls));
+        node->next = cache.heads[cls];
+        cache.heads[cls] = node;
+        ++cache.counts[cls];
+    }
+}
+
+void PooledStackAllocator::SetPoolCapacity(size_t count)
+{
+    s_pool_capacity = count;
+}
+
+size_t PooledStackAllocator::GetPoolCapacity()
+{
+    return s_pool_capacity;
+}
+
+uint64_t PooledStackAllocator::MappedCount()
+{
+    return s_mapped_count;
+}
+
+// 每个线程共享栈的数量和大小
+static std::atomic<size_t> s_shared_stack_count{4};
+static std::atomic<size_t> s_shared_stack_size{1024 * 1024};
+
+// 线程局部共享栈池
+struct ThreadSharedStacks
+{
+    std::vector<SharedStack> stacks;
+    size_t next = 0;    // 下一个分配出去的共享栈
+
+    ~ThreadSharedStacks()
+    {
+        for(SharedStack &s : stacks)
+        {
+            PooledStackAllocator::UnmapStack(s.stack, s.size);
+        }
+    }
+};
+
+static thread_local ThreadSharedStacks t_shared_stacks;
+
+SharedStack *SharedStackPool::Acquire()
+{
+    ThreadSharedStacks &pool = t_shared_stacks;
+    if(pool.stacks.empty())
+    {
+        pool.stacks.resize(s_shared_stack_count > 0 ? s_shared_stack_count.load() : 1);
+        for(SharedStack &s : pool.stacks)
+        {
+            s.size = (s_shared_stack_size + PageSize() - 1) & ~(PageSize() - 1);
+            s.stack = static_cast<char *>(PooledStackAllocator::MapStack(s.size));
+        }
+    }
+    SharedStack *s = &pool.stacks[pool.next];
+    pool.next = (pool.next + 1) % pool.stacks.size();
+    return s;
+}
+
+void SharedStackPool::SetConfig(size_t count, size_t size)
+{
+    s_shared_stack_count = count;
+    s_shared_stack_size = size;
+}
@@ -0,0 +1,73 @@
+// 协程栈分配器
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+// malloc栈内存分配器
+class MallocStackAllocator
+{
+public:
+    static void *Alloc(size_t size) { return malloc(size); }
+    static void Dealloc(void *vp, size_t size) { return free(vp); }
+};
+
+// mmap栈池分配器
+// 栈按大小分级(16KB, 32KB ... 2MB)，每个线程每个级别维护一个空闲栈链表，协程创建时直接从链表中取栈，销毁时放回链表
+// 每个栈的低地址处有一个PROT_NONE保护页，栈溢出时直接在保护页上崩溃，而不是悄悄踩坏堆内存
+// 超过最大级别的栈不进入栈池，直接mmap/munmap
+class PooledStackAllocator
+{
+public:
+    // 分配一个至少size字节的栈，返回栈的最低可用地址
+    static void *Alloc(size_t size);
+
+    // 释放栈，size必须和Alloc时一致
+    static void Dealloc(void *vp, size_t size);
+
+    // 预热当前线程的栈池，使size对应级别至少缓存count个栈，受栈池容量限制
+    static void Prewarm(size_t size, size_t count);
+
+    // 设置每个线程每个大小级别最多缓存的栈数量，超出的栈直接munmap
+    static void SetPoolCapacity(size_t count);
+
+    // 获取每个线程每个大小级别最多缓存的栈数量
+    static size_t GetPoolCapacity();
+
+    // 通过mmap新建的栈的总数，栈池命中时不会增加
+    static uint64_t MappedCount();
+
+    // 直接mmap一块带保护页的栈，不经过栈池
+    static void *MapStack(size_t size);
+
+    // 释放MapStack分配的栈
+    static void UnmapStack(void *vp, size_t size);
+};
+
+class Fiber;
+
+// 共享栈，多个共享栈协程轮流在同一块栈上运行，同一时刻栈上只保存一个协程(occupant)的内容
+struct SharedStack
+{
+    char *stack = nullptr;      // 栈的最低可用地址
+    size_t size = 0;            // 栈大小
+    Fiber *occupant = nullptr;  // 当前栈上保存的是哪个协程的内容
+};
+
+// 共享栈池，每个线程持有若干块共享栈，新的共享栈协程轮流使用
+class SharedStackPool
+{
+public:
+    // 为当前线程分配一块共享栈
+    static SharedStack *Acquire();
+
+    // 设置每个线程的共享栈数量和每块共享栈的大小，只对之后第一次使用共享栈的线程生效
+    static void SetConfig(size_t count, size_t size);
+};
+
+#ifdef FIBER_USE_MALLOC_STACK
+using StackAllocator = MallocStackAllocator;
+#else
+using StackAllocator = PooledStackAllocator;
+#endif
@@ -1,4 +1,7 @@
 #include "Timer.h"
+#include "TimingWheel.h"
+#include "FiberSync.h"
+#include <sched.h>
 #include <thread>
 
 bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs) const
@@ -13,69 +16,127 @@ bool Timer::Comparator::operator()(const Timer::ptr &lhs, const Timer::ptr &rhs)
     return lhs.get() < rhs.get(); // 比较地址
 }
 
-Timer::Timer(std::chrono::milliseconds ms, std::function<void()> cb, bool recurring, TimerManager *manager)
-    : m_recurring(recurring), m_ms(ms), m_cb(cb), m_manager(manager), 
-    m_next(getNow() + m_ms) // 通过当前时间点和m_ms来初始化
-{}
+Timer::Timer(std::chrono::microseconds us, std::function<void()> cb, bool recurring, TimerManager *manager,
+             std::chrono::microseconds slack)
+    : m_recurring(recurring), m_us(us), m_cb(cb), m_manager(manager), m_slack(slack)
+{
+    m_next = getNow() + us; // 通过当前时间点和m_us来初始化
+}
 
-Timer::Timer(std::chrono::milliseconds next) : m_next(next)
-{}
+Timer::Timer(TimerClock::time_point next)
+{
+    m_next = next;
+}
 
-bool Timer::cancel()
+TimeoutNode::~TimeoutNode()
 {
-    WriteLock lk(m_manager->m_mutex);
-    if(m_cb)
-    { // 取消定时器的操作就是将该定时器回调函数置空，然后从对应的定时器管理器将该定时器中移除
-        m_cb = nullptr;
-        auto it = m_manager->m_timers.find(shared_from_this());
-        m_manager->m_timers.erase(it);
-        return true;
+    int state = m_state.load(std::memory_order_acquire);
+    if(state == ARMED || state == FIRING)
+    {
+        m_manager->disarmTimeout(*this);
     }
-    return false;
+}
+
+bool Timer::cancel()
+{
+    return m_manager->cancelTimer(this);
 }
 
 bool Timer::refresh()
+{ // 刷新的操作就是取出后从现在开始重新计时，然后重新插入
+    return m_manager->resetTimer(this, std::chrono::microseconds(-1), true);
+}
+
+bool Timer::reset(std::chrono::microseconds us, bool from_now)
 {
-    WriteLock lk(m_manager->m_mutex);
-    if(!m_cb) {return false;}
+    return m_manager->resetTimer(this, us, from_now);
+}
 
-    // 刷新的操作就是取出后重新设置时间然后重新插入
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) return false; // 没有找到
-    m_manager->m_timers.erase(it);
-    m_next = getNow() + m_ms;
-    m_manager->m_timers.insert(shared_from_this()); // 重新插入自己
-    return true;
+TimerManager::TimerManager(std::chrono::microseconds wheel_tick, size_t shards)
+{
+    m_sharded = shards > 0;
+    if(shards == 0) shards = 1;
+    for(size_t i = 0; i < shards; ++i)
+    {
+        m_shards.emplace_back(new Shard);
+        if(wheel_tick.count() > 0)
+        {
+            m_shards.back()->wheel.reset(new TimingWheel(wheel_tick));
+        }
+        // 没有指定精度时超时节点按微秒放入时间轮，和std::set一样精确
+        m_shards.back()->timeouts.reset(new TimingWheel(wheel_tick.count() > 0 ? wheel_tick : std::chrono::microseconds(1)));
+    }
 }
 
-bool Timer::reset(std::chrono::milliseconds ms, bool from_now)
+TimerManager::~TimerManager()
 {
-    if(m_ms == ms && !from_now) return true;
-    WriteLock lk(m_manager->m_mutex);
-    if(!m_cb) return false; // 任务不存在
-    auto it = m_manager->m_timers.find(shared_from_this());
-    if(it == m_manager->m_timers.end()) return false;
+    // 定时器在时间轮中时持有自己，这里打断引用；还没停止的超时节点不再属于任何时间轮
+    std::vector<TimerNode *> nodes;
+    for(auto &shard : m_shards)
+    {
+        if(shard->wheel)
+        {
+            shard->wheel->clear(nodes);
+            for(TimerNode *node : nodes) static_cast<Timer *>(node)->m_wheelHold.reset();
+            nodes.clear();
+        }
+        for(auto &bucket : shard->buckets)
+        { // 桶中的定时器也持有自己
+            while(Timer *member = bucket.second->m_members)
+            {
+                bucket.second->m_members = member->m_bucketNext;
+                member->m_bucket = nullptr;
+                member->m_wheelHold.reset();
+            }
+        }
+        shard->buckets.clear();
+        shard->timeouts->clear(nodes);
+        for(TimerNode *node : nodes) static_cast<TimeoutNode *>(node)->m_state = TimeoutNode::IDLE;
+        nodes.clear();
+    }
+}
 
-    m_manager->m_timers.erase(it);
-    std::chrono::milliseconds start; // 重置的时间
-    if(from_now) start = getNow();
-    else start = m_next - ms;
-    m_ms = ms;
-    m_next = start + m_ms;
-    m_manager->addTimer(shared_from_this(), lk);
-    return true;
+size_t TimerManager::chooseTimerShard()
+{
+    return m_nextShard++ % m_shards.size();
 }
 
-TimerManager::TimerManager() : m_previouseTime(getNow())
-{}
+size_t TimerManager::localShard()
+{
+    if(!m_sharded)
+    {
+        return 0;
+    }
+    size_t index = getTimerShard();
+    return index < m_shards.size() ? index : static_cast<size_t>(-1);
+}
 
-TimerManager::~TimerManager() {}
+TimerManager::WriteLock TimerManager::lockShard(Shard &shard)
+{
+    return m_sharded ? WriteLock() : WriteLock(shard.mutex);
+}
 
-Timer::ptr TimerManager::addTimer(std::chrono::milliseconds ms, std::function<void()> cb, bool recurring)
+Timer::ptr TimerManager::addTimer(std::chrono::microseconds us, std::function<void()> cb, bool recurring,
+                                  std::chrono::microseconds slack)
 {
-    Timer::ptr timer(new Timer(ms, cb, recurring, this));
-    WriteLock lk(m_mutex);
-    addTimer(timer, lk);
+    Timer::ptr timer(new Timer(us, cb, recurring, this, slack));
+    size_t index = localShard();
+    if(index >= m_shards.size())
+    { // 不是分片的拥有者，交给选中分片的拥有者放入存储，并通知它重新计算超时时间
+        index = chooseTimerShard();
+        timer->m_shard = index;
+        ++m_shards[index]->count;
+        post(index, {TimerOp::ADD, timer, us, false}, true);
+        return timer;
+    }
+    timer->m_shard = index;
+    Shard &shard = *m_shards[index];
+    ++shard.count;
+    WriteLock lk = lockShard(shard);
+    if(insertTimer(shard, timer))
+    {
+        notifyFront(index, lk);
+    }
     return timer;
 }
 
@@ -88,102 +149,424 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
     }
 }
 
-Timer::ptr TimerManager::addConditionTimer(std::chrono::milliseconds ms, std::function<void()> cb, 
-                                    std::weak_ptr<void> weak_cond, bool recurring)
+Timer::ptr TimerManager::addConditionTimer(std::chrono::microseconds us, std::function<void()> cb, 
+                                    std::weak_ptr<void> weak_cond, bool recurring,
+                                    std::chrono::microseconds slack)
 {
-    return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+    return addTimer(us, std::bind(&OnTimer, weak_cond, cb), recurring, slack);
 }
 
-std::chrono::milliseconds TimerManager::getNextTimer()
+bool TimerManager::cancelTimer(Timer *timer)
 {
-    ReadLock lk(m_mutex);
-    m_tickled = false;
-    if(m_timers.empty()) return std::chrono::milliseconds(~0ull);
+    // 和触发竞争，只有一方能把状态从PENDING改掉
+    int expected = Timer::PENDING;
+    if(!timer->m_state.compare_exchange_strong(expected, Timer::CANCELLED))
+    {
+        return false;
+    }
+    Shard &shard = *m_shards[timer->m_shard];
+    --shard.count;
+    if(localShard() != timer->m_shard)
+    { // 定时器已经不会触发了，消息只是让拥有者尽早从存储中删除并释放回调，不需要唤醒它
+        post(timer->m_shard, {TimerOp::CANCEL, timer->shared_from_this(), std::chrono::microseconds(0), false}, false);
+        return true;
+    }
+    WriteLock lk = lockShard(shard);
+    removeTimer(shard, timer);
+    timer->m_cb = nullptr;
+    return true;
+}
 
-    const Timer::ptr &next = *m_timers.begin();
-    std::chrono::milliseconds now = getNow();
-    if(now >= next->m_next) return std::chrono::milliseconds(0);
-    else return next->m_next - now;
+bool TimerManager::resetTimer(Timer *timer, std::chrono::microseconds us, bool from_now)
+{
+    if(timer->m_state != Timer::PENDING)
+    {
+        return false;
+    }
+    size_t index = localShard();
+    if(index != timer->m_shard)
+    { // 拥有者处理消息时定时器可能已经触发或者取消，这时重置不再生效
+        post(timer->m_shard, {TimerOp::RESET, timer->shared_from_this(), us, from_now}, true);
+        return true;
+    }
+    if(m_sharded)
+    { // 定时器可能还在收件箱的添加消息中
+        drainInbox(index);
+    }
+    WriteLock lk = lockShard(*m_shards[index]);
+    return applyReset(index, lk, timer, us, from_now);
 }
 
-void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs)
+bool TimerManager::applyReset(size_t index, WriteLock &lock, Timer *timer, std::chrono::microseconds us, bool from_now)
 {
-    std::chrono::milliseconds now = getNow();
-    std::vector<Timer::ptr> expired;
-    { // 先使用写入锁判断
-        ReadLock lk(m_mutex);
-        if(m_timers.empty()) return;
+    Shard &shard = *m_shards[index];
+    if(timer->m_state != Timer::PENDING) return false; // 任务不存在
+    if(us.count() >= 0 && timer->m_us == us && !from_now) return true;
+    Timer::ptr self = timer->shared_from_this();
+    if(!removeTimer(shard, timer)) return false;
+
+    if(us.count() < 0) us = timer->m_us; // refresh沿用原来的时间
+    TimerClock::time_point start; // 重置的时间
+    if(from_now) start = getNow();
+    else start = timer->m_next - timer->m_us;
+    timer->m_us = us;
+    timer->m_next = start + us;
+    if(insertTimer(shard, self))
+    {
+        notifyFront(index, lock);
     }
+    return true;
+}
 
-    WriteLock lk(m_mutex);
-    if(m_timers.empty()) return;
+void TimerManager::post(size_t index, TimerOp op, bool notify)
+{
+    Shard &shard = *m_shards[index];
+    {
+        std::lock_guard<std::mutex> lk(shard.inboxMutex);
+        shard.inbox.emplace_back(std::move(op));
+        ++shard.inboxCount;
+    }
+    if(notify)
+    {
+        notifyShard(index);
+    }
+}
 
-    bool rollover = false; // 判断服务器时间是不是被调后了
-    if(detectClockRollover(now))
-    { 
-        rollover = true;
+void TimerManager::notifyFront(size_t index, WriteLock &lock)
+{
+    if(lock.owns_lock()) 
+    {
+        lock.unlock();
     }
+    notifyShard(index);
+}
 
-    if(!rollover && ((*m_timers.begin())->m_next > now))
-    { // 不存在过期的事件
+void TimerManager::notifyShard(size_t index)
+{
+    if(m_sharded && localShard() == index)
+    { // 拥有者正在运行，进入idle之前会重新计算超时时间
         return;
     }
+    // 先放入消息或者超时节点再检查tickled，和getNextTimer中先清除tickled再检查配合，拥有者要么看到，要么被通知
+    if(m_shards[index]->tickled.exchange(true))
+    {
+        return;
+    }
+    if(m_sharded) tickleTimerShard(index);
+    else onTimerInsertedAtFront();
+}
 
-    Timer::ptr now_timer(new Timer(now));
-    auto it = rollover ? m_timers.end() : m_timers.lower_bound(now_timer); // 使用二分查找，找到大于等于的位置
-    while(it != m_timers.end() && (*it)->m_next == now) ++it;
+void TimerManager::drainInbox(size_t index)
+{
+    Shard &shard = *m_shards[index];
+    if(shard.inboxCount == 0)
+    {
+        return;
+    }
+    std::vector<TimerOp> ops;
+    {
+        std::lock_guard<std::mutex> lk(shard.inboxMutex);
+        ops.swap(shard.inbox);
+        shard.inboxCount = 0;
+    }
+    WriteLock lk; // 分片模式下拥有者访问自己的分片不需要加锁
+    for(auto &op : ops)
+    {
+        Timer *timer = op.timer.get();
+        switch(op.type)
+        {
+        case TimerOp::ADD:
+            if(timer->m_state == Timer::PENDING) insertTimer(shard, op.timer);
+            else timer->m_cb = nullptr; // 还没放入存储就被取消了
+            break;
+        case TimerOp::CANCEL:
+            removeTimer(shard, timer);
+            timer->m_cb = nullptr;
+            break;
+        case TimerOp::RESET:
+            applyReset(index, lk, timer, op.us, op.fromNow);
+            break;
+        }
+    }
+}
+
+std::chrono::microseconds TimerManager::getNextTimer()
+{
+    size_t index = localShard();
+    if(index >= m_shards.size())
+    {
+        return std::chrono::microseconds(~0ull);
+    }
+    Shard &shard = *m_shards[index];
+    shard.tickled = false;
+    if(m_sharded)
+    {
+        drainInbox(index);
+    }
+
+    TimerClock::time_point next = TimerClock::time_point::max();
+    if(shard.wheel)
+    { // 时间轮查找最近的槽位时会记录下来，用于判断之后添加的定时器是否最早，需要写锁
+        // 空的时间轮也要调用，把记录重置掉，否则之后添加的定时器和过时的记录比较，不会通知
+        WriteLock lk = lockShard(shard);
+        next = shard.wheel->nextExpire();
+    }
+    else
+    {
+        ReadLock lk;
+        if(!m_sharded) lk = ReadLock(shard.mutex);
+        if(!shard.timers.empty()) next = (*shard.timers.begin())->m_next;
+    }
+    {
+        // 和上面的时间轮一样，空的时候也要重置记录
+        std::lock_guard<std::mutex> lk(shard.timeoutMutex);
+        next = std::min(next, shard.timeouts->nextExpire());
+    }
+    if(next == TimerClock::time_point::max()) return std::chrono::microseconds(~0ull);
+
+    TimerClock::time_point now = getNow();
+    if(now >= next) return std::chrono::microseconds(0);
+    // 向上取整，避免在定时器到期之前醒来空转一次
+    return std::chrono::ceil<std::chrono::microseconds>(next - now);
+}
 
-    expired.insert(expired.begin(), m_timers.begin(), it);
-    m_timers.erase(m_timers.begin(), it);
-    cbs.reserve(expired.size()); // 预留空间
+void TimerManager::listExpiredCb(std::vector<std::function<void()>> &cbs)
+{
+    size_t index = localShard();
+    if(index >= m_shards.size())
+    {
+        return;
+    }
+    Shard &shard = *m_shards[index];
+    if(m_sharded)
+    {
+        drainInbox(index);
+    }
+    TimerClock::time_point now = getNow();
+    fireTimeouts(shard, now);
+    std::vector<Timer::ptr> expired;
+    if(!m_sharded)
+    { // 先使用读锁判断
+        ReadLock lk(shard.mutex);
+        if(shard.wheel ? shard.wheel->empty() : shard.timers.empty()) return;
+    }
+
+    WriteLock lk = lockShard(shard);
+    if(shard.wheel)
+    { // 时间轮直接取出所有到期的定时器，时间轮对定时器的引用转移到expired中
+        std::vector<TimerNode *> nodes;
+        shard.wheel->advance(now, nodes);
+        expired.reserve(nodes.size());
+        for(TimerNode *node : nodes) expired.emplace_back(std::move(static_cast<Timer *>(node)->m_wheelHold));
+    }
+    else
+    {
+        // steady_clock不会被调后，不需要再检测系统时间回拨
+        if(shard.timers.empty() || (*shard.timers.begin())->m_next > now)
+        { // 不存在过期的事件
+            return;
+        }
+        Timer::ptr now_timer(new Timer(now));
+        auto it = shard.timers.lower_bound(now_timer); // 使用二分查找，找到大于等于的位置
+        while(it != shard.timers.end() && (*it)->m_next == now) ++it;
+        expired.insert(expired.begin(), shard.timers.begin(), it);
+        shard.timers.erase(shard.timers.begin(), it);
+    }
+    cbs.reserve(cbs.size() + expired.size()); // 预留空间
 
-    for(auto &timer : expired)
+    // 到期的桶展开成员追加在后面，一起处理
+    for(size_t i = 0; i < expired.size(); ++i)
     {
-        cbs.emplace_back(timer->m_cb);
+        Timer::ptr timer = std::move(expired[i]);
+        if(timer->m_isBucket)
+        {
+            shard.buckets.erase(std::chrono::duration_cast<std::chrono::microseconds>(timer->m_next.time_since_epoch()).count());
+            while(Timer *member = timer->m_members)
+            {
+                timer->m_members = member->m_bucketNext;
+                member->m_bucket = nullptr;
+                expired.emplace_back(std::move(member->m_wheelHold));
+            }
+            continue;
+        }
         if(timer->m_recurring)
         { // 处理循环的任务
-            timer->m_next = now + timer->m_ms;
-            m_timers.insert(timer);
+            if(timer->m_state == Timer::PENDING)
+            {
+                cbs.emplace_back(timer->m_cb);
+                timer->m_next = now + timer->m_us;
+                insertTimer(shard, timer);
+                continue;
+            }
         }
-        else 
+        else
         {
-            // 不循环的任务，置空
-            timer->m_cb = nullptr;
+            int expected = Timer::PENDING;
+            if(timer->m_state.compare_exchange_strong(expected, Timer::FIRED))
+            { // 不循环的任务直接把回调移出来，然后置空
+                cbs.emplace_back(std::move(timer->m_cb));
+                timer->m_cb = nullptr;
+                --shard.count;
+                continue;
+            }
         }
+        // 已经被其他线程取消，取消消息还在收件箱中
+        timer->m_cb = nullptr;
     }
 }
 
-void TimerManager::addTimer(Timer::ptr val, WriteLock &lock)
+bool TimerManager::insertTimer(Shard &shard, const Timer::ptr &timer)
 {
-    auto it = m_timers.insert(val).first;
-    bool at_front = ((it == m_timers.begin()) && !m_tickled);
-    if(at_front) m_tickled = true;
-    if(lock.owns_lock()) 
+    if(timer->m_slack.count() <= 0)
     {
-        //std::this_thread::sleep_for(std::chrono::milliseconds(1)); // 延迟一下，不然会死锁？？？
-        lock.unlock();
+        return insertStore(shard, timer);
+    }
+    // 向上取整到slack的整数倍，只会晚触发不会早触发；以时钟的起点对齐，不同分片、不同时间添加的定时器落在同样的桶上
+    int64_t us = std::chrono::ceil<std::chrono::microseconds>(timer->m_next.time_since_epoch()).count();
+    int64_t slack = timer->m_slack.count();
+    int64_t key = (us + slack - 1) / slack * slack;
+    bool earliest = false;
+    Timer::ptr &bucket = shard.buckets[key];
+    if(!bucket)
+    { // 这个时刻还没有桶，新建一个放入存储
+        bucket.reset(new Timer(TimerClock::time_point(std::chrono::microseconds(key))));
+        bucket->m_isBucket = true;
+        earliest = insertStore(shard, bucket);
     }
-    if(at_front) 
+    timer->m_bucket = bucket.get();
+    timer->m_bucketPrev = nullptr;
+    timer->m_bucketNext = bucket->m_members;
+    if(bucket->m_members) bucket->m_members->m_bucketPrev = timer.get();
+    bucket->m_members = timer.get();
+    timer->m_wheelHold = timer;
+    return earliest;
+}
+
+bool TimerManager::insertStore(Shard &shard, const Timer::ptr &timer)
+{
+    if(shard.wheel)
     {
-        onTimerInsertedAtFront();
+        timer->m_wheelHold = timer;
+        return shard.wheel->add(timer.get());
     }
+    // 先插入再取begin()，==两边的求值顺序是未指定的
+    auto it = shard.timers.insert(timer).first;
+    return it == shard.timers.begin();
 }
 
-bool TimerManager::detectClockRollover(std::chrono::milliseconds now_ms)
+bool TimerManager::removeTimer(Shard &shard, Timer *timer)
 {
-    bool rollover = false;
-    if(now_ms < m_previouseTime && now_ms < (m_previouseTime - std::chrono::milliseconds(60 * 60 * 1000)))
-    {   // 如果系统时间后调了一个小时，则标记，在listExpiredCb中会执行所有定时器操作，这里处理比较粗糙
-        rollover = true;
+    if(timer->m_bucket)
+    { // 只从桶中摘下，空桶留在存储中，到期时直接丢弃
+        Timer *bucket = timer->m_bucket;
+        if(timer->m_bucketPrev) timer->m_bucketPrev->m_bucketNext = timer->m_bucketNext;
+        else bucket->m_members = timer->m_bucketNext;
+        if(timer->m_bucketNext) timer->m_bucketNext->m_bucketPrev = timer->m_bucketPrev;
+        timer->m_bucket = timer->m_bucketPrev = timer->m_bucketNext = nullptr;
+        timer->m_wheelHold.reset(); // 可能是最后一个引用，之后不能再访问timer
+        return true;
+    }
+    if(timer->m_slack.count() > 0)
+    { // 有误差的定时器不在桶中就不在存储中
+        return false;
     }
-    m_previouseTime = now_ms;
-    return rollover;
+    if(shard.wheel)
+    {
+        if(!shard.wheel->remove(timer)) return false;
+        timer->m_wheelHold.reset(); // 可能是最后一个引用，之后不能再访问timer
+        return true;
+    }
+    auto it = shard.timers.find(timer->shared_from_this());
+    if(it == shard.timers.end()) return false;
+    shard.timers.erase(it);
+    return true;
 }
 
 bool TimerManager::hasTimer()
 {
-    ReadLock lk(m_mutex);
-    return !m_timers.empty();
+    for(auto &shard : m_shards)
+    {
+        if(shard->count > 0) return true;
+    }
+    return false;
 }
 
+void TimerManager::armTimeout(TimeoutNode &node, std::chrono::microseconds us, TimeoutNode::Callback cb, void *arg)
+{
+    disarmTimeout(node);
+    size_t index = localShard();
+    if(index >= m_shards.size())
+    {
+        index = chooseTimerShard();
+    }
+    Shard &shard = *m_shards[index];
+    node.m_manager = this;
+    node.m_shard = index;
+    node.m_cb = cb;
+    node.m_arg = arg;
+    node.m_next = getNow() + us;
+    ++shard.count;
+    bool earliest = false;
+    {
+        std::lock_guard<std::mutex> lk(shard.timeoutMutex);
+        node.m_state = TimeoutNode::ARMED;
+        earliest = shard.timeouts->add(&node);
+    }
+    if(earliest)
+    {
+        notifyShard(index);
+    }
+}
 
+bool TimerManager::disarmTimeout(TimeoutNode &node)
+{
+    int state = node.m_state.load(std::memory_order_acquire);
+    if(state == TimeoutNode::IDLE || state == TimeoutNode::FIRED)
+    {
+        return false;
+    }
+    if(state == TimeoutNode::ARMED)
+    {
+        Shard &shard = *m_shards[node.m_shard];
+        std::lock_guard<std::mutex> lk(shard.timeoutMutex);
+        if(node.m_state == TimeoutNode::ARMED)
+        {
+            shard.timeouts->remove(&node);
+            node.m_state = TimeoutNode::IDLE;
+            --shard.count;
+            return true;
+        }
+    }
+    // 回调正在执行，它可能还会访问节点所在的内存，等它执行完
+    for(int i = 0; node.m_state.load(std::memory_order_acquire) == TimeoutNode::FIRING; ++i)
+    {
+        if(i < 64) Spinlock::CpuRelax();
+        else sched_yield();
+    }
+    return false;
+}
+
+void TimerManager::fireTimeouts(Shard &shard, TimerClock::time_point now)
+{
+    // 到期节点的列表按线程复用，稳定之后不再分配内存
+    static thread_local std::vector<TimerNode *> t_fired;
+    {
+        std::lock_guard<std::mutex> lk(shard.timeoutMutex);
+        if(shard.timeouts->empty()) return;
+        shard.timeouts->advance(now, t_fired);
+        for(TimerNode *node : t_fired)
+        { // 标记为正在执行，停止节点的线程会等回调执行完
+            static_cast<TimeoutNode *>(node)->m_state = TimeoutNode::FIRING;
+            --shard.count;
+        }
+    }
+    // 锁外执行回调，回调可能唤醒等待者，等待者再停止节点时不会和这里争锁
+    for(TimerNode *node : t_fired)
+    {
+        TimeoutNode *timeout = static_cast<TimeoutNode *>(node);
+        timeout->m_cb(timeout->m_arg);
+        // 之后节点随时可能被释放，不能再访问
+        timeout->m_state.store(TimeoutNode::FIRED, std::memory_order_release);
+    }
+    t_fired.clear();
+}
@@ -4,27 +4,48 @@
 #include <memory>
 #include <vector>
 #include <set>
+#include <unordered_map>
 #include <mutex>
 #include <shared_mutex>
 #include <chrono>
+#include <cstdint>
+#include <atomic>
 #include <iostream>
 
 
 
 
-// 获得当前时间的时间戳，毫秒
-inline std::chrono::milliseconds getNow()
+// 定时器使用的时钟，单调递增，不受系统时间调整的影响
+typedef std::chrono::steady_clock TimerClock;
+
+// 获得当前时间点
+inline TimerClock::time_point getNow()
 {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock().now().time_since_epoch());
+    return TimerClock::now();
 }
 
 // forward declear
 class TimerManager;
+class TimingWheel;
+
+// 可以挂在时间轮上的节点，Timer和TimeoutNode共用
+class TimerNode
+{
+    friend TimerManager;
+    friend TimingWheel;
+protected:
+    TimerClock::time_point m_next;                                      // 到期的绝对时间
+    TimerNode *m_wheelPrev = nullptr;                                   // 时间轮槽位的双向链表
+    TimerNode *m_wheelNext = nullptr;
+    int m_wheelSlot = -1;                                               // 所在的槽位，-1表示不在时间轮中
+    uint64_t m_expireTick = 0;                                          // 到期的tick
+};
 
 // 定时器
-class Timer : public std::enable_shared_from_this<Timer>
+class Timer : public TimerNode, public std::enable_shared_from_this<Timer>
 {
     friend TimerManager;
+    friend TimingWheel;
 public:
     typedef std::shared_ptr<Timer> ptr;
     typedef std::shared_mutex RWMutexType; // 读写锁
@@ -32,8 +53,9 @@ public:
     typedef std::shared_lock<std::shared_mutex> ReadLock;
 private:
     // 私有构造函数
-    Timer(std::chrono::milliseconds ms, std::function<void()> cb, bool recurring, TimerManager *manager);
-    Timer(std::chrono::milliseconds next);
+    Timer(std::chrono::microseconds us, std::function<void()> cb, bool recurring, TimerManager *manager,
+          std::chrono::microseconds slack = std::chrono::microseconds(0));
+    Timer(TimerClock::time_point next);
 
 public:
     // 取消定时器
@@ -41,14 +63,26 @@ public:
     // 刷新设置定时器执行时间
     bool refresh();
     // 重置定时器的时间
-    bool reset(std::chrono::milliseconds ms, bool from_now);
+    bool reset(std::chrono::microseconds us, bool from_now);
 
 private:
     bool m_recurring = false;                                           // 是否循环
-    std::chrono::milliseconds m_ms = std::chrono::milliseconds(0);      // 多久之后执行，相对于创建定时器时间戳的相对时间
-    std::chrono::milliseconds m_next = std::chrono::milliseconds(0);    // 精确的执行绝对时间 == 创建时间戳 + m_ms      
+    std::chrono::microseconds m_us = std::chrono::microseconds(0);      // 多久之后执行，相对于创建定时器时间点的相对时间
     std::function<void()> m_cb;                                         // 回调函数
     TimerManager *m_manager = nullptr;                                  // 定时器管理器
+    size_t m_shard = 0;                                                 // 所在的分片
+    // 定时器的状态，取消和触发通过CAS竞争，其他线程取消时不需要访问定时器所在的存储
+    enum State { PENDING = 0, FIRED = 1, CANCELLED = 2 };
+    std::atomic<int> m_state {PENDING};
+    Timer::ptr m_wheelHold;                                             // 在时间轮或者桶中时持有自己
+    // 允许的误差大于0时，到期时间向上取整到slack的整数倍，同一时刻到期的定时器放在同一个桶中
+    // 桶本身也是一个Timer，在存储中只占一项，到期时整桶一起触发
+    std::chrono::microseconds m_slack = std::chrono::microseconds(0);  // 允许晚触发的时间
+    Timer *m_bucket = nullptr;                                          // 所在的桶
+    Timer *m_bucketPrev = nullptr;                                      // 桶内的双向链表
+    Timer *m_bucketNext = nullptr;
+    Timer *m_members = nullptr;                                         // 桶：成员链表头
+    bool m_isBucket = false;                                            // 是否为桶
 private:
     // 定时器比较仿函数，按执行时间排序
     struct Comparator
@@ -58,7 +92,40 @@ private:
 };
 
 
+// 侵入式超时节点
+// 不分配内存，可以直接放在等待者的栈帧里，启动和停止都是O(1)
+// 到期时在idle中直接调用回调，回调要很短并且不能阻塞，一般只是唤醒等待者
+// 运行在共享栈上的协程切出时栈内容会被拷走，不能把它放在栈上
+class TimeoutNode : public TimerNode
+{
+    friend TimerManager;
+public:
+    typedef void (*Callback)(void *arg);
+
+    TimeoutNode() {}
+
+    // 还在启动状态时先停止，回调正在执行时等它执行完
+    ~TimeoutNode();
+
+    TimeoutNode(const TimeoutNode &) = delete;
+    TimeoutNode &operator=(const TimeoutNode &) = delete;
+
+    // 是否已经启动并且还没有触发
+    bool isArmed() const { return m_state == ARMED; }
+
+private:
+    enum State { IDLE = 0, ARMED = 1, FIRING = 2, FIRED = 3 };
+    std::atomic<int> m_state {IDLE};                                    // 状态
+    TimerManager *m_manager = nullptr;                                  // 启动它的定时器管理器
+    size_t m_shard = 0;                                                 // 所在的分片
+    Callback m_cb = nullptr;                                            // 回调函数
+    void *m_arg = nullptr;                                              // 回调函数的参数
+};
+
 // 定时器管理器
+// 分片模式下每个工作线程有自己的分片，线程自己添加的定时器放在自己的分片中，访问时不需要加锁
+// 其他线程对定时器的添加、取消和重置作为消息放入目标分片的收件箱，由分片的拥有者在计算超时时间和收集到期定时器时处理
+// 默认只有一个分片，所有操作都加锁
 class TimerManager
 {
     friend Timer;
@@ -67,42 +134,122 @@ public:
     typedef std::unique_lock<std::shared_mutex> WriteLock;
     typedef std::shared_lock<std::shared_mutex> ReadLock;
     // 构造函数
-    TimerManager(); // 默认构造函数
-    ~TimerManager(); // 析构函数
-
-    // 添加定时器
-    Timer::ptr addTimer(std::chrono::milliseconds ms, std::function<void()> cb, bool recurring = false);
+    // wheel_tick大于0时用分层时间轮存放定时器，添加和取消都是O(1)，定时器最多晚wheel_tick触发
+    // 默认使用std::set，按照到期时间精确排序
+    // shards大于0时使用分片模式，子类通过getTimerShard告诉管理器当前线程拥有哪个分片
+    explicit TimerManager(std::chrono::microseconds wheel_tick = std::chrono::microseconds(0), size_t shards = 0);
+    virtual ~TimerManager(); // 析构函数
+
+    // 添加定时器，精度为微秒，传入毫秒等更粗的时间单位会自动转换
+    // slack大于0时定时器最多可以晚slack触发，到期时间取整到slack的整数倍，和同一时刻到期的定时器合并成一个桶
+    // 整个桶在存储中只占一项，到期时一次取出，回调作为一批交给调度器，适合大量不需要精确的空闲超时
+    Timer::ptr addTimer(std::chrono::microseconds us, std::function<void()> cb, bool recurring = false,
+                        std::chrono::microseconds slack = std::chrono::microseconds(0));
 
     // 添加条件定时器
-    Timer::ptr addConditionTimer(std::chrono::milliseconds ms, std::function<void()> cb, 
-                                    std::weak_ptr<void> weak_cond, bool recurring = false);
+    Timer::ptr addConditionTimer(std::chrono::microseconds us, std::function<void()> cb, 
+                                    std::weak_ptr<void> weak_cond, bool recurring = false,
+                                    std::chrono::microseconds slack = std::chrono::microseconds(0));
 
-    // 到最近一个定时器执行的时间间隔（毫秒）
-    std::chrono::milliseconds getNextTimer();
+    // 到最近一个定时器执行的时间间隔（微秒），没有定时器时返回microseconds(~0ull)
+    // 分片模式下只看当前线程的分片，不是分片的拥有者时返回microseconds(~0ull)
+    std::chrono::microseconds getNextTimer();
 
-    // 获取需要执行的过期的定时器的回调函数列表
+    // 获取需要执行的过期的定时器的回调函数列表，分片模式下只收集当前线程的分片
     void listExpiredCb(std::vector<std::function<void()>> &cbs);
 
-    // 是否有定时器
+    // 是否有定时器，分片模式下统计所有分片
     bool hasTimer();
 
+    // 启动超时节点，us之后以arg为参数调用cb，节点已经启动时先停止
+    // 任何线程都可以启动和停止，节点放在当前线程的分片中
+    void armTimeout(TimeoutNode &node, std::chrono::microseconds us, TimeoutNode::Callback cb, void *arg);
+
+    // 停止超时节点，返回节点是否在触发之前被停止
+    // 回调正在执行时等它执行完再返回，返回之后节点的内存就可以释放了，所以不能在节点自己的回调中调用
+    bool disarmTimeout(TimeoutNode &node);
+
 protected:
     // 有新的定时器插入到定时器的首部时，执行该函数
     virtual void onTimerInsertedAtFront() = 0; // 纯虚函数
 
-    // 将定时器添加到管理器中
-    void addTimer(Timer::ptr val, WriteLock &lock);
+    // 分片模式下通知分片的拥有者处理收件箱，默认和onTimerInsertedAtFront相同
+    virtual void tickleTimerShard(size_t) { onTimerInsertedAtFront(); }
 
-private:
-    // 检测服务器时间是否被调后了
-    bool detectClockRollover(std::chrono::milliseconds now_ms);
+    // 分片模式下当前线程拥有的分片，不是任何分片的拥有者时返回-1
+    virtual size_t getTimerShard() { return static_cast<size_t>(-1); }
+
+    // 分片模式下为不是分片拥有者的线程添加的定时器选择分片，默认轮流选择
+    virtual size_t chooseTimerShard();
 
 private:
-    // Mutex
-    RWMutexType m_mutex;                                                        // 读写锁
-    std::set<Timer::ptr, Timer::Comparator> m_timers;                           // 定时器集合，内部保存定时器的智能指针
-    bool m_tickled = false;                                                     // 是否触发 onTimerInsertedAtFront
-    std::chrono::milliseconds m_previouseTime = std::chrono::milliseconds(0);   // 上次执行时间
+    // 其他线程发给分片拥有者的消息
+    struct TimerOp
+    {
+        enum Type { ADD, CANCEL, RESET };
+        Type type;
+        Timer::ptr timer;
+        std::chrono::microseconds us;   // RESET的新时间，负数表示refresh，沿用原来的时间
+        bool fromNow;                   // RESET是否从现在开始计时
+    };
 
-};
+    // 定时器分片
+    struct Shard
+    {
+        RWMutexType mutex;                                      // 非分片模式下保护整个分片
+        std::set<Timer::ptr, Timer::Comparator> timers;         // 定时器集合，内部保存定时器的智能指针
+        std::unique_ptr<TimingWheel> wheel;                     // 使用时间轮时不为空，代替timers
+        std::unordered_map<int64_t, Timer::ptr> buckets;        // 还没有到期的桶，key为取整之后的到期时间(微秒)
+        std::mutex timeoutMutex;                                // 超时节点的锁，任何线程都可以直接启动和停止超时节点
+        std::unique_ptr<TimingWheel> timeouts;                  // 超时节点，总是放在时间轮中
+        std::mutex inboxMutex;                                  // 收件箱的锁
+        std::vector<TimerOp> inbox;                             // 其他线程发来的消息
+        std::atomic<size_t> inboxCount {0};                     // 收件箱中的消息数量，用于不加锁判断收件箱是否为空
+        std::atomic<size_t> count {0};                          // 还没有触发也没有取消的定时器数量
+        std::atomic<bool> tickled {false};                      // 是否触发 onTimerInsertedAtFront/tickleTimerShard
+    };
+
+    // 取消定时器
+    bool cancelTimer(Timer *timer);
+
+    // 重置定时器，us为负数时表示refresh
+    bool resetTimer(Timer *timer, std::chrono::microseconds us, bool from_now);
+
+    // 当前线程可以直接访问的分片：分片模式下是自己拥有的分片，否则是唯一的分片；没有时返回-1
+    size_t localShard();
+
+    // 非分片模式下对分片加锁，分片模式下只有拥有者访问，不需要加锁
+    WriteLock lockShard(Shard &shard);
+
+    // 把定时器放入存储，有误差的定时器放入对应的桶，返回它是否成为最早的定时器
+    bool insertTimer(Shard &shard, const Timer::ptr &timer);
 
+    // 把定时器或者桶放入set/时间轮
+    bool insertStore(Shard &shard, const Timer::ptr &timer);
+
+    // 从存储中删除定时器，不存在时返回false
+    bool removeTimer(Shard &shard, Timer *timer);
+
+    // 在当前线程可以直接访问的分片上重置定时器
+    bool applyReset(size_t index, WriteLock &lock, Timer *timer, std::chrono::microseconds us, bool from_now);
+
+    // 向分片的收件箱发送消息，需要拥有者尽快处理时notify为true
+    void post(size_t index, TimerOp op, bool notify);
+
+    // 定时器成为分片中最早的定时器时通知，lock在通知之前释放
+    void notifyFront(size_t index, WriteLock &lock);
+
+    // 分片最早的到期时间可能提前了，通知分片的拥有者重新计算超时时间
+    void notifyShard(size_t index);
+
+    // 触发分片中到期的超时节点
+    void fireTimeouts(Shard &shard, TimerClock::time_point now);
+
+    // 分片的拥有者处理收件箱中的消息
+    void drainInbox(size_t index);
+
+private:
+    std::vector<std::unique_ptr<Shard>> m_shards;                               // 定时器分片
+    bool m_sharded = false;                                                     // 是否为分片模式
+    std::atomic<size_t> m_nextShard {0};                                        // 轮流选择分片的游标
+};
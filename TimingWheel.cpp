@@ -0,0 +1,187 @@
+#include <cstring>
+#include "TimingWheel.h"
+
+TimingWheel::TimingWheel(std::chrono::microseconds tick)
+    : m_tick(tick.count() > 0 ? tick : std::chrono::microseconds(1)), m_base(getNow())
+{
+    memset(m_slots, 0, sizeof(m_slots));
+    memset(m_occupied, 0, sizeof(m_occupied));
+}
+
+bool TimingWheel::add(TimerNode *node)
+{
+    // 向上取整，定时器只会晚触发不会早触发；已经到期的放在下一个tick
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(node->m_next - m_base).count();
+    uint64_t tick = us > 0 ? (static_cast<uint64_t>(us) + m_tick.count() - 1) / m_tick.count() : 0;
+    node->m_expireTick = tick > m_current ? tick : m_current + 1;
+    link(node);
+    ++m_size;
+    if(node->m_expireTick < m_nextHint)
+    {
+        m_nextHint = node->m_expireTick;
+        return true;
+    }
+    return false;
+}
+
+bool TimingWheel::remove(TimerNode *node)
+{
+    if(node->m_wheelSlot < 0)
+    {
+        return false;
+    }
+    unlink(node);
+    if(--m_size == 0)
+    { // 空了之后任何新定时器都是最早的，不能再拿旧的tick比较
+        m_nextHint = UINT64_MAX;
+    }
+    return true;
+}
+
+void TimingWheel::clear(std::vector<TimerNode *> &nodes)
+{
+    for(int level = 0; level < LEVELS; ++level)
+    {
+        for(int slot = 0; slot < SLOTS; ++slot)
+        {
+            while(m_slots[level][slot])
+            {
+                TimerNode *node = m_slots[level][slot];
+                unlink(node);
+                nodes.push_back(node);
+            }
+        }
+    }
+    m_size = 0;
+    m_nextHint = UINT64_MAX;
+}
+
+void TimingWheel::link(TimerNode *node)
+{
+    uint64_t delta = node->m_expireTick - m_current;
+    int level = 0;
+    while(level < LEVELS - 1 && delta >= (1ull << (LEVEL_BITS * (level + 1))))
+    {
+        ++level;
+    }
+    // 超出最高层范围的定时器先放在最高层最远的槽位上，降级时再重新计算
+    uint64_t tick = node->m_expireTick;
+    if(level == LEVELS - 1 && delta >= (1ull << (LEVEL_BITS * LEVELS)))
+    {
+        tick = m_current + (1ull << (LEVEL_BITS * LEVELS)) - 1;
+    }
+    int slot = static_cast<int>((tick >> (LEVEL_BITS * level)) & (SLOTS - 1));
+
+    TimerNode *&head = m_slots[level][slot];
+    node->m_wheelPrev = nullptr;
+    node->m_wheelNext = head;
+    if(head) head->m_wheelPrev = node;
+    head = node;
+    node->m_wheelSlot = level * SLOTS + slot;
+    m_occupied[level] |= 1ull << slot;
+}
+
+void TimingWheel::unlink(TimerNode *node)
+{
+    int level = node->m_wheelSlot / SLOTS;
+    int slot = node->m_wheelSlot % SLOTS;
+    if(node->m_wheelPrev) node->m_wheelPrev->m_wheelNext = node->m_wheelNext;
+    else m_slots[level][slot] = node->m_wheelNext;
+    if(node->m_wheelNext) node->m_wheelNext->m_wheelPrev = node->m_wheelPrev;
+    if(!m_slots[level][slot]) m_occupied[level] &= ~(1ull << slot);
+    node->m_wheelPrev = node->m_wheelNext = nullptr;
+    node->m_wheelSlot = -1;
+}
+
+uint64_t TimingWheel::nextTick() const
+{
+    if(m_size == 0)
+    {
+        return UINT64_MAX;
+    }
+    uint64_t next = UINT64_MAX;
+    for(int level = 0; level < LEVELS; ++level)
+    {
+        if(!m_occupied[level]) continue;
+        int shift = LEVEL_BITS * level;
+        uint64_t block = m_current >> shift;
+        // 从当前块的下一个槽位开始找第一个非空槽位，距离为0表示绕了一圈
+        int pos = static_cast<int>((block + 1) & (SLOTS - 1));
+        uint64_t rotated = (m_occupied[level] >> pos) | (pos ? m_occupied[level] << (SLOTS - pos) : 0);
+        uint64_t distance = static_cast<uint64_t>(__builtin_ctzll(rotated)) + 1;
+        // 第0层是槽位本身的tick，高层是降级的tick
+        uint64_t tick = (block + distance) << shift;
+        if(tick < next) next = tick;
+    }
+    return next;
+}
+
+TimerClock::time_point TimingWheel::nextExpire()
+{
+    m_nextHint = nextTick();
+    if(m_nextHint == UINT64_MAX)
+    {
+        return TimerClock::time_point::max();
+    }
+    return m_base + m_tick * m_nextHint;
+}
+
+void TimingWheel::cascade(int level, int slot)
+{
+    TimerNode *node = m_slots[level][slot];
+    m_slots[level][slot] = nullptr;
+    m_occupied[level] &= ~(1ull << slot);
+    while(node)
+    {
+        TimerNode *next = node->m_wheelNext;
+        link(node);
+        node = next;
+    }
+}
+
+void TimingWheel::advance(TimerClock::time_point now, std::vector<TimerNode *> &expired)
+{
+    if(now < m_base)
+    {
+        return;
+    }
+    uint64_t target = std::chrono::duration_cast<std::chrono::microseconds>(now - m_base).count() / m_tick.count();
+    while(m_current < target)
+    {
+        // 中间的空槽位直接跳过，下一个非空槽位(或者需要降级的高层槽位)之前没有事情要做
+        uint64_t tick = nextTick();
+        if(tick > target)
+        {
+            m_current = target;
+            break;
+        }
+        m_current = tick;
+
+        // 走到高层槽位的起点，先降级，其中到期时间就在这个tick的定时器会落到第0层的当前槽位
+        for(int level = 1; level < LEVELS; ++level)
+        {
+            int shift = LEVEL_BITS * level;
+            if(tick & ((1ull << shift) - 1)) break;
+            cascade(level, static_cast<int>((tick >> shift) & (SLOTS - 1)));
+        }
+
+        int slot = static_cast<int>(tick & (SLOTS - 1));
+        TimerNode *node = m_slots[0][slot];
+        while(node)
+        {
+            TimerNode *next = node->m_wheelNext;
+            if(node->m_expireTick <= tick)
+            {
+                unlink(node);
+                --m_size;
+                expired.push_back(node);
+            }
+            node = next;
+        }
+    }
+    // 通知过的tick已经走过了，调用者已经醒来，之后添加的定时器要和剩下的比较，由下一次nextExpire重新计算
+    if(m_nextHint <= m_current)
+    {
+        m_nextHint = m_size == 0 ? UINT64_MAX : nextTick();
+    }
+}
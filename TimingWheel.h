@@ -0,0 +1,68 @@
+// 分层时间轮
+// TimerManager可选的定时器存储，添加和取消都是O(1)，精度为一个tick
+
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "Timer.h"
+
+// 6层，每层64个槽位，第k层的一个槽位跨越64^k个tick，tick为1毫秒时可以覆盖两年多
+// 定时器和超时节点通过TimerNode里的侵入式链表挂在槽位上，取消时直接从链表中摘下
+// 高层槽位在时间走到它的起点时整体降级(cascade)，重新按照剩余时间放入低层
+// 调用者负责同步：持有定时器分片的写锁，或者是分片的拥有者
+class TimingWheel
+{
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;   // 每层的槽位数
+    static const int LEVELS = 6;                // 层数
+
+    // tick为时间轮的精度，定时器最多晚一个tick触发，不会提前触发
+    explicit TimingWheel(std::chrono::microseconds tick);
+
+    TimingWheel(const TimingWheel &) = delete;
+    TimingWheel &operator=(const TimingWheel &) = delete;
+
+    // 按照node->m_next放入时间轮，返回它是否早于之前所有的定时器
+    // 时间轮不管理节点的生命周期，节点在时间轮中时由调用者保证它有效
+    bool add(TimerNode *node);
+
+    // 从时间轮中取下，node不在时间轮中时返回false
+    bool remove(TimerNode *node);
+
+    // 时间走到now，所有到期的节点从时间轮中取下放入expired
+    void advance(TimerClock::time_point now, std::vector<TimerNode *> &expired);
+
+    // 取下所有节点放入nodes
+    void clear(std::vector<TimerNode *> &nodes);
+
+    // 最近一个定时器可能到期的时间点，是一个下界：高层槽位返回的是它降级的时间
+    // 没有定时器时返回TimerClock::time_point::max()
+    TimerClock::time_point nextExpire();
+
+    bool empty() const { return m_size == 0; }
+
+    size_t size() const { return m_size; }
+
+private:
+    // 放入expire_tick对应的槽位
+    void link(TimerNode *node);
+
+    // 从所在的槽位上摘下
+    void unlink(TimerNode *node);
+
+    // 最近一个非空槽位的tick，没有定时器时返回UINT64_MAX
+    uint64_t nextTick() const;
+
+    // 第level层的slot槽位降级
+    void cascade(int level, int slot);
+
+private:
+    std::chrono::microseconds m_tick;           // 每个tick的长度
+    TimerClock::time_point m_base;              // 第0个tick的时间点
+    uint64_t m_current = 0;                     // 已经处理到的tick
+    uint64_t m_nextHint = UINT64_MAX;           // 上次通知调用者的最近到期tick，用于判断新定时器是否最早，时间轮空了之后重置
+    size_t m_size = 0;                          // 定时器数量
+    TimerNode *m_slots[LEVELS][SLOTS];          // 每个槽位的链表头
+    uint64_t m_occupied[LEVELS];                // 每层非空槽位的位图
+};
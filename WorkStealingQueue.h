@@ -0,0 +1,111 @@
+// Chase-Lev 无锁工作窃取队列
+// 参考 Lê et al. "Correct and Efficient Work-Stealing for Weak Memory Models"
+
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// 只有队列所属线程可以push，任何线程(包括所属线程)都可以steal
+// 所属线程同样从顶部取任务，保持调度器先来先服务的顺序，这样协程自己重新调度自己时不会饿死队列里的其他任务
+// T 必须是指针之类可以原子读写的类型
+template <typename T>
+class WorkStealingQueue
+{
+public:
+    // steal的结果
+    enum StealResult
+    {
+        EMPTY = 0,  // 队列为空
+        ABORT,      // 和其他线程竞争失败，可以重试
+        SUCCESS     // 成功取到任务
+    };
+
+    explicit WorkStealingQueue(size_t capacity = 256)
+        : m_top(0), m_bottom(0), m_array(new Array(capacity))
+    {}
+
+    ~WorkStealingQueue()
+    {
+        delete m_array.load(std::memory_order_relaxed);
+        for(Array *a : m_garbage) delete a;
+    }
+
+    WorkStealingQueue(const WorkStealingQueue &) = delete;
+    WorkStealingQueue &operator=(const WorkStealingQueue &) = delete;
+
+    // 从底部放入任务，只能由所属线程调用
+    void push(T item)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        Array *a = m_array.load(std::memory_order_relaxed);
+        if(b - t > static_cast<int64_t>(a->capacity) - 1)
+        { // 队列满了，扩容，旧数组可能正被窃取者读取，等队列析构时再释放
+            Array *bigger = a->grow(b, t);
+            m_garbage.push_back(a);
+            a = bigger;
+            m_array.store(a, std::memory_order_release);
+        }
+        a->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // 从顶部取任务
+    StealResult steal(T &item)
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+        if(t >= b)
+        {
+            return EMPTY;
+        }
+        Array *a = m_array.load(std::memory_order_acquire);
+        T x = a->get(t);
+        if(!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return ABORT;
+        }
+        item = x;
+        return SUCCESS;
+    }
+
+    // 队列中任务数量的近似值
+    size_t size() const
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    // 环形数组，容量为2的幂
+    struct Array
+    {
+        size_t capacity;
+        size_t mask;
+        std::atomic<T> *buffer;
+
+        explicit Array(size_t c) : capacity(c), mask(c - 1), buffer(new std::atomic<T>[c]) {}
+        ~Array() { delete [] buffer; }
+
+        T get(int64_t i) const { return buffer[i & mask].load(std::memory_order_relaxed); }
+        void put(int64_t i, T x) { buffer[i & mask].store(x, std::memory_order_relaxed); }
+
+        Array *grow(int64_t bottom, int64_t top) const
+        {
+            Array *a = new Array(capacity * 2);
+            for(int64_t i = top; i != bottom; ++i) a->put(i, get(i));
+            return a;
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> m_top;     // 窃取端
+    alignas(64) std::atomic<int64_t> m_bottom;  // 所属线程放入端
+    alignas(64) std::atomic<Array *> m_array;   // 当前使用的数组
+    std::vector<Array *> m_garbage;             // 扩容之后被替换下来的旧数组
+};
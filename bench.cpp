@@ -0,0 +1,1122 @@
+// 性能测试
+// 用法: ./bench [name ...]，不带参数时运行全部测试
+
+#include <ucontext.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include "Fiber.h"
+#include "Scheduler.h"
+#include "FiberSync.h"
+#include "Channel.h"
+#include "IOManager.h"
+#include "StackAllocator.h"
+#include "Hook.h"
+#include "FdManager.h"
+#include "Acceptor.h"
+#include "Interrupt.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <thread>
+
+using namespace std;
+
+// 统计堆分配次数，只有需要的测试读取
+// 替换全部的全局operator new/delete，分配和释放都走malloc/free，不会和标准库的版本混用
+static std::atomic<uint64_t> s_allocations {0};
+
+static void *CountedAlloc(size_t size, size_t align) noexcept
+{
+    s_allocations.fetch_add(1, std::memory_order_relaxed);
+    if(size == 0) size = 1;
+    if(align <= alignof(std::max_align_t))
+    {
+        return malloc(size);
+    }
+    void *p = nullptr;
+    return posix_memalign(&p, align, size) == 0 ? p : nullptr;
+}
+
+// 不内联，否则编译器在内联之后看到operator new的返回值被传给free，会报-Wmismatched-new-delete
+static __attribute__((noinline)) void CountedFree(void *p) noexcept
+{
+    free(p);
+}
+
+void *operator new(size_t size)
+{
+    void *p = CountedAlloc(size, 0);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, std::align_val_t align)
+{
+    void *p = CountedAlloc(size, static_cast<size_t>(align));
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size, std::align_val_t align) { return operator new(size, align); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return CountedAlloc(size, 0); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return CountedAlloc(size, 0); }
+
+void *operator new(size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+    return CountedAlloc(size, static_cast<size_t>(align));
+}
+
+void *operator new[](size_t size, std::align_val_t align, const std::nothrow_t &) noexcept
+{
+    return CountedAlloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void *p) noexcept { CountedFree(p); }
+void operator delete[](void *p) noexcept { CountedFree(p); }
+void operator delete(void *p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void *p, size_t) noexcept { CountedFree(p); }
+void operator delete(void *p, std::align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { CountedFree(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { CountedFree(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { CountedFree(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { CountedFree(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { CountedFree(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { CountedFree(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { CountedFree(p); }
+
+// 计时工具，返回从构造开始经过的秒数
+class StopWatch
+{
+public:
+    StopWatch() : m_start(std::chrono::steady_clock::now()) {}
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// =======================context switch=========================
+static const int SWITCH_ROUNDS = 2000000;
+
+static ucontext_t s_uc_main, s_uc_child;
+
+static void uc_child_func()
+{
+    for(;;)
+    {
+        swapcontext(&s_uc_child, &s_uc_main);
+    }
+}
+
+// 协程切换速度：当前编译进来的Context后端 vs 直接调用swapcontext
+void bench_context_switch()
+{
+    Fiber::GetThis(); // 初始化线程主协程
+
+    Fiber::ptr fiber(new Fiber([](){
+        for(;;) Fiber::GetThis()->yield();
+    }, 0, false));
+
+    StopWatch sw;
+    for(int i = 0; i < SWITCH_ROUNDS; ++i)
+    {
+        fiber->resume();
+    }
+    double t = sw.elapsed();
+    // resume + yield 各算一次切换
+    cout << "context[" << Context::BackendName() << "]: " << static_cast<uint64_t>(SWITCH_ROUNDS * 2 / t) << " switches/s" << endl;
+
+    static char stack[128 * 1024];
+    getcontext(&s_uc_child);
+    s_uc_child.uc_stack.ss_sp = stack;
+    s_uc_child.uc_stack.ss_size = sizeof(stack);
+    s_uc_child.uc_link = nullptr;
+    makecontext(&s_uc_child, uc_child_func, 0);
+
+    StopWatch sw2;
+    for(int i = 0; i < SWITCH_ROUNDS; ++i)
+    {
+        swapcontext(&s_uc_main, &s_uc_child);
+    }
+    t = sw2.elapsed();
+    cout << "context[raw swapcontext]: " << static_cast<uint64_t>(SWITCH_ROUNDS * 2 / t) << " switches/s" << endl;
+    // fiber 永远不会结束，这里直接泄漏掉，避免析构时断言状态
+    new Fiber::ptr(fiber);
+}
+
+// =======================fiber create=========================
+static const int CREATE_ROUNDS = 200000;
+
+// 协程创建/销毁速度，以及创建过程中新mmap的栈数量
+void bench_fiber_create()
+{
+    Fiber::GetThis();
+
+    uint64_t mapped = PooledStackAllocator::MappedCount();
+    StopWatch sw;
+    for(int i = 0; i < CREATE_ROUNDS; ++i)
+    {
+        Fiber::ptr fiber(new Fiber([](){}, 0, false));
+        fiber->resume();
+    }
+    double t = sw.elapsed();
+    cout << "fiber create+run+destroy: " << static_cast<uint64_t>(CREATE_ROUNDS / t) << " fibers/s, "
+         << "stacks mapped: " << PooledStackAllocator::MappedCount() - mapped << endl;
+}
+
+// =======================shared stack=========================
+static const int IDLE_FIBERS = 10000;
+
+// 当前进程常驻内存，单位KB
+static size_t ResidentKB()
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if(!fp) return 0;
+    size_t total = 0, resident = 0;
+    if(fscanf(fp, "%zu %zu", &total, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE) / 1024;
+}
+
+static void idle_fiber_func()
+{
+    volatile char buf[2048]; // 模拟一个典型连接处理函数的栈深度
+    buf[0] = 1;
+    Fiber::GetThis()->yield();
+    buf[1] = buf[0];
+}
+
+static void park_fibers(bool shared)
+{
+    std::vector<Fiber::ptr> fibers;
+    fibers.reserve(IDLE_FIBERS);
+    size_t before = ResidentKB();
+    for(int i = 0; i < IDLE_FIBERS; ++i)
+    {
+        fibers.emplace_back(new Fiber(idle_fiber_func, 0, false, shared));
+        fibers.back()->resume(); // 运行到yield，之后一直挂起
+    }
+    size_t after = ResidentKB();
+    size_t saved = 0;
+    for(auto &f : fibers) saved += f->getSavedStackSize();
+    cout << (shared ? "shared stack" : "private stack") << ": " << IDLE_FIBERS << " idle fibers, resident +"
+         << after - before << "KB (" << (after - before) * 1024 / IDLE_FIBERS << " bytes/fiber)";
+    if(shared) cout << ", saved stack bytes/fiber: " << saved / IDLE_FIBERS;
+    cout << endl;
+    for(auto &f : fibers) f->resume();
+}
+
+// 大量挂起协程的常驻内存：私有栈 vs 共享栈
+void bench_shared_stack()
+{
+    Fiber::GetThis();
+    PooledStackAllocator::SetPoolCapacity(0); // 不缓存释放的栈，避免两次测试互相影响
+    park_fibers(false);
+    park_fibers(true);
+    PooledStackAllocator::SetPoolCapacity(128);
+}
+
+// =======================callback tasks=========================
+static const int CALLBACK_TASKS = 200000;
+
+// 大量回调任务的调度速度，以及调度过程中新建的协程栈数量
+void bench_callback_tasks()
+{
+    PooledStackAllocator::SetPoolCapacity(0); // 关闭栈池，每次新建协程都会mmap一个栈
+    uint64_t mapped = PooledStackAllocator::MappedCount();
+    std::atomic<int> count{0};
+    StopWatch sw;
+    {
+        Scheduler sc(2, false);
+        sc.start();
+        for(int i = 0; i < CALLBACK_TASKS; ++i)
+        {
+            sc.schedule([&count](){ ++count; });
+        }
+        sc.stop();
+    }
+    double t = sw.elapsed();
+    cout << "callbacks: " << count << ", " << static_cast<uint64_t>(count / t) << " tasks/s, stacks mapped: "
+         << PooledStackAllocator::MappedCount() - mapped << " (idle + callback fiber per worker)" << endl;
+    PooledStackAllocator::SetPoolCapacity(128);
+}
+
+// =======================scheduler scaling=========================
+static const int TREE_DEPTH = 14;   // 每棵任务树 2^15-1 个任务
+static const int TREE_ROOTS = 4;
+
+static std::atomic<uint64_t> s_tree_tasks{0};
+
+// 每个任务做一点计算，然后派生两个子任务，子任务由工作线程添加，会进入本地队列
+static void tree_task(int depth)
+{
+    ++s_tree_tasks;
+    volatile uint64_t x = depth;
+    for(int i = 0; i < 64; ++i) x = x * 6364136223846793005ull + 1;
+    if(depth > 0)
+    {
+        Scheduler::GetThis()->schedule(std::bind(tree_task, depth - 1));
+        Scheduler::GetThis()->schedule(std::bind(tree_task, depth - 1));
+    }
+}
+
+// 调度器吞吐量随线程数的变化
+void bench_scheduler_scaling()
+{
+    for(size_t threads = 1; threads <= 64; threads *= 2)
+    {
+        s_tree_tasks = 0;
+        StopWatch sw;
+        {
+            Scheduler sc(threads, false);
+            sc.start();
+            for(int i = 0; i < TREE_ROOTS; ++i)
+            {
+                sc.schedule(std::bind(tree_task, TREE_DEPTH));
+            }
+            sc.stop();
+        }
+        double t = sw.elapsed();
+        cout << "threads " << threads << ": " << s_tree_tasks << " tasks, " << static_cast<uint64_t>(s_tree_tasks / t) << " tasks/s" << endl;
+    }
+}
+
+// =======================idle workers=========================
+static const int IDLE_WORKERS = 4;
+static const int IDLE_MS = 300;
+
+// 进程消耗的CPU时间，单位秒
+static double ProcessCpuSeconds()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 没有任务和只有零星任务时，空闲工作线程消耗的CPU
+void bench_idle_workers()
+{
+    std::atomic<int> count{0};
+    Scheduler sc(IDLE_WORKERS, false);
+    sc.start();
+
+    double cpu = ProcessCpuSeconds();
+    StopWatch sw;
+    usleep(IDLE_MS * 1000);
+    double t = sw.elapsed();
+    cout << IDLE_WORKERS << " idle workers: " << static_cast<int>((ProcessCpuSeconds() - cpu) / t * 100) << "% cpu" << endl;
+
+    // 每毫秒一个任务
+    cpu = ProcessCpuSeconds();
+    StopWatch sw2;
+    for(int i = 0; i < IDLE_MS; ++i)
+    {
+        sc.schedule([&count](){ ++count; });
+        usleep(1000);
+    }
+    t = sw2.elapsed();
+    cout << IDLE_WORKERS << " workers, 1 task/ms: " << static_cast<int>((ProcessCpuSeconds() - cpu) / t * 100) << "% cpu" << endl;
+    sc.stop();
+}
+
+// =======================mutex contention=========================
+static const int MUTEX_THREADS = 4;
+static const int MUTEX_FIBERS = 4000;
+static const int MUTEX_OPS = 100;   // 每个协程加锁的次数
+
+template <typename Mutex>
+static void mutex_contention(const char *name)
+{
+    Mutex mtx;
+    uint64_t counter = 0;
+    StopWatch sw;
+    {
+        Scheduler sc(MUTEX_THREADS, false);
+        sc.start();
+        for(int i = 0; i < MUTEX_FIBERS; ++i)
+        {
+            sc.schedule([&mtx, &counter](){
+                for(int j = 0; j < MUTEX_OPS; ++j)
+                {
+                    std::lock_guard<Mutex> lk(mtx);
+                    volatile uint64_t x = counter;
+                    for(int k = 0; k < 32; ++k) x = x * 6364136223846793005ull + 1; // 临界区里做一点计算
+                    ++counter;
+                }
+            });
+        }
+        sc.stop();
+    }
+    double t = sw.elapsed();
+    cout << name << ": " << counter << " locks, " << static_cast<uint64_t>(counter / t) << " locks/s" << endl;
+}
+
+// 几个线程上几千个协程竞争同一把锁：FiberMutex vs std::mutex
+void bench_mutex_contention()
+{
+    mutex_contention<FiberMutex>("FiberMutex");
+    mutex_contention<std::mutex>("std::mutex");
+}
+
+// =======================channel=========================
+static const int PINGPONG_ROUNDS = 200000;
+static const int FANIN_PRODUCERS = 8;
+static const int FANIN_MESSAGES = 1000000;  // 所有生产者发送的消息总数
+
+// 两个协程通过两个容量为1的通道来回传递一个数，测量往返延迟
+static void channel_pingpong(size_t threads)
+{
+    Channel<int> ping(1), pong(1);
+    StopWatch sw;
+    {
+        Scheduler sc(threads, false);
+        sc.start();
+        sc.schedule([&ping, &pong](){
+            int v = 0;
+            while(pong.recv(v) && v < PINGPONG_ROUNDS) ping.send(v + 1);
+            ping.close();
+        });
+        sc.schedule([&ping, &pong](){
+            int v = 0;
+            pong.send(0);
+            while(ping.recv(v)) pong.send(v + 1);
+        });
+        sc.stop();
+    }
+    double t = sw.elapsed();
+    cout << "channel ping-pong, " << threads << " thread(s): " << static_cast<uint64_t>(t * 1e9 / (PINGPONG_ROUNDS / 2)) << " ns/round trip" << endl;
+}
+
+// 多个生产者协程向同一个通道发送，一个消费者协程接收，测量吞吐量
+static void channel_fanin(size_t threads)
+{
+    Channel<uint64_t> ch(1024);
+    std::atomic<int> producers{FANIN_PRODUCERS};
+    uint64_t received = 0;
+    StopWatch sw;
+    {
+        Scheduler sc(threads, false);
+        sc.start();
+        for(int i = 0; i < FANIN_PRODUCERS; ++i)
+        {
+            sc.schedule([&ch, &producers](){
+                for(int j = 0; j < FANIN_MESSAGES / FANIN_PRODUCERS; ++j) ch.send(j);
+                if(--producers == 0) ch.close();
+            });
+        }
+        sc.schedule([&ch, &received](){
+            uint64_t v = 0;
+            while(ch.recv(v)) ++received;
+        });
+        sc.stop();
+    }
+    double t = sw.elapsed();
+    cout << "channel fan-in " << FANIN_PRODUCERS << "->1, " << threads << " thread(s): " << received << " messages, "
+         << static_cast<uint64_t>(received / t) << " messages/s" << endl;
+}
+
+void bench_channel()
+{
+    channel_pingpong(1);
+    channel_pingpong(2);
+    channel_fanin(1);
+    channel_fanin(4);
+}
+
+// =======================IOManager schedule=========================
+static const int IOM_TASKS = 200000;
+
+// 外部线程向IOManager连续添加回调任务，每次添加都可能tickle空闲线程
+void bench_iomanager_schedule()
+{
+    std::atomic<int> count{0};
+    StopWatch sw;
+    {
+        IOManager iom(2, false);
+        for(int i = 0; i < IOM_TASKS; ++i)
+        {
+            iom.schedule([&count](){ ++count; });
+        }
+    }
+    double t = sw.elapsed();
+    cout << "IOManager callbacks: " << count << ", " << static_cast<uint64_t>(count / t) << " tasks/s" << endl;
+}
+
+// =======================hooked IO=========================
+static const int HOOKIO_ROUNDS = 100000;
+
+// 两个协程通过socketpair来回传递一个字节，read/write都经过hook，比较不同的IOManager配置
+// hook开关是线程局部的，协程可能换到其他工作线程上，所以每次调用之前都打开hook
+// 多个工作线程时同时跑pairs组，统计每组一次来回的平均时间
+static void hookio_pingpong(const IOManagerOptions &options, const char *name, size_t threads = 1, int pairs = 1)
+{
+    std::vector<int> fds(pairs * 2);
+    for(int i = 0; i < pairs; ++i)
+    {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, &fds[i * 2]);
+    }
+    bool uring = false;
+    StopWatch sw;
+    {
+        IOManager iom(threads, false, "hookio", options);
+        uring = iom.isIoUring();
+        for(int i = 0; i < pairs; ++i)
+        {
+            int a = fds[i * 2], b = fds[i * 2 + 1];
+            iom.schedule([a](){
+                set_hook_enable(true);
+                FdMgr::GetInstance()->get(a, true);
+                char c = 0;
+                for(int i = 0; i < HOOKIO_ROUNDS; ++i)
+                {
+                    set_hook_enable(true);
+                    write(a, &c, 1);
+                    set_hook_enable(true);
+                    read(a, &c, 1);
+                }
+            });
+            iom.schedule([b](){
+                set_hook_enable(true);
+                FdMgr::GetInstance()->get(b, true);
+                char c = 0;
+                for(int i = 0; i < HOOKIO_ROUNDS; ++i)
+                {
+                    set_hook_enable(true);
+                    read(b, &c, 1);
+                    set_hook_enable(true);
+                    write(b, &c, 1);
+                }
+            });
+        }
+    }
+    double t = sw.elapsed();
+    for(int fd : fds)
+    {
+        FdMgr::GetInstance()->del(fd);
+        ::close(fd);
+    }
+    cout << "hooked socketpair ping-pong, " << name << (options.use_io_uring && !uring ? " (fallback to epoll)" : "");
+    if(threads > 1) cout << ", " << threads << " threads " << pairs << " pairs";
+    cout << ": " << static_cast<uint64_t>(t * 1e9 / HOOKIO_ROUNDS) << " ns/round trip" << endl;
+}
+
+void bench_hooked_io()
+{
+    IOManagerOptions options;
+    hookio_pingpong(options, "epoll one-shot");
+    options.persistent_registration = true;
+    hookio_pingpong(options, "epoll persistent");
+    options.persistent_registration = false;
+    options.use_io_uring = true;
+    hookio_pingpong(options, "io_uring");
+
+    // 多个工作线程时比较就绪协程走任务队列和直接交接
+    size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    options = IOManagerOptions();
+    hookio_pingpong(options, "epoll one-shot", threads, static_cast<int>(threads));
+    options.run_next = true;
+    hookio_pingpong(options, "epoll one-shot + runnext", threads, static_cast<int>(threads));
+}
+
+// =======================timed recv allocations=========================
+static const int TIMEDIO_WARMUP = 1000;
+static const int TIMEDIO_ROUNDS = 100000;
+
+// 和hookio一样来回传递一个字节，但是两端都设置了SO_RCVTIMEO，每次阻塞的read都要启动和停止超时
+// deadline为true时不设置SO_RCVTIMEO，整个循环放在一个DeadlineScope中，只有协程的截止时间节点，read不再启动自己的超时
+// 统计预热之后每次read平均的堆分配次数和耗时
+static void timed_pingpong(const IOManagerOptions &options, const char *name, bool shared_stack = false,
+                           bool deadline = false)
+{
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    uint64_t allocations = 0;
+    double t = 0;
+    {
+        IOManager iom(1, false, "timedio", options);
+        auto side = [&allocations, &t, deadline](int fd, bool first){
+            set_hook_enable(true);
+            FdMgr::GetInstance()->get(fd, true);
+            std::unique_ptr<DeadlineScope> scope;
+            if(deadline) scope.reset(new DeadlineScope(std::chrono::seconds(60)));
+            else
+            {
+                timeval tv {5, 0};
+                set_hook_enable(true);
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            }
+            char c = 0;
+            uint64_t start = 0;
+            StopWatch sw;
+            for(int i = 0; i < TIMEDIO_WARMUP + TIMEDIO_ROUNDS; ++i)
+            {
+                if(first && i == TIMEDIO_WARMUP)
+                {
+                    start = s_allocations.load(std::memory_order_relaxed);
+                    sw = StopWatch();
+                }
+                set_hook_enable(true);
+                if(first) write(fd, &c, 1);
+                set_hook_enable(true);
+                read(fd, &c, 1);
+                set_hook_enable(true);
+                if(!first) write(fd, &c, 1);
+            }
+            if(first)
+            {
+                allocations = s_allocations.load(std::memory_order_relaxed) - start;
+                t = sw.elapsed();
+            }
+        };
+        iom.schedule(Fiber::ptr(new Fiber(std::bind(side, fds[0], true), 0, true, shared_stack)));
+        iom.schedule(Fiber::ptr(new Fiber(std::bind(side, fds[1], false), 0, true, shared_stack)));
+    }
+    for(int fd : fds)
+    {
+        FdMgr::GetInstance()->del(fd);
+        ::close(fd);
+    }
+    // 每轮两端各有一次阻塞的read
+    cout << "timed recv ping-pong, " << name << ": " << static_cast<double>(allocations) / (TIMEDIO_ROUNDS * 2)
+         << " allocations per read, " << static_cast<uint64_t>(t * 1e9 / TIMEDIO_ROUNDS) << " ns/round trip" << endl;
+}
+
+void bench_timed_io()
+{
+    IOManagerOptions options;
+    timed_pingpong(options, "epoll one-shot");
+    options.run_next = true;
+    timed_pingpong(options, "epoll one-shot + runnext");
+    options.run_next = false;
+    timed_pingpong(options, "epoll one-shot, shared stack fibers", true);
+    timed_pingpong(options, "epoll one-shot, per-fiber deadline", false, true);
+}
+
+// =======================fd context table=========================
+static const int FDTABLE_SOCKETS = 2000;    // socketpair数量，fd数量是它的两倍
+static const int FDTABLE_ROUNDS = 200;      // 每个fd添加/删除事件的次数
+
+// 持久注册模式下fd注册之后addEvent/delEvent不再调用epoll_ctl，测量的主要是查找fd上下文和加锁的开销
+void bench_fd_table()
+{
+    std::vector<int> fds;
+    for(int i = 0; i < FDTABLE_SOCKETS; ++i)
+    {
+        int sv[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) break;
+        fds.push_back(sv[0]);
+        fds.push_back(sv[1]);
+    }
+    IOManagerOptions options;
+    options.persistent_registration = true;
+    uint64_t ops = 0;
+    double t = 0;
+    {
+        IOManager iom(1, false, "fdtable", options);
+        // 第一轮完成注册，之后的轮次只操作上下文表
+        for(int fd : fds) iom.addEvent(fd, IOManager::READ, [](){});
+        for(int fd : fds) iom.delEvent(fd, IOManager::READ);
+        StopWatch sw;
+        for(int round = 0; round < FDTABLE_ROUNDS; ++round)
+        {
+            for(int fd : fds)
+            {
+                iom.addEvent(fd, IOManager::READ, [](){});
+                iom.delEvent(fd, IOManager::READ);
+                ops += 2;
+            }
+        }
+        t = sw.elapsed();
+        for(int fd : fds) iom.cancalAll(fd);
+    }
+    for(int fd : fds) ::close(fd);
+    cout << "fd table, " << fds.size() << " fds: " << static_cast<uint64_t>(ops / t) << " addEvent+delEvent ops/s" << endl;
+}
+
+// =======================acceptor=========================
+static const int ACCEPT_CLIENTS = 4;        // 发起连接的线程数
+static const int ACCEPT_CONNECTIONS = 2000; // 每个线程发起的连接数
+
+// 客户端线程不断connect然后立即RST关闭，服务端的处理函数只关闭连接，测量每秒接收的连接数
+static void connect_clients(const sockaddr_in &addr)
+{
+    std::vector<std::thread> clients;
+    for(int i = 0; i < ACCEPT_CLIENTS; ++i)
+    {
+        clients.emplace_back([&addr](){
+            linger lg = {1, 0}; // RST关闭，客户端不进入TIME_WAIT
+            for(int j = 0; j < ACCEPT_CONNECTIONS; ++j)
+            {
+                int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                if(::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)))
+                {
+                    perror("connect");
+                }
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                ::close(fd);
+            }
+        });
+    }
+    for(auto &t : clients) t.join();
+}
+
+static void close_connection(int fd)
+{
+    FdMgr::GetInstance()->del(fd);
+    ::close(fd);
+}
+
+// 原来server.cpp的做法：每次可读只accept一个连接，然后重新addEvent
+static void accept_one_per_event(size_t threads)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    socklen_t len = sizeof(addr);
+    ::bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), len);
+    ::listen(listen_fd, SOMAXCONN);
+    getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr), &len);
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+
+    const int total = ACCEPT_CLIENTS * ACCEPT_CONNECTIONS;
+    StopWatch sw;
+    {
+        IOManager iom(threads, false, "accept");
+        iom.schedule([&iom, listen_fd, total](){
+            for(int n = 0; n < total;)
+            {
+                int fd = ::accept(listen_fd, nullptr, nullptr);
+                if(fd >= 0)
+                {
+                    ++n;
+                    fcntl(fd, F_SETFL, O_NONBLOCK);
+                    iom.schedule(std::bind(close_connection, fd));
+                    if(n == total) break;
+                }
+                iom.addEvent(listen_fd, IOManager::READ);
+                Fiber::GetThis()->yield();
+            }
+        });
+        connect_clients(addr);
+    }
+    double t = sw.elapsed();
+    ::close(listen_fd);
+    cout << "accept one per event, " << threads << " threads: " << static_cast<uint64_t>(total / t) << " connections/s" << endl;
+}
+
+static void accept_with_acceptor(size_t threads, bool reuse_port)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const uint64_t total = ACCEPT_CLIENTS * ACCEPT_CONNECTIONS;
+    IOManagerOptions options;
+    options.per_worker_epoll = reuse_port;
+    StopWatch sw;
+    {
+        IOManager iom(threads, false, "accept", options);
+        AcceptorOptions acceptor_options;
+        acceptor_options.reuse_port = reuse_port;
+        Acceptor acceptor(&iom, close_connection, acceptor_options);
+        if(!acceptor.bind(reinterpret_cast<sockaddr *>(&addr), sizeof(addr)))
+        {
+            perror("bind");
+            return;
+        }
+        socklen_t len = sizeof(addr);
+        getsockname(acceptor.getListenFds()[0], reinterpret_cast<sockaddr *>(&addr), &len);
+        acceptor.start();
+        connect_clients(addr);
+        while(acceptor.getAcceptedCount() < total) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        acceptor.stop();
+    }
+    double t = sw.elapsed();
+    cout << "Acceptor" << (reuse_port ? " + SO_REUSEPORT per worker" : "") << ", " << threads << " threads: "
+         << static_cast<uint64_t>(total / t) << " connections/s" << endl;
+}
+
+void bench_acceptor()
+{
+    size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    accept_one_per_event(threads);
+    accept_with_acceptor(threads, false);
+    accept_with_acceptor(threads, true);
+}
+
+// =======================timer store=========================
+static const int WHEEL_TIMERS = 1000000;
+static const auto WHEEL_MAX_DELAY = std::chrono::milliseconds(200);
+
+class BenchTimerManager : public TimerManager
+{
+public:
+    explicit BenchTimerManager(std::chrono::microseconds wheel_tick) : TimerManager(wheel_tick) {}
+protected:
+    void onTimerInsertedAtFront() override {}
+};
+
+// 添加100万个定时器，取消一半，剩下的全部到期，分别统计每个阶段每次操作的耗时
+static void timer_store(std::chrono::microseconds wheel_tick, const char *name)
+{
+    BenchTimerManager manager(wheel_tick);
+    std::vector<Timer::ptr> timers;
+    timers.reserve(WHEEL_TIMERS);
+    uint64_t seed = 88172645463325252ull;
+    int fired = 0;
+
+    StopWatch add_sw;
+    for(int i = 0; i < WHEEL_TIMERS; ++i)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        auto delay = std::chrono::microseconds(seed % std::chrono::microseconds(WHEEL_MAX_DELAY).count());
+        timers.push_back(manager.addTimer(delay, [&fired](){ ++fired; }));
+    }
+    double add_t = add_sw.elapsed();
+
+    StopWatch cancel_sw;
+    for(int i = 0; i < WHEEL_TIMERS; i += 2)
+    {
+        timers[i]->cancel();
+    }
+    double cancel_t = cancel_sw.elapsed();
+    timers.clear();
+
+    // 只统计listExpiredCb本身的时间，不算等待定时器到期的时间
+    double expire_t = 0;
+    std::vector<std::function<void()>> cbs;
+    while(manager.hasTimer())
+    {
+        StopWatch sw;
+        manager.listExpiredCb(cbs);
+        expire_t += sw.elapsed();
+        for(auto &cb : cbs) cb();
+        cbs.clear();
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+    cout << "1M timers, " << name << ": add " << static_cast<uint64_t>(add_t * 1e9 / WHEEL_TIMERS) << " ns, cancel "
+         << static_cast<uint64_t>(cancel_t * 1e9 / (WHEEL_TIMERS / 2)) << " ns, expire "
+         << static_cast<uint64_t>(expire_t * 1e9 / fired) << " ns per timer (" << fired << " fired)" << endl;
+}
+
+void bench_timer_store()
+{
+    timer_store(std::chrono::microseconds(0), "std::set");
+    timer_store(std::chrono::milliseconds(1), "timing wheel 1ms tick");
+}
+
+// =======================timer slack=========================
+static const int SLACK_TIMERS = 200000;
+static const auto SLACK_MAX_DELAY = std::chrono::seconds(1);
+
+// 模拟idle：添加20万个0~1秒的空闲超时，然后睡到最近的定时器到期、收集到期定时器，直到全部触发
+// 统计添加的耗时、醒来的次数以及每次醒来平均收集的回调数量
+static void timer_slack(std::chrono::microseconds slack, const char *name)
+{
+    BenchTimerManager manager(std::chrono::microseconds(0));
+    uint64_t seed = 88172645463325252ull;
+    int fired = 0;
+    StopWatch add_sw;
+    for(int i = 0; i < SLACK_TIMERS; ++i)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        auto delay = std::chrono::microseconds(seed % std::chrono::microseconds(SLACK_MAX_DELAY).count());
+        manager.addTimer(delay, [&fired](){ ++fired; }, false, slack);
+    }
+    double add_t = add_sw.elapsed();
+
+    int wakeups = 0;
+    std::vector<std::function<void()>> cbs;
+    for(;;)
+    {
+        std::chrono::microseconds next = manager.getNextTimer();
+        if(next == std::chrono::microseconds(~0ull)) break;
+        std::this_thread::sleep_for(next);
+        manager.listExpiredCb(cbs);
+        if(cbs.empty()) continue;
+        ++wakeups;
+        for(auto &cb : cbs) cb();
+        cbs.clear();
+    }
+    cout << "200k idle timeouts, " << name << ": add " << static_cast<uint64_t>(add_t * 1e9 / SLACK_TIMERS) << " ns, "
+         << wakeups << " wakeups, " << fired / std::max(wakeups, 1) << " timers per wakeup" << endl;
+}
+
+void bench_timer_slack()
+{
+    timer_slack(std::chrono::microseconds(0), "no slack");
+    timer_slack(std::chrono::milliseconds(10), "10ms slack");
+    timer_slack(std::chrono::milliseconds(100), "100ms slack");
+}
+
+// =======================timer shards=========================
+static const int SHARD_WORKERS = 4;
+static const int SHARD_FIBERS = 64;
+static const int SHARD_ROUNDS = 20000;  // 每个协程添加并取消定时器的次数
+static const int SHARD_YIELD = 64;      // 每隔多少次让出一次，协程可能换到别的线程上，之后的取消就是跨线程的
+
+// 模拟带超时的IO：添加一个超时定时器，IO完成后马上取消
+static void timer_add_cancel(const IOManagerOptions &options, const char *name)
+{
+    StopWatch sw;
+    {
+        IOManager iom(SHARD_WORKERS, false, "timershard", options);
+        for(int i = 0; i < SHARD_FIBERS; ++i)
+        {
+            iom.schedule([&iom](){
+                Timer::ptr pending;
+                for(int j = 0; j < SHARD_ROUNDS; ++j)
+                {
+                    Timer::ptr timer = iom.addTimer(std::chrono::seconds(5), [](){});
+                    if(j % SHARD_YIELD == 0)
+                    { // 带着没取消的定时器让出，可能在另一个线程上恢复
+                        if(pending) pending->cancel();
+                        pending = timer;
+                        iom.schedule(Fiber::GetThis());
+                        Fiber::GetThis()->yield();
+                    }
+                    else timer->cancel();
+                }
+                if(pending) pending->cancel();
+            });
+        }
+        iom.stop();
+    }
+    double t = sw.elapsed();
+    cout << SHARD_WORKERS << " workers, " << name << ": " << static_cast<uint64_t>(t * 1e9 / (SHARD_FIBERS * SHARD_ROUNDS))
+         << " ns per add+cancel" << endl;
+}
+
+void bench_timer_shards()
+{
+    IOManagerOptions options;
+    options.per_worker_epoll = true;
+    timer_add_cancel(options, "shared locked store");
+    options.per_worker_timers = true;
+    timer_add_cancel(options, "per-worker timers");
+    options.timer_wheel_tick = std::chrono::milliseconds(1);
+    timer_add_cancel(options, "per-worker timing wheels");
+}
+
+// =======================timer precision=========================
+static const int TIMER_FIBERS = 10;
+static const int TIMER_ROUNDS = 500;    // 每个协程等待定时器的次数
+static const auto TIMER_DELAY = std::chrono::microseconds(200);
+
+// 多个协程反复等待200微秒的定时器，统计定时器回调比到期时间晚了多少以及CPU占用
+static void timer_precision(const IOManagerOptions &options, const char *name)
+{
+    std::vector<int64_t> lateness;
+    lateness.reserve(TIMER_FIBERS * TIMER_ROUNDS);
+    std::mutex mtx;
+    IOManager::BusyPollStats stats;
+    double cpu = ProcessCpuSeconds();
+    StopWatch sw;
+    {
+        IOManager iom(1, false, "timer", options);
+        for(int i = 0; i < TIMER_FIBERS; ++i)
+        {
+            iom.schedule([&iom, &lateness, &mtx](){
+                Fiber::ptr fiber = Fiber::GetThis();
+                for(int j = 0; j < TIMER_ROUNDS; ++j)
+                {
+                    auto deadline = std::chrono::steady_clock::now() + TIMER_DELAY;
+                    int64_t late = 0;
+                    iom.addTimer(TIMER_DELAY, [&iom, fiber, deadline, &late](){
+                        late = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - deadline).count();
+                        iom.schedule(fiber);
+                    });
+                    Fiber::GetThis()->yield();
+                    std::lock_guard<std::mutex> lk(mtx);
+                    lateness.push_back(late);
+                }
+            });
+        }
+        iom.stop();
+        stats = iom.getBusyPollStats();
+    }
+    double t = sw.elapsed();
+    double used = ProcessCpuSeconds() - cpu;
+    std::sort(lateness.begin(), lateness.end());
+    int64_t sum = 0;
+    for(int64_t l : lateness) sum += l;
+    cout << "200us timers, " << name << ", " << lateness.size() << " fires: mean late " << sum / static_cast<int64_t>(lateness.size())
+         << "us, p99 late " << lateness[lateness.size() * 99 / 100] << "us, " << static_cast<int>(used / t * 100) << "% cpu" << endl;
+    if(options.busy_poll.count() > 0)
+    {
+        cout << "    spin " << stats.spinUs << "us (" << stats.spinHits << " hits, " << stats.spinMisses << " misses), blocked "
+             << stats.blockedUs << "us" << endl;
+    }
+}
+
+void bench_timer_precision()
+{
+    IOManagerOptions options;
+    timer_precision(options, "blocking idle");
+    options.busy_poll = std::chrono::microseconds(500);
+    timer_precision(options, "busy poll 500us");
+}
+
+// =======================cancellation=========================
+static const int CANCEL_FIBERS = 1000;  // 同时挂起的协程数量
+
+enum CancelWait
+{
+    CANCEL_READ,        // 各自socketpair上的hook read
+    CANCEL_SLEEP,       // hook的sleep
+    CANCEL_CHANNEL      // 同一个通道上的recv
+};
+
+// 每个协程关联自己的取消令牌之后挂起，全部挂起之后逐个cancel，统计从第一个cancel到所有协程醒来的平均时间
+// 通道上的协程都在同一个等待队列里，每次取消都要在队列中找到对应的协程
+static void cancel_waits(CancelWait kind, const char *name)
+{
+    std::vector<int> fds;
+    if(kind == CANCEL_READ)
+    {
+        for(int i = 0; i < CANCEL_FIBERS; ++i)
+        {
+            int sv[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+            fds.push_back(sv[0]);
+            fds.push_back(sv[1]);
+        }
+    }
+    Channel<int> channel(16);
+    std::vector<CancellationToken::ptr> tokens;
+    for(int i = 0; i < CANCEL_FIBERS; ++i) tokens.emplace_back(new CancellationToken);
+    std::atomic<int> parked {0};
+    std::atomic<int> cancelled {0};
+    double t = 0;
+    {
+        IOManager iom(1, false, "cancel");
+        for(int i = 0; i < CANCEL_FIBERS; ++i)
+        {
+            iom.schedule([&, i](){
+                CancellationScope scope(tokens[i]);
+                ++parked;
+                bool failed = false;
+                if(kind == CANCEL_READ)
+                {
+                    char c;
+                    FdMgr::GetInstance()->get(fds[i * 2], true);
+                    set_hook_enable(true);
+                    failed = read(fds[i * 2], &c, 1) < 0;
+                }
+                else if(kind == CANCEL_SLEEP)
+                {
+                    set_hook_enable(true);
+                    failed = sleep(100) > 0;
+                }
+                else
+                {
+                    int v;
+                    failed = !channel.recv(v);
+                }
+                if(failed) ++cancelled;
+            });
+        }
+        iom.schedule([&](){
+            // 等所有协程都挂起
+            while(parked < CANCEL_FIBERS)
+            {
+                iom.schedule(Fiber::GetThis());
+                Fiber::GetThis()->yield();
+            }
+            iom.schedule(Fiber::GetThis());
+            Fiber::GetThis()->yield();
+            StopWatch sw;
+            for(auto &token : tokens) token->cancel();
+            while(cancelled < CANCEL_FIBERS)
+            {
+                iom.schedule(Fiber::GetThis());
+                Fiber::GetThis()->yield();
+            }
+            t = sw.elapsed();
+        });
+    }
+    for(int fd : fds)
+    {
+        FdMgr::GetInstance()->del(fd);
+        ::close(fd);
+    }
+    cout << "cancel " << CANCEL_FIBERS << " fibers parked in " << name << ": "
+         << static_cast<uint64_t>(t * 1e9 / CANCEL_FIBERS) << " ns per cancelled wait" << endl;
+}
+
+void bench_cancel()
+{
+    cancel_waits(CANCEL_READ, "hooked read");
+    cancel_waits(CANCEL_SLEEP, "hooked sleep");
+    cancel_waits(CANCEL_CHANNEL, "one channel recv");
+}
+
+// ============== main ================
+
+struct BenchEntry
+{
+    const char *name;
+    void (*func)();
+};
+
+static const BenchEntry s_benches[] = {
+    {"context", bench_context_switch},
+    {"create", bench_fiber_create},
+    {"sharedstack", bench_shared_stack},
+    {"callback", bench_callback_tasks},
+    {"scaling", bench_scheduler_scaling},
+    {"idle", bench_idle_workers},
+    {"mutex", bench_mutex_contention},
+    {"channel", bench_channel},
+    {"ioschedule", bench_iomanager_schedule},
+    {"hookio", bench_hooked_io},
+    {"timedio", bench_timed_io},
+    {"fdtable", bench_fd_table},
+    {"accept", bench_acceptor},
+    {"timerwheel", bench_timer_store},
+    {"timershard", bench_timer_shards},
+    {"timerslack", bench_timer_slack},
+    {"timer", bench_timer_precision},
+    {"cancel", bench_cancel},
+};
+
+int main(int argc, char *argv[])
+{
+    for(const BenchEntry &b : s_benches)
+    {
+        bool run = (argc == 1);
+        for(int i = 1; i < argc; ++i)
+        {
+            if(strcmp(argv[i], b.name) == 0) run = true;
+        }
+        if(run)
+        {
+            cout << "=== " << b.name << " ===" << endl;
+            b.func();
+        }
+    }
+    return 0;
+}
@@ -1,108 +1,88 @@
 #include "Scheduler.h"
 #include "Timer.h"
 #include "IOManager.h"
+#include "Acceptor.h"
 // #include "Hook.h"
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <fcntl.h>
 #include <iostream>
-#include <stack>
 #include <string.h>
 
-static int sock_listen_fd = -1;
-
-void test_accept();
-void error(char *msg)
-{
-    perror(msg);
-    printf("erreur....\n");
-    exit(1);
-}
-
-void watch_io_read()
+// 写完全部数据，发送缓冲区满时等待fd可写
+static bool write_all(int fd, const char *buf, size_t len)
 {
-    IOManager::GetThis()->addEvent(sock_listen_fd, IOManager::READ, test_accept);
-}
-
-void test_accept()
-{ // 回声服务器
-    sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    socklen_t len = sizeof(addr);
-    int fd = accept(sock_listen_fd, reinterpret_cast<sockaddr *>(&addr), &len);
-    errno;
-    if (fd < 0)
+    while(len > 0)
     {
-        std::cout << "fd ==" << fd << "accept false" << std::endl;
+        ssize_t ret = write(fd, buf, len);
+        if(ret > 0)
+        {
+            buf += ret;
+            len -= ret;
+        }
+        else if(ret < 0 && errno == EAGAIN)
+        {
+            if(IOManager::GetThis()->addEvent(fd, IOManager::WRITE)) return false;
+            Fiber::GetThis()->yield();
+        }
+        else if(ret < 0 && errno == EINTR) continue;
+        else return false;
     }
-    else
+    return true;
+}
+
+void echo(int fd)
+{ // 回声服务器，Acceptor交过来的连接已经是非阻塞的
+    std::cout << "accept successful" << std::endl;
+    char buffer[1024];
+    for(;;)
     {
-        std::cout<<"accept successful"<<std::endl;
-        fcntl(fd, F_SETFL, O_NONBLOCK);
-        IOManager::GetThis()->addEvent(fd, IOManager::READ, [fd]()
-                                       {
-            char buffer[1024];
-            memset(buffer, 0, sizeof(buffer));
-            for(;;)
-            {
-                int ret = read(fd, buffer, sizeof(buffer));
-                if(ret > 0)
-                {
-                    ret = write(fd, buffer, sizeof(buffer));
-                }
-                if(ret <= 0)
-                {
-                    if(errno == EAGAIN) continue;
-                    close(fd);
-                    break;
-                }
-            } });
+        ssize_t ret = read(fd, buffer, sizeof(buffer));
+        if(ret > 0)
+        {
+            if(!write_all(fd, buffer, ret)) break;
+        }
+        else if(ret < 0 && errno == EAGAIN)
+        { // 没有数据，等待fd可读
+            if(IOManager::GetThis()->addEvent(fd, IOManager::READ)) break;
+            Fiber::GetThis()->yield();
+        }
+        else if(ret < 0 && errno == EINTR) continue;
+        else break; // 对端关闭或者出错
     }
-    IOManager::GetThis()->schedule(watch_io_read);
+    IOManager::GetThis()->cancalAll(fd);
+    close(fd);
 }
 
-void test_IOmanager()
+int main(int argc, char *argv[])
 {
     int portno = 9000;
-    sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    sock_listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock_listen_fd < 0)
-    {
-        std::cerr << "Error creating socket listen-fd." << std::endl;
-        exit(0);
-    }
-    int yes = 1;
-    setsockopt(sock_listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    size_t threads = argc > 1 ? atoi(argv[1]) : 1; // 工作线程数量，大于1时每个线程一个SO_REUSEPORT监听socket
 
-    memset(reinterpret_cast<char *>(&server_addr), 0, sizeof(server_addr));
+    IOManagerOptions options;
+    options.per_worker_epoll = threads > 1;
+    IOManager iom(threads, true, "server", options);
+
+    AcceptorOptions acceptor_options;
+    acceptor_options.reuse_port = threads > 1;
+    Acceptor acceptor(&iom, echo, acceptor_options);
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     server_addr.sin_port = htons(portno);
-
-    if (bind(sock_listen_fd, reinterpret_cast<sockaddr *>(&server_addr), sizeof(server_addr)) < 0)
+    if(!acceptor.bind(reinterpret_cast<sockaddr *>(&server_addr), sizeof(server_addr)))
     {
-        std::cerr << "Error creating socket listen-fd." << std::endl;
-        exit(0);
+        perror("bind");
+        return 1;
     }
     printf("epoll echo server listening for connetions on port : %d\n", portno);
+    acceptor.start();
 
-    if (listen(sock_listen_fd, 1) == -1)
-    {
-        std::cerr << "Error listen socket listen-fd." << std::endl;
-        exit(0);
-    }
-    fcntl(sock_listen_fd, F_SETFL, O_NONBLOCK);
-    IOManager::GetThis()->addEvent(sock_listen_fd, IOManager::READ, test_accept);
-}
-
-int main(int argc, char *argv[])
-{
-    IOManager iom;
-    iom.schedule(test_IOmanager);
-    for(;;);
+    // use_caller模式下主线程在stop中参与调度，接收协程一直在等待连接，不会返回
+    iom.stop();
     return 0;
-}
\ No newline at end of file
+}
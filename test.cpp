@@ -6,11 +6,18 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <fcntl.h>      // fcntl()
+#include <atomic>
+#include <chrono>
+#include <memory>
 #include <thread>
 #include "Scheduler.h"
 #include "Timer.h"
 #include "IOManager.h"
 #include "Hook.h"
+#include "FiberSync.h"
+#include "Channel.h"
+#include "FdManager.h"
+#include "Interrupt.h"
 
 using namespace std;
 
@@ -183,10 +190,502 @@ void test_hook()
     iom.schedule(std::bind(test_sock, std::ref(iom)));
     return;
 }
+// ==============checks===============
+// 行为检查：./test check 运行，结果不对时打印原因并以非0退出，ctest通过它运行
+static std::atomic<int> s_failures {0};
+
+static void Expect(bool ok, const char *what)
+{
+    if(!ok)
+    {
+        cout << "FAILED: " << what << endl;
+        ++s_failures;
+    }
+}
+
+class StopWatch
+{
+public:
+    StopWatch() : m_start(std::chrono::steady_clock::now()) {}
+    double elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+    }
+private:
+    std::chrono::steady_clock::time_point m_start;
+};
+
+// yield之后协程可能换了线程，通过不内联的函数重新取errno的地址
+static __attribute__((noinline)) int LastErrno()
+{
+    return errno;
+}
+
+// 等待信号量，最多等待timeout，超时说明被等待的协程没有醒来
+static bool WaitFor(FiberSemaphore &sem, std::chrono::microseconds timeout)
+{
+    DeadlineScope deadline(timeout);
+    return sem.wait_interruptible() == 0;
+}
+
+// ----------------截止时间和取消令牌----------------
+// 已经取消的令牌：所有可打断的等待都直接以ECANCELED失败，不会挂起
+static void check_cancel_before_wait()
+{
+    CancellationToken::ptr token(new CancellationToken);
+    token->cancel();
+    CancellationScope scope(token);
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    FdMgr::GetInstance()->get(sv[0], true);
+    StopWatch sw;
+    char c;
+    set_hook_enable(true);
+    ssize_t n = read(sv[0], &c, 1);
+    Expect(n == -1 && LastErrno() == ECANCELED, "read with a cancelled token fails with ECANCELED");
+    set_hook_enable(true);
+    unsigned left = sleep(10);
+    Expect(left == 10 && LastErrno() == ECANCELED, "sleep with a cancelled token returns at once with ECANCELED");
+    Channel<int> channel(2);
+    int v;
+    Expect(!channel.recv(v) && LastErrno() == ECANCELED, "channel recv with a cancelled token fails with ECANCELED");
+    FiberSemaphore sem;
+    Expect(sem.wait_interruptible() == ECANCELED, "semaphore wait with a cancelled token fails with ECANCELED");
+    FiberMutex mutex;
+    mutex.lock();
+    Expect(mutex.lock_interruptible() == ECANCELED, "mutex lock with a cancelled token fails with ECANCELED");
+    FiberCondVar cond;
+    {
+        std::unique_lock<FiberMutex> lk(mutex, std::adopt_lock);
+        Expect(cond.wait_interruptible(lk) == ECANCELED && lk.owns_lock(),
+               "condvar wait with a cancelled token fails with ECANCELED and keeps the lock");
+    }
+    Expect(sw.elapsed() < 0.05, "waits with a cancelled token do not suspend");
+    set_hook_enable(true);
+    close(sv[0]);
+    ::close(sv[1]);
+}
+
+// 截止时间：到期时等待以ETIMEDOUT结束，不会提前；过期之后的IO直接失败；截止时间之前完成的IO不受影响
+static void check_deadline()
+{
+    IOManager *iom = IOManager::GetThis();
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    FdMgr::GetInstance()->get(sv[0], true);
+    char c;
+    {
+        DeadlineScope deadline(std::chrono::milliseconds(50));
+        StopWatch sw;
+        set_hook_enable(true);
+        ssize_t n = read(sv[0], &c, 1);
+        int err = LastErrno();
+        double t = sw.elapsed();
+        Expect(n == -1 && err == ETIMEDOUT, "read past the deadline fails with ETIMEDOUT");
+        Expect(t >= 0.049 && t < 0.5, "read wakes at the deadline");
+        sw = StopWatch();
+        set_hook_enable(true);
+        n = read(sv[0], &c, 1);
+        Expect(n == -1 && LastErrno() == ETIMEDOUT && sw.elapsed() < 0.01, "read after the deadline fails at once");
+    }
+    Expect(DeadlineScope::Remaining().count() == -1, "leaving the scope clears the deadline");
+    {
+        DeadlineScope outer(std::chrono::seconds(1));
+        int peer = sv[1];
+        iom->addTimer(std::chrono::milliseconds(10), [peer](){ char x = 'x'; ::write(peer, &x, 1); });
+        set_hook_enable(true);
+        ssize_t n = read(sv[0], &c, 1);
+        Expect(n == 1 && c == 'x', "read that completes before the deadline succeeds");
+        StopWatch sw;
+        {
+            DeadlineScope inner(std::chrono::milliseconds(30));
+            set_hook_enable(true);
+            unsigned left = sleep(5);
+            Expect(left > 0 && sw.elapsed() >= 0.029 && sw.elapsed() < 0.5, "sleep is cut short by the inner deadline");
+        }
+        Expect(DeadlineScope::Remaining() > std::chrono::milliseconds(500), "leaving the inner scope restores the outer deadline");
+    }
+    {
+        DeadlineScope deadline(std::chrono::milliseconds(30));
+        FiberSemaphore sem;
+        StopWatch sw;
+        Expect(sem.wait_interruptible() == ETIMEDOUT && sw.elapsed() >= 0.029, "semaphore wait times out at the deadline");
+    }
+    set_hook_enable(true);
+    close(sv[0]);
+    ::close(sv[1]);
+}
+
+// 检查中其他协程要访问的状态
+// 共享栈协程切出时栈帧会被拷走，同一块共享栈上的其他协程会覆盖它，这些状态不能放在检查协程的栈上
+struct WakeState
+{
+    FiberSemaphore done;
+    Channel<int> channel {2};
+    CancellationToken::ptr token {new CancellationToken};
+    int fd = -1;
+    ssize_t n = 0;
+    int err = 0;
+    int got = -1;
+};
+
+// 等待中被取消：只唤醒关联了令牌的协程
+static void check_cancel_while_waiting(bool shared)
+{
+    IOManager *iom = IOManager::GetThis();
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    FdMgr::GetInstance()->get(sv[0], true);
+    CancellationToken::ptr token(new CancellationToken);
+    iom->addTimer(std::chrono::milliseconds(20), [token](){ token->cancel(); });
+    {
+        CancellationScope scope(token);
+        StopWatch sw;
+        char c;
+        set_hook_enable(true);
+        ssize_t n = read(sv[0], &c, 1);
+        int err = LastErrno();
+        Expect(n == -1 && err == ECANCELED && sw.elapsed() >= 0.019, "cancel wakes a blocked read with ECANCELED");
+    }
+    set_hook_enable(true);
+    close(sv[0]);
+    ::close(sv[1]);
+
+    // 两个协程在同一个通道上接收，取消其中一个，数据交给另一个
+    std::shared_ptr<WakeState> state(new WakeState);
+    iom->schedule(Fiber::ptr(new Fiber([state](){
+        CancellationScope scope(state->token);
+        int v;
+        if(!state->channel.recv(v)) state->err = LastErrno();
+        state->done.post();
+    }, 0, true, shared)));
+    iom->schedule(Fiber::ptr(new Fiber([state](){
+        int v;
+        if(state->channel.recv(v)) state->got = v;
+        state->done.post();
+    }, 0, true, shared)));
+    set_hook_enable(true);
+    usleep(10000);
+    state->token->cancel();
+    Expect(WaitFor(state->done, std::chrono::seconds(1)) && state->err == ECANCELED,
+           "cancel wakes a channel receiver with ECANCELED");
+    state->channel.send(7);
+    Expect(WaitFor(state->done, std::chrono::seconds(1)) && state->got == 7,
+           "cancelling one receiver leaves the other one waiting");
+}
+
+// 关闭fd唤醒阻塞在它上面的IO，IO以EBADF失败
+static void check_close_wakes_io(bool shared)
+{
+    IOManager *iom = IOManager::GetThis();
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    FdMgr::GetInstance()->get(sv[0], true);
+    std::shared_ptr<WakeState> state(new WakeState);
+    state->fd = sv[0];
+    iom->schedule(Fiber::ptr(new Fiber([state](){
+        char c;
+        set_hook_enable(true);
+        state->n = read(state->fd, &c, 1);
+        state->err = LastErrno();
+        state->done.post();
+    }, 0, true, shared)));
+    set_hook_enable(true);
+    usleep(10000);
+    set_hook_enable(true);
+    close(sv[0]);
+    Expect(WaitFor(state->done, std::chrono::seconds(1)), "close wakes a read blocked on the fd");
+    Expect(state->n == -1 && state->err == EBADF, "read woken by close fails with EBADF");
+    ::close(sv[1]);
+}
+
+static void interrupt_checks(bool shared)
+{
+    check_cancel_before_wait();
+    check_deadline();
+    check_cancel_while_waiting(shared);
+    check_close_wakes_io(shared);
+}
+
+static const int RACE_WAITERS = 400;    // 每种竞争的等待者数量
+static const int RACE_SIGNALS = 200;    // 每种竞争的信号数量
+static const int RACE_SPREAD_US = 3000; // 取消和信号分散在这段时间内
+
+// 取消和post/send/notify竞争：被取消的等待者不能拿走信号，信号也不能丢
+static void interrupt_races()
+{
+    IOManager *iom = IOManager::GetThis();
+    FiberSemaphore done;
+    FiberSemaphore sem;
+    Channel<int> channel(RACE_SIGNALS);
+    FiberMutex mutex;
+    FiberCondVar cond;
+    int ready = 0;  // 条件变量保护的信号数量
+    std::atomic<int> acquired {0}, received {0}, consumed {0}, cancelled {0};
+    for(int i = 0; i < RACE_WAITERS; ++i)
+    {
+        auto delay = std::chrono::microseconds(i * 97 % RACE_SPREAD_US);
+        iom->schedule([&, delay](){
+            CancellationToken::ptr token(new CancellationToken);
+            IOManager::GetThis()->addTimer(delay, [token](){ token->cancel(); });
+            CancellationScope scope(token);
+            if(sem.wait_interruptible() == 0) ++acquired;
+            else ++cancelled;
+            int v;
+            if(channel.recv(v)) ++received;
+            else ++cancelled;
+            std::unique_lock<FiberMutex> lk(mutex);
+            while(ready == 0)
+            {
+                if(cond.wait_interruptible(lk) != 0) break;
+            }
+            Expect(lk.owns_lock(), "condvar wait returns with the lock held");
+            if(ready > 0)
+            {
+                --ready;
+                ++consumed;
+            }
+            else ++cancelled;
+            lk.unlock();
+            done.post();
+        });
+    }
+    for(int i = 0; i < RACE_SIGNALS; ++i)
+    {
+        auto delay = std::chrono::microseconds(i * 53 % RACE_SPREAD_US);
+        iom->addTimer(delay, [&, i](){
+            sem.post();
+            channel.try_send(i);
+            {
+                std::lock_guard<FiberMutex> lk(mutex);
+                ++ready;
+                cond.notify_one();
+            }
+            done.post();
+        });
+    }
+    // 等待者可能全部被取消提前结束，信号的定时器也要等到全部执行完，它们引用了这里的局部变量
+    bool finished = true;
+    for(int i = 0; i < RACE_WAITERS + RACE_SIGNALS; ++i)
+    {
+        finished = WaitFor(done, std::chrono::seconds(5)) && finished;
+    }
+    Expect(finished, "every racing waiter and signal finishes");
+    Expect(acquired + static_cast<int>(sem.getCount()) == RACE_SIGNALS, "semaphore posts are not lost to cancelled waiters");
+    Expect(received + static_cast<int>(channel.size()) == RACE_SIGNALS, "channel values are not lost to cancelled receivers");
+    Expect(consumed + ready == RACE_SIGNALS, "condvar signals are not lost to cancelled waiters");
+    Expect(acquired + received + consumed + cancelled == RACE_WAITERS * 3, "each wait either succeeds or is cancelled");
+}
+
+static void run_interrupt_checks(const IOManagerOptions &options, const char *name)
+{
+    int before = s_failures;
+    {
+        // 依次执行，关闭的fd值会被马上复用，同时执行的检查会互相干扰
+        IOManager iom(2, false, "interrupt", options);
+        FiberSemaphore done;
+        iom.schedule([&](){
+            interrupt_checks(false);
+            done.post();
+        });
+        iom.schedule([&](){
+            done.wait();
+            IOManager::GetThis()->schedule(Fiber::ptr(new Fiber([&](){
+                interrupt_checks(true);
+                done.post();
+            }, 0, true, true)));
+            done.wait();
+            interrupt_races();
+        });
+    }
+    int failures = s_failures - before;
+    cout << "interrupt checks, " << name << ": " << (failures ? "FAILED" : "ok") << endl;
+}
+
+void test_interrupt()
+{
+    IOManagerOptions options;
+    run_interrupt_checks(options, "epoll");
+    options.per_worker_epoll = true;
+    options.per_worker_timers = true;
+    run_interrupt_checks(options, "per-worker epoll");
+    options = IOManagerOptions();
+    options.use_io_uring = true;
+    run_interrupt_checks(options, "io_uring");
+}
+
+// ----------------定时器----------------
+// 等待外部线程添加的定时器触发，返回从添加到触发经过的秒数，2秒还没有触发返回-1
+static double WaitFired(const std::atomic<bool> &fired, const StopWatch &sw)
+{
+    while(!fired)
+    {
+        if(sw.elapsed() > 2) return -1;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return sw.elapsed();
+}
+
+// 从不是工作线程的线程添加定时器，等待ms之后触发，检查它按时触发
+static void check_timer_from_outside(IOManager &iom, std::chrono::milliseconds ms, const char *what)
+{
+    std::atomic<bool> fired {false};
+    StopWatch sw;
+    iom.addTimer(ms, [&fired](){ fired = true; });
+    double t = WaitFired(fired, sw);
+    double expect = std::chrono::duration<double>(ms).count();
+    Expect(t >= expect - 0.001 && t < expect + 0.3, what);
+}
+
+// 存储中的定时器全部触发或者取消之后，外部线程添加的定时器要通知空闲线程，不能等到epoll_wait的5秒超时
+static void check_timer_after_drain(IOManager &iom)
+{
+    check_timer_from_outside(iom, std::chrono::milliseconds(20), "timer added from outside fires on time");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));   // 工作线程回到epoll_wait
+    check_timer_from_outside(iom, std::chrono::milliseconds(100), "timer added after the store drained by firing fires on time");
+
+    Timer::ptr timer = iom.addTimer(std::chrono::milliseconds(20), [](){});
+    timer->cancel();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check_timer_from_outside(iom, std::chrono::milliseconds(100), "timer added after the store drained by cancel fires on time");
+}
+
+static void OnTimeoutFired(void *arg)
+{
+    static_cast<std::atomic<bool> *>(arg)->store(true);
+}
+
+// 从不是工作线程的线程启动超时节点，检查它按时触发
+static void check_timeout_from_outside(IOManager &iom, std::chrono::milliseconds ms, const char *what)
+{
+    TimeoutNode node;
+    std::atomic<bool> fired {false};
+    StopWatch sw;
+    iom.armTimeout(node, ms, OnTimeoutFired, &fired);
+    double t = WaitFired(fired, sw);
+    double expect = std::chrono::duration<double>(ms).count();
+    Expect(t >= expect - 0.001 && t < expect + 0.3, what);
+}
+
+// 超时节点总是放在时间轮中，默认配置下截止时间、hook的IO超时也会遇到时间轮空了之后不通知的问题
+static void check_timeout_after_drain(IOManager &iom)
+{
+    check_timeout_from_outside(iom, std::chrono::milliseconds(20), "timeout armed from outside fires on time");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check_timeout_from_outside(iom, std::chrono::milliseconds(100), "timeout armed after the wheel drained by firing fires on time");
+
+    TimeoutNode node;
+    iom.armTimeout(node, std::chrono::milliseconds(20), OnTimeoutFired, nullptr);
+    iom.disarmTimeout(node);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    check_timeout_from_outside(iom, std::chrono::milliseconds(100), "timeout armed after the wheel drained by disarm fires on time");
+}
+
+// 工作线程添加的定时器被外部线程取消和重置，分片模式下这些操作经过分片的收件箱
+static void check_timer_cross_thread(IOManager &iom)
+{
+    std::shared_ptr<std::atomic<int>> fired(new std::atomic<int>(0));
+    std::atomic<Timer *> added {nullptr};
+    Timer::ptr cancelled, reset;
+    std::mutex mutex;
+    iom.schedule([&, fired](){
+        std::lock_guard<std::mutex> lk(mutex);
+        cancelled = IOManager::GetThis()->addTimer(std::chrono::milliseconds(50), [fired](){ *fired += 1; });
+        reset = IOManager::GetThis()->addTimer(std::chrono::milliseconds(500), [fired](){ *fired += 10; });
+        added = reset.get();
+    });
+    while(!added) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    StopWatch sw;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        Expect(cancelled->cancel(), "timer is cancelled from another thread");
+        Expect(!cancelled->cancel(), "a cancelled timer cannot be cancelled again");
+        Expect(reset->reset(std::chrono::milliseconds(30), true), "timer is reset from another thread");
+    }
+    while(*fired < 10 && sw.elapsed() < 2) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double t = sw.elapsed();
+    Expect(*fired == 10 && t >= 0.029 && t < 0.3, "timer reset from another thread fires at the new time");
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    Expect(*fired == 10, "timer cancelled from another thread does not fire");
+    Expect(!reset->cancel(), "a fired timer cannot be cancelled");
+}
+
+// 有误差的定时器合并到桶中：不早于自己的到期时间触发，最多晚slack；桶中被取消的定时器不触发
+static void check_timer_slack(IOManager &iom)
+{
+    static const int COUNT = 20;
+    const std::chrono::milliseconds slack(20);
+    std::shared_ptr<std::atomic<int>> early(new std::atomic<int>(0));
+    std::shared_ptr<std::atomic<int>> late(new std::atomic<int>(0));
+    std::shared_ptr<std::atomic<int>> fired(new std::atomic<int>(0));
+    std::vector<Timer::ptr> timers;
+    for(int i = 0; i < COUNT; ++i)
+    {
+        auto us = std::chrono::milliseconds(30 + i);
+        auto due = std::chrono::steady_clock::now() + us;
+        timers.push_back(iom.addTimer(us, [=](){
+            auto now = std::chrono::steady_clock::now();
+            if(now < due) *early += 1;
+            if(now > due + slack + std::chrono::milliseconds(300)) *late += 1;
+            *fired += 1;
+        }, false, slack));
+    }
+    for(int i = 0; i < COUNT; i += 2)
+    {
+        timers[i]->cancel();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(30 + COUNT) + slack + std::chrono::milliseconds(100));
+    Expect(*fired == COUNT / 2, "cancelled timers in a slack bucket do not fire, the rest do");
+    Expect(*early == 0, "slack never fires a timer early");
+    Expect(*late == 0, "slack fires a timer within its slack");
+}
+
+static void run_timer_checks(const IOManagerOptions &options, const char *name)
+{
+    int before = s_failures;
+    {
+        IOManager iom(2, false, "timer", options);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));   // 工作线程进入idle
+        check_timer_after_drain(iom);
+        check_timeout_after_drain(iom);
+        check_timer_cross_thread(iom);
+        check_timer_slack(iom);
+    }
+    int failures = s_failures - before;
+    cout << "timer checks, " << name << ": " << (failures ? "FAILED" : "ok") << endl;
+}
+
+void test_timer_checks()
+{
+    IOManagerOptions options;
+    run_timer_checks(options, "default");
+    options.per_worker_timers = true;
+    run_timer_checks(options, "per-worker");
+    options = IOManagerOptions();
+    options.timer_wheel_tick = std::chrono::milliseconds(1);
+    run_timer_checks(options, "wheel");
+    options.per_worker_timers = true;
+    run_timer_checks(options, "per-worker wheel");
+}
+
+// 运行全部行为检查，返回失败的数量
+int run_checks()
+{
+    test_interrupt();
+    test_timer_checks();
+    return s_failures;
+}
+
 // ============== main ================
 
-int main()
+int main(int argc, char *argv[])
 {
+    if(argc > 1 && strcmp(argv[1], "check") == 0)
+    {
+        return run_checks() > 0 ? 1 : 0;
+    }
+
+
     // context_test();
 
     // testScheduler();